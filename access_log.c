@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "access_log.h"
+#include "metrics.h"
+
+#define RING_MASK (ACCESS_LOG_RING_SIZE - 1)
+
+/*
+ * A byte ring with one producer (its worker) and one consumer (the writer thread).
+ * head and tail only grow, their difference is the number of buffered bytes.
+   Each sits on a cache line of its own, so the worker and the writer do not bounce one line between them.
+ */
+struct log_ring {
+    size_t tail __attribute__((aligned(64))); // Written by the worker, released once a line is copied in
+    size_t head __attribute__((aligned(64))); // Written by the writer, released once a span is written out
+    char data[ACCESS_LOG_RING_SIZE] __attribute__((aligned(64)));
+};
+
+static int enabled;
+static enum access_log_format log_format;
+static const char *log_path;
+static int log_fd = -1;
+static int wake_fd = -1; // eventfd the writer sleeps on
+static int reopen_requested;
+static int stop_requested;
+static int write_failed; // Report a failing write once, not on every round
+static pthread_t writer_thread;
+
+static struct log_ring *rings[ACCESS_LOG_MAX_THREADS];
+static int ring_count;
+static __thread struct log_ring *local_ring;
+static __thread int ring_unavailable;
+
+// Per thread, so formatting the time costs one call to time() per request and gmtime_r() once a second
+static __thread time_t cached_second = -1;
+static __thread char common_time[32]; // 10/Oct/2000:13:55:36 +0000
+static __thread char iso_time[32];    // 2000-10-10T13:55:36Z
+
+int access_log_parse_format(const char *name, enum access_log_format *format) {
+    if (strcmp(name, "common") == 0) *format = ACCESS_LOG_COMMON;
+    else if (strcmp(name, "combined") == 0) *format = ACCESS_LOG_COMBINED;
+    else if (strcmp(name, "json") == 0) *format = ACCESS_LOG_JSON;
+    else return -1;
+    return 0;
+}
+
+static void wake_writer(void) {
+    uint64_t one = 1;
+    ssize_t ignored = write(wake_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+static int open_log(void) {
+    if (strcmp(log_path, "-") == 0) return STDOUT_FILENO;
+    return open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+static struct log_ring *ring_for_thread(void) {
+    if (local_ring || ring_unavailable) return local_ring;
+    struct log_ring *ring = aligned_alloc(64, sizeof(*ring));
+    int index = __atomic_fetch_add(&ring_count, 1, __ATOMIC_RELAXED);
+    if (!ring || index >= ACCESS_LOG_MAX_THREADS) {
+        free(ring);
+        ring_unavailable = 1;
+        return NULL;
+    }
+    ring->head = ring->tail = 0;
+    __atomic_store_n(&rings[index], ring, __ATOMIC_RELEASE);
+    local_ring = ring;
+    return ring;
+}
+
+// Copies one line in whole or, when the writer has fallen too far behind, drops it
+static void ring_push(struct log_ring *ring, const char *line, size_t length) {
+    size_t tail = ring->tail;
+    size_t used = tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (length > ACCESS_LOG_RING_SIZE - used) {
+        metrics_add(METRIC_ACCESS_LOG_DROPPED, 1);
+        return;
+    }
+    size_t offset = tail & RING_MASK;
+    size_t first = ACCESS_LOG_RING_SIZE - offset;
+    if (first > length) first = length;
+    memcpy(ring->data + offset, line, first);
+    memcpy(ring->data, line + first, length - first);
+    __atomic_store_n(&ring->tail, tail + length, __ATOMIC_RELEASE);
+
+    // The writer comes by every ACCESS_LOG_FLUSH_MS anyway, only a ring filling up fast is worth a wakeup
+    if (used < ACCESS_LOG_RING_SIZE / 2 && used + length >= ACCESS_LOG_RING_SIZE / 2) wake_writer();
+}
+
+/*
+ * Writes what every ring holds with one writev(), at most two pieces per ring since its bytes may wrap.
+ * Each head is only advanced past bytes the kernel took, so a worker never overwrites data still being written.
+ */
+static void drain_rings(void) {
+    struct iovec iov[2 * ACCESS_LOG_MAX_THREADS];
+    struct log_ring *owner[2 * ACCESS_LOG_MAX_THREADS];
+    int count = 0;
+    int ring_total = __atomic_load_n(&ring_count, __ATOMIC_RELAXED);
+    if (ring_total > ACCESS_LOG_MAX_THREADS) ring_total = ACCESS_LOG_MAX_THREADS;
+    for (int i = 0; i < ring_total; i++) {
+        struct log_ring *ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        if (!ring) continue;
+        size_t head = ring->head;
+        size_t length = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+        if (length == 0) continue;
+        size_t offset = head & RING_MASK;
+        size_t first = ACCESS_LOG_RING_SIZE - offset;
+        if (first > length) first = length;
+        iov[count] = (struct iovec){.iov_base = ring->data + offset, .iov_len = first};
+        owner[count++] = ring;
+        if (length > first) {
+            iov[count] = (struct iovec){.iov_base = ring->data, .iov_len = length - first};
+            owner[count++] = ring;
+        }
+    }
+
+    int index = 0;
+    while (index < count) {
+        int batch = count - index < IOV_MAX ? count - index : IOV_MAX;
+        ssize_t n = writev(log_fd, iov + index, batch);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            // The lines are lost either way, throw them away so the workers can keep logging
+            if (!write_failed) perror("Writing the access log failed");
+            write_failed = 1;
+            for (; index < count; index++) {
+                __atomic_store_n(&owner[index]->head, owner[index]->head + iov[index].iov_len, __ATOMIC_RELEASE);
+            }
+            return;
+        }
+        write_failed = 0;
+        while (n > 0) {
+            size_t taken = (size_t)n < iov[index].iov_len ? (size_t)n : iov[index].iov_len;
+            __atomic_store_n(&owner[index]->head, owner[index]->head + taken, __ATOMIC_RELEASE);
+            iov[index].iov_base = (char *)iov[index].iov_base + taken;
+            iov[index].iov_len -= taken;
+            n -= taken;
+            if (iov[index].iov_len == 0) index++;
+        }
+    }
+}
+
+static void reopen_log(void) {
+    if (log_fd == STDOUT_FILENO) return;
+    int fd = open_log();
+    if (fd < 0) {
+        perror("Reopening the access log failed, still writing to the old file");
+        return;
+    }
+    close(log_fd);
+    log_fd = fd;
+}
+
+static void *writer_run(void *arg) {
+    (void)arg;
+    struct pollfd wake = {.fd = wake_fd, .events = POLLIN};
+    for (;;) {
+        // Read before draining: once it is set the workers are done, so this round empties the rings for good
+        int stopping = __atomic_load_n(&stop_requested, __ATOMIC_ACQUIRE);
+        if (!stopping) poll(&wake, 1, ACCESS_LOG_FLUSH_MS);
+        uint64_t wakeups;
+        ssize_t ignored = read(wake_fd, &wakeups, sizeof(wakeups));
+        (void)ignored;
+
+        if (__atomic_exchange_n(&reopen_requested, 0, __ATOMIC_ACQ_REL)) {
+            // Lines from before the signal still belong in the old file
+            drain_rings();
+            reopen_log();
+        }
+        drain_rings();
+        if (stopping) return NULL;
+    }
+}
+
+int access_log_start(const char *path, enum access_log_format format) {
+    log_path = path;
+    log_format = format;
+    log_fd = open_log();
+    if (log_fd < 0) {
+        perror("Opening the access log failed");
+        return -1;
+    }
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        perror("eventfd failed");
+        if (log_fd != STDOUT_FILENO) close(log_fd);
+        return -1;
+    }
+    int error = pthread_create(&writer_thread, NULL, writer_run, NULL);
+    if (error) {
+        fprintf(stderr, "Starting the access log writer failed: %s\n", strerror(error));
+        close(wake_fd);
+        if (log_fd != STDOUT_FILENO) close(log_fd);
+        return -1;
+    }
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void access_log_reopen(void) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) return;
+    __atomic_store_n(&reopen_requested, 1, __ATOMIC_RELEASE);
+    wake_writer();
+}
+
+void access_log_stop(void) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) return;
+    __atomic_store_n(&enabled, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stop_requested, 1, __ATOMIC_RELEASE);
+    wake_writer();
+    pthread_join(writer_thread, NULL);
+    close(wake_fd);
+    if (log_fd != STDOUT_FILENO) close(log_fd);
+    wake_fd = log_fd = -1;
+}
+
+// A line being formatted. Whatever does not fit is cut, the newline always does.
+struct line {
+    char data[ACCESS_LOG_LINE_MAX];
+    size_t len;
+};
+
+/*
+ * Escaped request fields end here, the rest of the line is kept for what follows them: the status, byte and
+   duration numbers, field names, quotes and the closing brace, far less than LINE_TAIL_RESERVE bytes in every format.
+ */
+#define LINE_TAIL_RESERVE 256
+#define ESCAPED_LIMIT (ACCESS_LOG_LINE_MAX - 1 - LINE_TAIL_RESERVE)
+_Static_assert(ACCESS_LOG_LINE_MAX > 2 * LINE_TAIL_RESERVE, "Leave room for the request fields");
+
+static void put(struct line *line, const char *data, size_t length) {
+    size_t room = sizeof(line->data) - 1 - line->len;
+    if (length > room) length = room;
+    memcpy(line->data + line->len, data, length);
+    line->len += length;
+}
+
+static void put_string(struct line *line, const char *string) {
+    put(line, string, strlen(string));
+}
+
+static void put_number(struct line *line, uint64_t value) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[sizeof(digits) - 1 - count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    put(line, digits + sizeof(digits) - count, count);
+}
+
+/*
+ * Request fields come straight from the client, so they are escaped before they can break a line or a quoted field.
+ * Quotes and backslashes get a backslash, control and non-ASCII bytes become \xHH, or \u00HH in JSON,
+   which keeps every JSON line valid even when the bytes are not UTF-8.
+ * A field that does not fit is cut between two escapes and short of ESCAPED_LIMIT, so the fixed fields, quotes
+   and braces that follow always make it into the line.
+ */
+static void put_escaped(struct line *line, const char *data, size_t length, int json) {
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = data[i];
+        char escaped[6];
+        size_t escaped_len;
+        if (c == '"' || c == '\\') {
+            escaped[0] = '\\';
+            escaped[1] = c;
+            escaped_len = 2;
+        } else if ((c < 0x20 || c >= 0x7f) && json) {
+            memcpy(escaped, "\\u00", 4);
+            escaped[4] = hex[c >> 4];
+            escaped[5] = hex[c & 15];
+            escaped_len = 6;
+        } else if (c < 0x20 || c >= 0x7f) {
+            escaped[0] = '\\';
+            escaped[1] = 'x';
+            escaped[2] = hex[c >> 4];
+            escaped[3] = hex[c & 15];
+            escaped_len = 4;
+        } else {
+            escaped[0] = c;
+            escaped_len = 1;
+        }
+        if (line->len + escaped_len > ESCAPED_LIMIT) return;
+        memcpy(line->data + line->len, escaped, escaped_len);
+        line->len += escaped_len;
+    }
+}
+
+static void put_header(struct line *line, const struct http_request *request, const char *name, int json) {
+    const struct http_slice *value = request->have_request_line ? http_request_header(request, name) : NULL;
+    if (value) put_escaped(line, value->data, value->len, json);
+    else if (!json) put_string(line, "-");
+}
+
+// The client's address, looked up once per connection
+static const char *peer_address(struct connection *conn) {
+    if (conn->peer[0]) return conn->peer;
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    const char *text = NULL;
+    if (getpeername(conn->fd, (struct sockaddr *)&address, &length) == 0) {
+        if (address.ss_family == AF_INET) {
+            text = inet_ntop(AF_INET, &((struct sockaddr_in *)&address)->sin_addr, conn->peer, sizeof(conn->peer));
+        } else if (address.ss_family == AF_INET6) {
+            text = inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&address)->sin6_addr, conn->peer, sizeof(conn->peer));
+        }
+    }
+    if (!text) strcpy(conn->peer, "-");
+    return conn->peer;
+}
+
+static void update_time(void) {
+    time_t now = time(NULL);
+    if (now == cached_second) return;
+    static const char months[12][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                       "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    snprintf(common_time, sizeof(common_time), "%02d/%s/%04d:%02d:%02d:%02d +0000", tm.tm_mday, months[tm.tm_mon],
+             tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    strftime(iso_time, sizeof(iso_time), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    cached_second = now;
+}
+
+static void format_common(struct line *line, struct connection *conn, int combined) {
+    const struct http_request *request = &conn->io->parser;
+    put_string(line, peer_address(conn));
+    put_string(line, " - - [");
+    put_string(line, common_time);
+    put_string(line, "] \"");
+    if (request->have_request_line) {
+        put_escaped(line, request->method.data, request->method.len, 0);
+        put(line, " ", 1);
+        put_escaped(line, request->uri.data, request->uri.len, 0);
+        put(line, " ", 1);
+        put_escaped(line, request->version.data, request->version.len, 0);
+    } else {
+        put(line, "-", 1);
+    }
+    put_string(line, "\" ");
+    put_number(line, conn->status);
+    put(line, " ", 1);
+    put_number(line, conn->response_bytes);
+    if (combined) {
+        put_string(line, " \"");
+        put_header(line, request, "Referer", 0);
+        put_string(line, "\" \"");
+        put_header(line, request, "User-Agent", 0);
+        put(line, "\"", 1);
+    }
+}
+
+static void put_json_field(struct line *line, const char *name, const char *data, size_t length) {
+    put_string(line, ",\"");
+    put_string(line, name);
+    put_string(line, "\":\"");
+    put_escaped(line, data, length, 1);
+    put(line, "\"", 1);
+}
+
+static void format_json(struct line *line, struct connection *conn, uint64_t duration_ns) {
+    const struct http_request *request = &conn->io->parser;
+    put_string(line, "{\"time\":\"");
+    put_string(line, iso_time);
+    put_string(line, "\",\"remote\":\"");
+    put_string(line, peer_address(conn));
+    put(line, "\"", 1);
+    if (request->have_request_line) {
+        put_json_field(line, "method", request->method.data, request->method.len);
+        put_json_field(line, "uri", request->uri.data, request->uri.len);
+        put_json_field(line, "protocol", request->version.data, request->version.len);
+    }
+    put_string(line, ",\"status\":");
+    put_number(line, conn->status);
+    put_string(line, ",\"bytes\":");
+    put_number(line, conn->response_bytes);
+    put_string(line, ",\"duration_us\":");
+    put_number(line, duration_ns / 1000);
+    put_string(line, ",\"referer\":\"");
+    put_header(line, request, "Referer", 1);
+    put_string(line, "\",\"user_agent\":\"");
+    put_header(line, request, "User-Agent", 1);
+    put_string(line, "\"}");
+}
+
+void access_log_record(struct connection *conn, uint64_t duration_ns) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) return;
+    struct log_ring *ring = ring_for_thread();
+    if (!ring) {
+        metrics_add(METRIC_ACCESS_LOG_DROPPED, 1);
+        return;
+    }
+
+    update_time();
+    struct line line;
+    line.len = 0;
+    if (log_format == ACCESS_LOG_JSON) format_json(&line, conn, duration_ns);
+    else format_common(&line, conn, log_format == ACCESS_LOG_COMBINED);
+    line.data[line.len++] = '\n';
+    ring_push(ring, line.data, line.len);
+}
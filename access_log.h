@@ -0,0 +1,44 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdint.h>
+
+#include "event_loop.h"
+
+#define ACCESS_LOG_RING_SIZE (1 << 20) // Bytes of log lines each thread can buffer, a power of two
+#define ACCESS_LOG_LINE_MAX 2048       // Longer lines are cut
+#define ACCESS_LOG_MAX_THREADS 256     // Requests of threads beyond this are not logged
+#define ACCESS_LOG_FLUSH_MS 100        // The writer wakes at least this often while lines are waiting
+
+enum access_log_format {
+    ACCESS_LOG_COMMON,   // host - - [time] "request line" status bytes
+    ACCESS_LOG_COMBINED, // common plus "referer" "user agent"
+    ACCESS_LOG_JSON      // One JSON object per line, with the request duration as well
+};
+
+// Reads "common", "combined" or "json". Returns 0, or -1 for an unknown name.
+int access_log_parse_format(const char *name, enum access_log_format *format);
+
+/*
+ * Opens path for appending ("-" for stdout) and starts the writer thread.
+ * Workers only copy each line into a ring buffer of their own, the writer thread empties every ring
+   with one writev() per round, so a worker never waits for stdio locks or the disk.
+ * When a ring is full because the disk falls behind, lines are dropped and counted as
+   access_log_dropped_total on /metrics instead of slowing the workers down.
+ * Returns 0, or -1 if the file cannot be opened or the thread not started.
+ */
+int access_log_start(const char *path, enum access_log_format format);
+
+/*
+ * Logs the response just sent on conn, which took duration_ns from the end of parsing.
+ * Called by the event loop for every completed response, does nothing unless the log was started.
+ */
+void access_log_record(struct connection *conn, uint64_t duration_ns);
+
+// Makes the writer reopen the file, e.g. after logrotate moved it. Async-signal-safe, for a SIGHUP handler.
+void access_log_reopen(void);
+
+// Writes out every buffered line, stops the writer thread and closes the file. Call once the workers have stopped.
+void access_log_stop(void);
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "admission.h"
+#include "metrics.h"
+
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x) // Expands x first
+#define BUSY_BODY "The server is busy, please try again shortly.\n"
+
+static const char busy_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Type: text/plain; charset=utf-8\r\n"
+    "Retry-After: " TO_STRING(ADMISSION_RETRY_AFTER) "\r\n"
+    "Cache-Control: no-store\r\n"
+    "Connection: close\r\n"
+    "Content-Length: 46\r\n"
+    "\r\n" BUSY_BODY;
+_Static_assert(sizeof(BUSY_BODY) - 1 == 46, "Content-Length must match the body");
+
+static int max_connections;
+static int max_per_address;
+
+// Shared by every worker, but only touched on accept and close, never per request
+static int open_connections;
+static int address_connections[ADMISSION_IP_SLOTS];
+
+void admission_set_limits(int connections, int per_address) {
+    max_connections = connections > 0 ? connections : 0;
+    max_per_address = per_address > 0 ? per_address : 0;
+}
+
+// Hashes the client's address (IPv4-mapped IPv6 addresses as the IPv4 address) to its slot, or returns -1
+static int address_slot(int fd) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if (getpeername(fd, (struct sockaddr *)&address, &length) < 0) return -1;
+
+    const unsigned char *bytes;
+    size_t count;
+    if (address.ss_family == AF_INET) {
+        bytes = (const unsigned char *)&((struct sockaddr_in *)&address)->sin_addr;
+        count = 4;
+    } else if (address.ss_family == AF_INET6) {
+        const struct in6_addr *in6 = &((struct sockaddr_in6 *)&address)->sin6_addr;
+        bytes = in6->s6_addr;
+        count = 16;
+        if (IN6_IS_ADDR_V4MAPPED(in6)) {
+            bytes += 12;
+            count = 4;
+        }
+    } else {
+        return -1;
+    }
+
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (size_t i = 0; i < count; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return (int)(hash >> 32) & (ADMISSION_IP_SLOTS - 1);
+}
+
+// Takes one from counter unless that passes limit
+static int acquire(int *counter, int limit) {
+    if (__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED) <= limit) return 1;
+    __atomic_sub_fetch(counter, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Any request bytes that already arrived are read first: closing a socket with unread data makes the
+   kernel reset the connection, and the client could lose the 503 before reading it.
+ */
+static void reject(int fd, enum metrics_counter reason) {
+    char discard[512];
+    while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+    }
+    ssize_t ignored = send(fd, busy_response, sizeof(busy_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    (void)ignored;
+    close(fd);
+    metrics_add(reason, 1);
+}
+
+int admission_admit(int fd, int *slot) {
+    *slot = -1;
+    if (max_connections && !acquire(&open_connections, max_connections)) {
+        reject(fd, METRIC_REJECTED_CONNECTIONS);
+        return 0;
+    }
+    if (max_per_address) {
+        int index = address_slot(fd);
+        if (index >= 0 && !acquire(&address_connections[index], max_per_address)) {
+            if (max_connections) __atomic_sub_fetch(&open_connections, 1, __ATOMIC_RELAXED);
+            reject(fd, METRIC_REJECTED_PER_ADDRESS);
+            return 0;
+        }
+        *slot = index;
+    }
+    return 1;
+}
+
+void admission_release(int slot) {
+    if (max_connections) __atomic_sub_fetch(&open_connections, 1, __ATOMIC_RELAXED);
+    if (slot >= 0) __atomic_sub_fetch(&address_connections[slot], 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,23 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#define ADMISSION_IP_SLOTS 4096  // Per-address counters, a power of two. Addresses hashing to one slot share its limit
+#define ADMISSION_RETRY_AFTER 1  // Seconds a rejected client is asked to wait before trying again
+
+/*
+ * Sets the most connections open at once over all workers, and the most from one client address.
+ * 0 leaves a limit off, which is the default. Call before any event loop starts.
+ */
+void admission_set_limits(int max_connections, int max_per_address);
+
+/*
+ * Checks a client the event loop just accepted against the limits. Called for every accepted socket.
+ * Returns 1 when it is admitted; *slot must then be handed to admission_release() once the connection closes.
+ * Returns 0 when a limit is reached. The client was then sent a canned 503 with Retry-After and fd is closed,
+   so an overloaded server spends one send() on the clients it turns away and keeps serving the others.
+ */
+int admission_admit(int fd, int *slot);
+
+void admission_release(int slot);
+
+#endif
@@ -0,0 +1,639 @@
+#define _GNU_SOURCE // For memmem()
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "hdr_histogram.h"
+
+#define MAX_TARGETS 32
+#define MAX_PIPELINE 64
+#define MAX_THREADS 256
+#define RESPONSE_HEADER_SIZE 8192
+#define READ_BUFFER_SIZE 65536
+#define LATENCY_HIGHEST_US 60000000 // Slower responses are recorded as 60 s
+#define LATENCY_SIGNIFICANT_FIGURES 3
+#define TICK_MS 100 // How often each thread checks the clock when the server is quiet
+
+// A URL path to request and how often, relative to the other targets
+struct target {
+    const char *path;
+    unsigned weight;
+    char *request;
+    size_t request_len;
+};
+
+struct options {
+    const char *host;
+    const char *port;
+    int connections;
+    int threads;
+    double duration;
+    double warmup;
+    double timeout;
+    int keep_alive;
+    int pipeline;
+    const char *label;
+    const char *output;
+    struct target targets[MAX_TARGETS];
+    int target_count;
+    unsigned weight_total;
+};
+
+static struct options options = {
+    .host = "127.0.0.1",
+    .port = "8080",
+    .connections = 64,
+    .duration = 10,
+    .warmup = 1,
+    .timeout = 5,
+    .keep_alive = 1,
+    .pipeline = 1,
+    .label = "",
+};
+
+static struct sockaddr_storage server_address;
+static socklen_t server_address_len;
+
+enum response_state {
+    RESPONSE_HEADER,
+    RESPONSE_BODY,
+    RESPONSE_BODY_UNTIL_CLOSE, // No Content-Length, the server closes the connection after the body
+};
+
+/*
+ * One client connection. Up to options.pipeline requests are in flight, their send times wait in sent_at
+   in order, as responses come back in the same order.
+ */
+struct client {
+    int fd;
+    int connecting;
+    double last_activity;
+    int in_flight;
+    int first_in_flight;
+    double sent_at[MAX_PIPELINE];
+    char output[MAX_PIPELINE * 512];
+    size_t output_len;
+    size_t output_sent;
+    enum response_state state;
+    char header[RESPONSE_HEADER_SIZE];
+    size_t header_len;
+    long long body_remaining;
+    int status;
+    int closes; // The response carries Connection: close
+};
+
+struct statistics {
+    unsigned long requests;
+    unsigned long long bytes;
+    unsigned long status[6]; // By first digit, 0 for anything else
+    unsigned long connect_errors;
+    unsigned long read_errors;
+    unsigned long parse_errors;
+    unsigned long timeouts;
+    struct hdr_histogram latency; // Microseconds
+};
+
+struct worker {
+    pthread_t thread;
+    int epoll_fd;
+    int client_count;
+    struct client *clients;
+    unsigned long long random;
+    struct statistics statistics;
+};
+
+static double start_time, measure_from, stop_at;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, each thread has its own state so picking a target needs no lock
+static unsigned long long next_random(struct worker *worker) {
+    worker->random ^= worker->random >> 12;
+    worker->random ^= worker->random << 25;
+    worker->random ^= worker->random >> 27;
+    return worker->random * 0x2545f4914f6cdd1dull;
+}
+
+static const struct target *pick_target(struct worker *worker) {
+    if (options.target_count == 1) return &options.targets[0];
+    unsigned pick = next_random(worker) % options.weight_total;
+    for (int i = 0; i < options.target_count; i++) {
+        if (pick < options.targets[i].weight) return &options.targets[i];
+        pick -= options.targets[i].weight;
+    }
+    return &options.targets[options.target_count - 1];
+}
+
+static int counting(double time) {
+    return time >= measure_from && time < stop_at;
+}
+
+static void client_close(struct worker *worker, struct client *client) {
+    if (client->fd >= 0) {
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+        close(client->fd);
+    }
+    client->fd = -1;
+    client->in_flight = 0;
+    client->first_in_flight = 0;
+    client->output_len = 0;
+    client->output_sent = 0;
+    client->state = RESPONSE_HEADER;
+    client->header_len = 0;
+}
+
+// Queues requests until the pipeline is full, with a single one per connection without keep-alive
+static void client_fill(struct worker *worker, struct client *client) {
+    int depth = options.keep_alive ? options.pipeline : 1;
+    double time = now();
+    if (time >= stop_at) return;
+    if (!options.keep_alive && client->in_flight > 0) return;
+    if (client->in_flight == 0) client->last_activity = time; // The timeout starts with the first request
+    while (client->in_flight < depth) {
+        const struct target *target = pick_target(worker);
+        if (client->output_len + target->request_len > sizeof(client->output)) break;
+        memcpy(client->output + client->output_len, target->request, target->request_len);
+        client->output_len += target->request_len;
+        client->sent_at[(client->first_in_flight + client->in_flight) % MAX_PIPELINE] = time;
+        client->in_flight++;
+    }
+}
+
+static int client_connect(struct worker *worker, struct client *client) {
+    client->fd = socket(server_address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (client->fd < 0) {
+        worker->statistics.connect_errors++;
+        return -1;
+    }
+    int one = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    client->connecting = 1;
+    client->last_activity = now();
+    if (connect(client->fd, (struct sockaddr *)&server_address, server_address_len) < 0 && errno != EINPROGRESS) {
+        worker->statistics.connect_errors++;
+        close(client->fd);
+        client->fd = -1;
+        return -1;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = client};
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client->fd, &event) < 0) {
+        worker->statistics.connect_errors++;
+        client_close(worker, client);
+        return -1;
+    }
+    client_fill(worker, client);
+    return 0;
+}
+
+static void client_reconnect(struct worker *worker, struct client *client) {
+    client_close(worker, client);
+    if (now() < stop_at) client_connect(worker, client);
+}
+
+static int client_flush(struct worker *worker, struct client *client) {
+    while (client->output_sent < client->output_len) {
+        ssize_t n = send(client->fd, client->output + client->output_sent, client->output_len - client->output_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (counting(now())) worker->statistics.read_errors++;
+            return -1;
+        }
+        client->output_sent += n;
+    }
+    client->output_len = 0;
+    client->output_sent = 0;
+    return 0;
+}
+
+// Reads the status code, Content-Length and Connection of the response header in client->header
+static int parse_header(struct client *client) {
+    char *header = client->header;
+    if (client->header_len < 12 || strncmp(header, "HTTP/1.", 7) != 0) return -1;
+    client->status = atoi(header + 9);
+    client->body_remaining = -1;
+    client->closes = header[7] == '0'; // HTTP/1.0 closes unless told otherwise
+
+    char *line = strstr(header, "\r\n");
+    while (line && line[2] != '\r') {
+        line += 2;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            client->body_remaining = atoll(line + 15);
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            const char *value = line + 11;
+            while (*value == ' ') value++;
+            if (strncasecmp(value, "close", 5) == 0) client->closes = 1;
+            if (strncasecmp(value, "keep-alive", 10) == 0) client->closes = 0;
+        }
+        line = strstr(line, "\r\n");
+    }
+
+    // 1xx, 204 and 304 never have a body
+    if (client->status < 200 || client->status == 204 || client->status == 304) client->body_remaining = 0;
+    client->state = client->body_remaining >= 0 ? RESPONSE_BODY : RESPONSE_BODY_UNTIL_CLOSE;
+    return 0;
+}
+
+static void response_done(struct worker *worker, struct client *client) {
+    double time = now();
+    double sent_at = client->sent_at[client->first_in_flight];
+    client->first_in_flight = (client->first_in_flight + 1) % MAX_PIPELINE;
+    client->in_flight--;
+    client->state = RESPONSE_HEADER;
+    client->header_len = 0;
+
+    if (counting(time)) {
+        struct statistics *statistics = &worker->statistics;
+        statistics->requests++;
+        statistics->status[client->status >= 100 && client->status < 600 ? client->status / 100 : 0]++;
+        hdr_record(&statistics->latency, (int64_t)((time - sent_at) * 1e6));
+    }
+}
+
+/*
+ * Consumes length bytes of response data. Returns 1 when the connection must be opened again
+   (the server announced it closes, or the exchange without keep-alive is over), -1 on a broken response.
+ */
+static int client_consume(struct worker *worker, struct client *client, const char *data, size_t length) {
+    while (length > 0) {
+        if (client->in_flight == 0) return -1; // Data nobody asked for
+
+        if (client->state == RESPONSE_HEADER) {
+            size_t old_len = client->header_len;
+            size_t take = sizeof(client->header) - 1 - old_len;
+            if (take > length) take = length;
+            memcpy(client->header + old_len, data, take);
+            client->header_len += take;
+            client->header[client->header_len] = '\0';
+
+            size_t search_from = old_len > 3 ? old_len - 3 : 0;
+            char *end = memmem(client->header + search_from, client->header_len - search_from, "\r\n\r\n", 4);
+            if (!end) {
+                if (client->header_len == sizeof(client->header) - 1) return -1;
+                return 0; // take was the whole of length
+            }
+            size_t header_len = end + 4 - client->header;
+            size_t used = header_len - old_len;
+            client->header_len = header_len;
+            if (parse_header(client) < 0) return -1;
+            data += used;
+            length -= used;
+            if (client->state == RESPONSE_BODY && client->body_remaining == 0) {
+                response_done(worker, client);
+                if (client->closes || !options.keep_alive) return 1;
+            }
+            continue;
+        }
+
+        if (client->state == RESPONSE_BODY_UNTIL_CLOSE) return 0; // Finished by the end of the stream
+
+        size_t take = length < (size_t)client->body_remaining ? length : (size_t)client->body_remaining;
+        client->body_remaining -= take;
+        data += take;
+        length -= take;
+        if (client->body_remaining == 0) {
+            response_done(worker, client);
+            if (client->closes || !options.keep_alive) return 1;
+        }
+    }
+    return 0;
+}
+
+static void client_readable(struct worker *worker, struct client *client) {
+    static __thread char buffer[READ_BUFFER_SIZE];
+    for (;;) {
+        ssize_t n = recv(client->fd, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+            if (counting(now())) worker->statistics.bytes += n;
+            client->last_activity = now();
+            int result = client_consume(worker, client, buffer, n);
+            if (result < 0) {
+                if (counting(now())) worker->statistics.parse_errors++;
+                client_reconnect(worker, client);
+                return;
+            }
+            if (result > 0) {
+                client_reconnect(worker, client);
+                return;
+            }
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+        // The server closed the connection (or reset it)
+        if (n == 0 && client->state == RESPONSE_BODY_UNTIL_CLOSE) {
+            response_done(worker, client);
+        } else if (client->in_flight > 0 && counting(now())) {
+            worker->statistics.read_errors++;
+        }
+        client_reconnect(worker, client);
+        return;
+    }
+
+    // A response finished without closing the connection, send the next requests
+    client_fill(worker, client);
+    if (client_flush(worker, client) < 0) client_reconnect(worker, client);
+}
+
+static void client_event(struct worker *worker, struct client *client, unsigned events) {
+    if (client->connecting) {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+        if (error) {
+            if (counting(now())) worker->statistics.connect_errors++;
+            client_reconnect(worker, client);
+            return;
+        }
+        if (!(events & (EPOLLOUT | EPOLLIN))) return;
+        client->connecting = 0;
+    }
+    if (events & EPOLLOUT) {
+        if (client_flush(worker, client) < 0) {
+            client_reconnect(worker, client);
+            return;
+        }
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) client_readable(worker, client);
+}
+
+// Connections without progress for options.timeout seconds count as timed out and start over
+static void check_timeouts(struct worker *worker, double time) {
+    for (int i = 0; i < worker->client_count; i++) {
+        struct client *client = &worker->clients[i];
+        if (client->fd >= 0 && client->in_flight > 0 && time - client->last_activity > options.timeout) {
+            if (counting(time)) worker->statistics.timeouts++;
+            client_reconnect(worker, client);
+        } else if (client->fd < 0 && time < stop_at) {
+            client_connect(worker, client); // Connecting failed before, try again
+        }
+    }
+}
+
+static void *worker_run(void *arg) {
+    struct worker *worker = arg;
+    struct epoll_event events[256];
+
+    for (int i = 0; i < worker->client_count; i++) {
+        worker->clients[i].fd = -1;
+        client_connect(worker, &worker->clients[i]);
+    }
+
+    double last_check = now();
+    for (;;) {
+        int count = epoll_wait(worker->epoll_fd, events, 256, TICK_MS);
+        for (int i = 0; i < count; i++) {
+            struct client *client = events[i].data.ptr;
+            if (client->fd >= 0) client_event(worker, client, events[i].events);
+        }
+        double time = now();
+        if (time >= stop_at) break;
+        if (time - last_check >= TICK_MS / 1000.0) {
+            check_timeouts(worker, time);
+            last_check = time;
+        }
+    }
+
+    for (int i = 0; i < worker->client_count; i++) {
+        client_close(worker, &worker->clients[i]);
+    }
+    return NULL;
+}
+
+static int add_target(const char *argument) {
+    if (options.target_count == MAX_TARGETS) return -1;
+    struct target *target = &options.targets[options.target_count];
+    char *path = strdup(argument);
+    if (!path || path[0] != '/') return -1;
+
+    // "path:weight", a path may itself contain ':', only a numeric suffix is a weight
+    target->weight = 1;
+    char *colon = strrchr(path, ':');
+    if (colon && colon[1] && strspn(colon + 1, "0123456789") == strlen(colon + 1)) {
+        target->weight = atoi(colon + 1);
+        *colon = '\0';
+    }
+    if (target->weight == 0) return -1;
+    target->path = path;
+    options.target_count++;
+    options.weight_total += target->weight;
+    return 0;
+}
+
+static int prepare_requests(void) {
+    for (int i = 0; i < options.target_count; i++) {
+        struct target *target = &options.targets[i];
+        char request[512];
+        int length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s:%s\r\n%s\r\n", target->path,
+                              options.host, options.port, options.keep_alive ? "" : "Connection: close\r\n");
+        if (length >= (int)sizeof(request)) return -1;
+        target->request = strdup(request);
+        target->request_len = length;
+        if (!target->request) return -1;
+    }
+    return 0;
+}
+
+static int resolve(void) {
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *result;
+    int status = getaddrinfo(options.host, options.port, &hints, &result);
+    if (status != 0) {
+        fprintf(stderr, "Cannot resolve %s: %s\n", options.host, gai_strerror(status));
+        return -1;
+    }
+    memcpy(&server_address, result->ai_addr, result->ai_addrlen);
+    server_address_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+static void print_results(const struct statistics *total, double elapsed) {
+    const struct hdr_histogram *latency = &total->latency;
+    printf("\n%-12s %lu (%.1f/s)\n", "Requests:", total->requests, total->requests / elapsed);
+    printf("%-12s %.2f MB (%.2f MB/s)\n", "Transfer:", total->bytes / 1e6, total->bytes / 1e6 / elapsed);
+    printf("%-12s p50 %lld us, p90 %lld us, p99 %lld us, p99.9 %lld us, max %lld us, mean %.1f us\n", "Latency:",
+           (long long)hdr_value_at_percentile(latency, 50), (long long)hdr_value_at_percentile(latency, 90),
+           (long long)hdr_value_at_percentile(latency, 99), (long long)hdr_value_at_percentile(latency, 99.9),
+           (long long)(latency->total ? latency->max : 0), hdr_mean(latency));
+    printf("%-12s 2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu, other %lu\n", "Status:", total->status[2], total->status[3],
+           total->status[4], total->status[5], total->status[0] + total->status[1]);
+    printf("%-12s connect %lu, read %lu, parse %lu, timeout %lu\n", "Errors:", total->connect_errors,
+           total->read_errors, total->parse_errors, total->timeouts);
+}
+
+// Appends the run as one JSON object per line, so results of many runs and versions can be compared
+static int write_results(const struct statistics *total, double elapsed) {
+    FILE *file = fopen(options.output, "a");
+    if (!file) {
+        perror(options.output);
+        return -1;
+    }
+    const struct hdr_histogram *latency = &total->latency;
+    fprintf(file, "{\"label\":\"%s\",\"time\":%lld,\"host\":\"%s\",\"port\":\"%s\",\"threads\":%d,\"connections\":%d,"
+                  "\"keep_alive\":%s,\"pipeline\":%d,\"duration\":%.3f,\"targets\":[",
+            options.label, (long long)time(NULL), options.host, options.port, options.threads, options.connections,
+            options.keep_alive ? "true" : "false", options.pipeline, elapsed);
+    for (int i = 0; i < options.target_count; i++) {
+        fprintf(file, "%s{\"path\":\"%s\",\"weight\":%u}", i ? "," : "", options.targets[i].path, options.targets[i].weight);
+    }
+    fprintf(file, "],\"requests\":%lu,\"requests_per_sec\":%.1f,\"bytes\":%llu,\"bytes_per_sec\":%.1f,"
+                  "\"latency_us\":{\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"p99_9\":%lld,\"max\":%lld,\"mean\":%.1f},"
+                  "\"status\":{\"2xx\":%lu,\"3xx\":%lu,\"4xx\":%lu,\"5xx\":%lu,\"other\":%lu},"
+                  "\"errors\":{\"connect\":%lu,\"read\":%lu,\"parse\":%lu,\"timeout\":%lu}}\n",
+            total->requests, total->requests / elapsed, total->bytes, total->bytes / elapsed,
+            (long long)hdr_value_at_percentile(latency, 50), (long long)hdr_value_at_percentile(latency, 90),
+            (long long)hdr_value_at_percentile(latency, 99), (long long)hdr_value_at_percentile(latency, 99.9),
+            (long long)(latency->total ? latency->max : 0), hdr_mean(latency), total->status[2], total->status[3],
+            total->status[4], total->status[5], total->status[0] + total->status[1], total->connect_errors,
+            total->read_errors, total->parse_errors, total->timeouts);
+    fclose(file);
+    return 0;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] [path[:weight] ...]\n", program);
+    fprintf(stderr, "  -H host           server address (default: %s)\n", options.host);
+    fprintf(stderr, "  -p port           server port (default: %s)\n", options.port);
+    fprintf(stderr, "  -c connections    concurrent connections (default: %d)\n", options.connections);
+    fprintf(stderr, "  -t threads        client threads (default: one per CPU, at most one per connection)\n");
+    fprintf(stderr, "  -d seconds        measured duration (default: %g)\n", options.duration);
+    fprintf(stderr, "  -w seconds        warm-up before measuring (default: %g)\n", options.warmup);
+    fprintf(stderr, "  -T seconds        a request without progress for this long is a timeout (default: %g)\n", options.timeout);
+    fprintf(stderr, "  -n                no keep-alive: one request per connection\n");
+    fprintf(stderr, "  -P depth          pipeline this many requests per connection (default: 1)\n");
+    fprintf(stderr, "  -l label          name of the run in the results, e.g. a version\n");
+    fprintf(stderr, "  -o file           append the results as a JSON line to file\n");
+    fprintf(stderr, "Paths default to /. A weight makes a path that many times as likely as one of weight 1,\n"
+                    "e.g. /index.html:8 /big.bin:1 for a mix of small and large files.\n");
+}
+
+int main(int argc, char *argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "H:p:c:t:d:w:T:nP:l:o:")) != -1) {
+        switch (option) {
+        case 'H':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = optarg;
+            break;
+        case 'c':
+            options.connections = atoi(optarg);
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            break;
+        case 'd':
+            options.duration = atof(optarg);
+            break;
+        case 'w':
+            options.warmup = atof(optarg);
+            break;
+        case 'T':
+            options.timeout = atof(optarg);
+            break;
+        case 'n':
+            options.keep_alive = 0;
+            break;
+        case 'P':
+            options.pipeline = atoi(optarg);
+            break;
+        case 'l':
+            options.label = optarg;
+            break;
+        case 'o':
+            options.output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        if (add_target(argv[i]) < 0) {
+            fprintf(stderr, "Bad path %s, it must start with / and may end with :weight (at most %d paths)\n", argv[i], MAX_TARGETS);
+            return 1;
+        }
+    }
+    if (options.target_count == 0) add_target("/");
+
+    if (options.threads <= 0) options.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (options.threads > MAX_THREADS) options.threads = MAX_THREADS;
+    if (options.threads > options.connections) options.threads = options.connections;
+    if (options.connections <= 0 || options.duration <= 0 || options.pipeline < 1 || options.pipeline > MAX_PIPELINE) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!options.keep_alive) options.pipeline = 1;
+    if (resolve() < 0 || prepare_requests() < 0) return 1;
+
+    printf("%gs run against %s:%s, %d threads, %d connections, %s", options.duration, options.host, options.port,
+           options.threads, options.connections, options.keep_alive ? "keep-alive" : "a new connection per request");
+    if (options.pipeline > 1) printf(", pipeline depth %d", options.pipeline);
+    printf("\n");
+    for (int i = 0; i < options.target_count; i++) {
+        printf("  %s (%.0f%%)\n", options.targets[i].path, 100.0 * options.targets[i].weight / options.weight_total);
+    }
+
+    struct worker *workers = calloc(options.threads, sizeof(*workers));
+    if (!workers) return 1;
+    start_time = now();
+    measure_from = start_time + options.warmup;
+    stop_at = measure_from + options.duration;
+
+    for (int i = 0; i < options.threads; i++) {
+        struct worker *worker = &workers[i];
+        worker->client_count = options.connections / options.threads + (i < options.connections % options.threads);
+        worker->clients = calloc(worker->client_count, sizeof(*worker->clients));
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        worker->random = 0x9e3779b97f4a7c15ull * (i + 1);
+        if (!worker->clients || worker->epoll_fd < 0 ||
+            hdr_init(&worker->statistics.latency, LATENCY_HIGHEST_US, LATENCY_SIGNIFICANT_FIGURES) < 0 ||
+            pthread_create(&worker->thread, NULL, worker_run, worker) != 0) {
+            perror("Starting the client threads failed");
+            return 1;
+        }
+    }
+
+    struct statistics total;
+    memset(&total, 0, sizeof(total));
+    hdr_init(&total.latency, LATENCY_HIGHEST_US, LATENCY_SIGNIFICANT_FIGURES);
+    for (int i = 0; i < options.threads; i++) {
+        struct worker *worker = &workers[i];
+        pthread_join(worker->thread, NULL);
+        const struct statistics *statistics = &worker->statistics;
+        total.requests += statistics->requests;
+        total.bytes += statistics->bytes;
+        for (int j = 0; j < 6; j++) total.status[j] += statistics->status[j];
+        total.connect_errors += statistics->connect_errors;
+        total.read_errors += statistics->read_errors;
+        total.parse_errors += statistics->parse_errors;
+        total.timeouts += statistics->timeouts;
+        hdr_add(&total.latency, &statistics->latency);
+        hdr_free(&worker->statistics.latency);
+        close(worker->epoll_fd);
+        free(worker->clients);
+    }
+    free(workers);
+
+    print_results(&total, options.duration);
+    if (options.output && write_results(&total, options.duration) < 0) return 1;
+    hdr_free(&total.latency);
+    return 0;
+}
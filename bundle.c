@@ -0,0 +1,181 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "bundle.h"
+#include "http_header.h"
+#include "http_range.h"
+
+// The open bundle, shared read-only by every worker
+static const char *map;
+static uint64_t map_size;
+static int bundle_fd = -1; // For sendfile() of large bodies
+static const struct bundle_entry *entries;
+static const uint32_t *index_slots;
+static uint32_t index_mask;
+
+// Whether length bytes at offset lie inside the bundle, without overflowing
+static int inside(uint64_t offset, uint64_t length) {
+    return offset <= map_size && length <= map_size - offset;
+}
+
+static int valid_body(const struct bundle_body *body) {
+    return inside(body->header_offset, body->header_len) && inside(body->not_modified_offset, body->not_modified_len) &&
+           inside(body->data_offset, body->data_len) && body->validators.etag_len < ETAG_SIZE &&
+           body->validators.last_modified_len < HTTP_DATE_SIZE;
+}
+
+static int valid_entry(const struct bundle_entry *entry) {
+    if (!inside(entry->path_offset, (uint64_t)entry->path_len + 1) || map[entry->path_offset + entry->path_len] != '\0') return 0;
+    if (!inside(entry->mime_offset, 1) || !memchr(map + entry->mime_offset, '\0', map_size - entry->mime_offset)) return 0;
+    if (entry->hash != bundle_hash(map + entry->path_offset, entry->path_len)) return 0;
+    if (entry->identity.header_len == 0 || !valid_body(&entry->identity)) return 0;
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        if (entry->variants[i].header_len && !valid_body(&entry->variants[i])) return 0;
+    }
+    return 1;
+}
+
+static int valid_bundle(const struct bundle_header *header) {
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 || header->size != map_size) return 0;
+    uint32_t slots = header->index_slots;
+    if (slots == 0 || (slots & (slots - 1)) || slots / 2 < header->entry_count) return 0;
+    if (header->entries_offset % _Alignof(struct bundle_entry) || header->index_offset % _Alignof(uint32_t)) return 0;
+    if (!inside(header->entries_offset, (uint64_t)header->entry_count * sizeof(struct bundle_entry)) ||
+        !inside(header->index_offset, (uint64_t)slots * sizeof(uint32_t))) {
+        return 0;
+    }
+
+    const struct bundle_entry *all = (const struct bundle_entry *)(map + header->entries_offset);
+    for (uint32_t i = 0; i < header->entry_count; i++) {
+        if (!valid_entry(&all[i])) return 0;
+    }
+    // Every lookup ends at an empty slot, so there must be one
+    const uint32_t *index = (const uint32_t *)(map + header->index_offset);
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < slots; i++) {
+        if (index[i] > header->entry_count) return 0;
+        used += index[i] != 0;
+    }
+    return used == header->entry_count;
+}
+
+int bundle_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat bundle_stat;
+    if (fd < 0 || fstat(fd, &bundle_stat) < 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    if ((size_t)bundle_stat.st_size < sizeof(struct bundle_header)) {
+        fprintf(stderr, "%s is not a bundle\n", path);
+        close(fd);
+        return -1;
+    }
+
+    // The page cache holds the bundle once, every worker reads the same pages
+    void *mapped = mmap(NULL, bundle_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        perror("Mapping the bundle failed");
+        close(fd);
+        return -1;
+    }
+    map = mapped;
+    map_size = bundle_stat.st_size;
+    const struct bundle_header *header = mapped;
+    if (!valid_bundle(header)) {
+        fprintf(stderr, "%s is not a bundle, or was packed on a different kind of machine\n", path);
+        munmap(mapped, bundle_stat.st_size);
+        map = NULL;
+        close(fd);
+        return -1;
+    }
+
+    entries = (const struct bundle_entry *)(map + header->entries_offset);
+    index_slots = (const uint32_t *)(map + header->index_offset);
+    index_mask = header->index_slots - 1;
+    bundle_fd = fd;
+    return 0;
+}
+
+const struct bundle_entry *bundle_find(struct http_slice url) {
+    if (!map) return NULL;
+    uint32_t hash = bundle_hash(url.data, url.len);
+    for (uint32_t i = hash & index_mask;; i = (i + 1) & index_mask) {
+        uint32_t number = index_slots[i];
+        if (!number) return NULL;
+        const struct bundle_entry *entry = &entries[number - 1];
+        if (entry->hash == hash && entry->path_len == url.len && memcmp(map + entry->path_offset, url.data, url.len) == 0) {
+            return entry;
+        }
+    }
+}
+
+const char *bundle_data(const struct bundle_body *body) {
+    return map + body->data_offset;
+}
+
+const char *bundle_mime_type(const struct bundle_entry *entry) {
+    return map + entry->mime_offset;
+}
+
+// Picks the representation to send: the first coding the client accepts, the file as is for ranges
+static const struct bundle_body *negotiate(const struct bundle_entry *entry, const struct http_request *request) {
+    int any = 0;
+    for (int i = 0; i < ENCODING_COUNT; i++) any |= entry->variants[i].header_len != 0;
+    if (!any || http_request_header(request, "Range")) return &entry->identity;
+
+    int accepted = compression_accepted(request);
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        if ((accepted & (1 << i)) && entry->variants[i].header_len) return &entry->variants[i];
+    }
+    return &entry->identity;
+}
+
+void bundle_send(struct connection *conn, const struct http_request *request, const struct bundle_entry *entry,
+                 const struct cache_policy *policy) {
+    const struct bundle_body *body = negotiate(entry, request);
+    const char *mime_type = bundle_mime_type(entry);
+    conn->mime_type = mime_type;
+
+    if (file_validators_not_modified(&body->validators, request)) {
+        struct iovec pieces[2] = {{.iov_base = (void *)(map + body->not_modified_offset), .iov_len = body->not_modified_len},
+                                  http_header_tail(conn, policy)};
+        connection_send_buffers(conn, pieces, 2, NULL, NULL);
+        return;
+    }
+
+    if (body == &entry->identity) {
+        struct byte_range ranges[RANGE_MAX];
+        int range_count = http_range_parse(request, body->data_len, &body->validators, ranges);
+        if (range_count < 0) {
+            http_range_send_unsatisfiable(conn, body->data_len);
+            return;
+        }
+        if (range_count > 0) {
+            struct range_source source = {.mime_type = mime_type, .validators = &body->validators,
+                                          .cache_policy = policy, .size = body->data_len,
+                                          .data = bundle_data(body), .fd = -1};
+            http_range_send(conn, ranges, range_count, &source);
+            return;
+        }
+    }
+
+    struct iovec pieces[3] = {
+        {.iov_base = (void *)(map + body->header_offset), .iov_len = body->header_len},
+        http_header_tail(conn, policy),
+        {.iov_base = (void *)bundle_data(body), .iov_len = body->data_len},
+    };
+    if (body->data_len < BUNDLE_SENDFILE_MIN) {
+        connection_send_buffers(conn, pieces, 3, NULL, NULL);
+    } else {
+        // sendfile() keeps its own offset per call, so every connection can share the bundle's descriptor
+        connection_send_buffers(conn, pieces, 2, NULL, NULL);
+        connection_add_file_body(conn, bundle_fd, body->data_offset, body->data_len, 0);
+    }
+}
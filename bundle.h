@@ -0,0 +1,90 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cache_policy.h"
+#include "compression.h"
+#include "event_loop.h"
+#include "file_validators.h"
+#include "http_parser.h"
+
+#define BUNDLE_MAGIC "WEBBNDL2" // First 8 bytes of a bundle, the digit is the format version
+#define BUNDLE_ALIGN 64         // Bodies start at multiples of this, so none shares a cache line with another
+#define BUNDLE_SENDFILE_MIN (64 * 1024) // Larger bodies go out with sendfile() from the bundle instead of sendmsg()
+
+/*
+ * A bundle is a whole web root packed into one file by bundle_pack, to be mapped read-only and served from.
+ * Everything a response needs is in it ahead of time: the body, its 200 and 304 headers (up to the Date line),
+   its validators, MIME type and compressed variants. A hash index finds a file by its URL path.
+ * The structures below are stored as they are in memory, so a bundle is read on the kind of machine it was packed on.
+ * Offsets count from the start of the bundle.
+ *
+ *   struct bundle_header
+ *   bodies, each aligned to BUNDLE_ALIGN
+ *   strings: paths and MIME types, each ending in '\0', every MIME type stored once, and the 200 and 304 headers
+ *   struct bundle_entry[entry_count]
+ *   uint32_t index[index_slots]: 1 + the number of the entry, 0 for an empty slot, linear probing from hash
+ */
+struct bundle_header {
+    char magic[8];
+    uint32_t entry_count;
+    uint32_t index_slots; // A power of two, at least twice entry_count
+    uint64_t entries_offset;
+    uint64_t index_offset;
+    uint64_t size; // Of the whole bundle, so a truncated one is noticed
+};
+
+// One representation of a file: as is, or in a content coding
+struct bundle_body {
+    uint64_t header_offset; // "HTTP/1.1 200 OK\r\n..." up to the Date line
+    uint64_t not_modified_offset;
+    uint64_t data_offset;
+    uint64_t data_len;
+    uint32_t header_len; // 0 when the file has no such representation
+    uint32_t not_modified_len;
+    struct file_validators validators;
+};
+
+struct bundle_entry {
+    uint64_t path_offset; // URL path, "/index.html"
+    uint64_t mime_offset;
+    uint32_t path_len;
+    uint32_t hash;
+    uint32_t fingerprint; // cache_fingerprint() of the file as is
+    struct bundle_body identity;
+    struct bundle_body variants[ENCODING_COUNT]; // By enum content_encoding
+};
+
+// Hash of a URL path in the index
+static inline uint32_t bundle_hash(const char *path, size_t length) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)path[i]) * 16777619u;
+    return hash;
+}
+
+/*
+ * Maps the bundle at path and checks that every offset in it stays inside the file, so serving never has to.
+ * Returns 0, or -1 with a message on stderr. Call before the workers start.
+ */
+int bundle_open(const char *path);
+
+// Returns the file at the URL path url, or NULL if the bundle has none (or none is open).
+const struct bundle_entry *bundle_find(struct http_slice url);
+
+// Returns the bytes of body, pointing into the mapping.
+const char *bundle_data(const struct bundle_body *body);
+
+// Returns the MIME type of entry. Files of one type share the same pointer, as the metrics expect.
+const char *bundle_mime_type(const struct bundle_entry *entry);
+
+/*
+ * Queues the response for request on entry: 304, 206, 416 or 200, in the best coding the client accepts,
+   with the Cache-Control line of policy (NULL for none).
+ * Headers and small bodies go out in one sendmsg() straight from the mapping, large bodies with sendfile().
+ */
+void bundle_send(struct connection *conn, const struct http_request *request, const struct bundle_entry *entry,
+                 const struct cache_policy *policy);
+
+#endif
@@ -0,0 +1,331 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bundle.h"
+#include "cache_policy.h"
+#include "http_header.h"
+#include "mime_types.h"
+#include "web_root.h"
+
+/*
+ * Packs a web root into a bundle for server_v2 -B: bundle_pack [-z gzip_level] [-m mime.types] [-M manifest] web web.bundle
+ * Bodies are written out one file at a time. Everything else (paths, MIME types, headers, entries) is small and
+   collected in memory until the end, where the index is built and the header at the front is filled in.
+ */
+
+struct text {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static FILE *out;
+static const char *out_path;
+static int gzip_level = COMPRESSION_DEFAULT_LEVEL;
+static FILE *manifest; // "/app.js\t/app.3f9a2c1d.js" for every file, for pages to link the fingerprinted URLs
+static const char *manifest_path;
+
+static struct text strings; // Offsets into it are made absolute once its place in the bundle is known
+static struct bundle_entry *entries;
+static uint32_t entry_count;
+static uint32_t entry_cap;
+
+// MIME types already stored, by the pointer mime_type_lookup() returned
+static const char *mime_types[256];
+static uint64_t mime_offsets[256];
+static int mime_count;
+
+static void fail(const char *what) {
+    perror(what);
+    if (out) unlink(out_path);
+    exit(1);
+}
+
+static void *grow(void *array, uint32_t *cap, size_t element) {
+    *cap = *cap ? *cap * 2 : 64;
+    void *grown = realloc(array, *cap * element);
+    if (!grown) fail("Memory allocation failed");
+    return grown;
+}
+
+// Appends length bytes to the strings and returns their offset there
+static uint64_t add_text(const char *data, size_t length) {
+    while (strings.len + length > strings.cap) {
+        strings.cap = strings.cap ? strings.cap * 2 : 4096;
+        strings.data = realloc(strings.data, strings.cap);
+        if (!strings.data) fail("Memory allocation failed");
+    }
+    memcpy(strings.data + strings.len, data, length);
+    strings.len += length;
+    return strings.len - length;
+}
+
+static uint64_t add_mime_type(const char *mime_type) {
+    for (int i = 0; i < mime_count; i++) {
+        if (mime_types[i] == mime_type || strcmp(mime_types[i], mime_type) == 0) return mime_offsets[i];
+    }
+    uint64_t offset = add_text(mime_type, strlen(mime_type) + 1);
+    if (mime_count < (int)(sizeof(mime_types) / sizeof(mime_types[0]))) {
+        mime_types[mime_count] = mime_type;
+        mime_offsets[mime_count++] = offset;
+    }
+    return offset;
+}
+
+static void write_at_alignment(size_t alignment) {
+    long position = ftell(out);
+    if (position < 0) fail(out_path);
+    static const char zeros[BUNDLE_ALIGN];
+    size_t padding = (alignment - position % alignment) % alignment;
+    if (fwrite(zeros, 1, padding, out) != padding) fail(out_path);
+}
+
+static uint64_t write_data(const void *data, size_t length, size_t alignment) {
+    write_at_alignment(alignment);
+    long position = ftell(out);
+    if (position < 0 || fwrite(data, 1, length, out) != length) fail(out_path);
+    return position;
+}
+
+/*
+ * Writes one representation of a file: its bytes, and the same 200 and 304 headers the file cache builds.
+ * encoding is the Content-Encoding or NULL, vary adds "Vary: Accept-Encoding".
+ */
+static void pack_body(struct bundle_body *body, const char *data, size_t length, const char *mime_type,
+                      const char *encoding, int vary, const struct file_validators *validators) {
+    char header[HEADER_BUFFER_SIZE];
+    char not_modified[HEADER_BUFFER_SIZE];
+    size_t not_modified_len;
+    int header_len = http_header_file_templates(header, not_modified, &not_modified_len, mime_type, length, encoding, vary,
+                                                validators);
+    if (header_len < 0) {
+        fprintf(stderr, "Headers too long for %s\n", mime_type);
+        exit(1);
+    }
+
+    body->header_offset = add_text(header, header_len);
+    body->header_len = header_len;
+    body->not_modified_offset = add_text(not_modified, not_modified_len);
+    body->not_modified_len = not_modified_len;
+    body->data_offset = write_data(data, length, BUNDLE_ALIGN);
+    body->data_len = length;
+    body->validators = *validators;
+}
+
+// Reads the whole file at url below the web root, the way server_v2 opens it, or returns NULL with errno set
+static char *read_file(const char *url, struct stat *file_stat) {
+    int fd = web_root_open_file(url);
+    if (fd < 0) return NULL;
+    char *data = NULL;
+    if (fstat(fd, file_stat) == 0 && S_ISREG(file_stat->st_mode) && (data = malloc(file_stat->st_size + 1))) {
+        size_t done = 0;
+        ssize_t n;
+        while (done < (size_t)file_stat->st_size && (n = read(fd, data + done, file_stat->st_size - done)) > 0) done += n;
+        if (done != (size_t)file_stat->st_size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    close(fd);
+    return data;
+}
+
+// Packs the file at path under the URL url, with its precompressed siblings or a gzipped copy as variants
+static void pack_file(const char *path, const char *url) {
+    struct stat file_stat;
+    char *data = read_file(url, &file_stat);
+    if (!data && errno == EXDEV) {
+        // server_v2 would refuse it too
+        fprintf(stderr, "Skipping %s, a symbolic link leads out of the web root\n", path);
+        return;
+    }
+    if (!data) fail(path);
+    if (entry_count == entry_cap) entries = grow(entries, &entry_cap, sizeof(*entries));
+    struct bundle_entry *entry = &entries[entry_count++];
+    memset(entry, 0, sizeof(*entry));
+
+    size_t url_len = strlen(url);
+    const char *mime_type = mime_type_lookup(path);
+    entry->path_offset = add_text(url, url_len + 1);
+    entry->path_len = url_len;
+    entry->hash = bundle_hash(url, url_len);
+    entry->mime_offset = add_mime_type(mime_type);
+    entry->fingerprint = cache_fingerprint(data, file_stat.st_size);
+    char fingerprinted[4096];
+    if (manifest && cache_fingerprint_insert(url, entry->fingerprint, fingerprinted, sizeof(fingerprinted)) > 0 &&
+        fprintf(manifest, "%s\t%s\n", url, fingerprinted) < 0) {
+        fail(manifest_path);
+    }
+
+    // A sibling older than the file itself was not rebuilt after the file changed, so it is ignored
+    int has_variants = 0;
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        char sibling[4096];
+        struct stat sibling_stat;
+        snprintf(sibling, sizeof(sibling), "%s%s", url, encoding_suffixes[i]);
+        char *encoded = read_file(sibling, &sibling_stat);
+        if (!encoded) continue;
+        if (sibling_stat.st_mtim.tv_sec >= file_stat.st_mtim.tv_sec) {
+            struct file_validators validators;
+            file_validators_init(&validators, &sibling_stat);
+            pack_body(&entry->variants[i], encoded, sibling_stat.st_size, mime_type, encoding_names[i], 1, &validators);
+            has_variants = 1;
+        }
+        free(encoded);
+    }
+
+    struct file_validators validators;
+    file_validators_init(&validators, &file_stat);
+    int compressible = compression_suitable(mime_type);
+    if (!entry->variants[ENCODING_GZIP].header_len && compressible && gzip_level > 0 && file_stat.st_size >= COMPRESSION_MIN_SIZE) {
+        size_t length;
+        char *compressed = compression_gzip(data, file_stat.st_size, gzip_level, &length);
+        if (compressed) {
+            // The compressed bytes are a different representation and need their own ETag, "...-gz"
+            struct file_validators gzip_validators = validators;
+            if (gzip_validators.etag_len + 3 < sizeof(gzip_validators.etag)) {
+                memcpy(gzip_validators.etag + gzip_validators.etag_len - 1, "-gz\"", 5);
+                gzip_validators.etag_len += 3;
+            }
+            pack_body(&entry->variants[ENCODING_GZIP], compressed, length, mime_type, encoding_names[ENCODING_GZIP], 1,
+                      &gzip_validators);
+            has_variants = 1;
+            free(compressed);
+        }
+    }
+    pack_body(&entry->identity, data, file_stat.st_size, mime_type, NULL, compressible || has_variants, &validators);
+    free(data);
+}
+
+// Packs every file below dir, whose URL starts with prefix ("" for the root)
+static void pack_tree(const char *dir, const char *prefix) {
+    DIR *d = opendir(dir);
+    if (!d) fail(dir);
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        char path[4096];
+        char url[4096];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name) >= (int)sizeof(path) ||
+            snprintf(url, sizeof(url), "%s/%s", prefix, ent->d_name) >= (int)sizeof(url)) {
+            fprintf(stderr, "Path too long: %s/%s\n", dir, ent->d_name);
+            exit(1);
+        }
+        struct stat file_stat;
+        if (stat(path, &file_stat) < 0) fail(path);
+        if (S_ISDIR(file_stat.st_mode)) {
+            pack_tree(path, url);
+        } else if (S_ISREG(file_stat.st_mode)) {
+            pack_file(path, url);
+        }
+    }
+    closedir(d);
+}
+
+// Writes the strings, the entries with absolute offsets and the index, then fills in the header
+static void finish(void) {
+    uint64_t strings_offset = write_data(strings.data, strings.len, 1);
+    for (uint32_t i = 0; i < entry_count; i++) {
+        struct bundle_entry *entry = &entries[i];
+        entry->path_offset += strings_offset;
+        entry->mime_offset += strings_offset;
+        struct bundle_body *bodies[1 + ENCODING_COUNT] = {&entry->identity};
+        for (int j = 0; j < ENCODING_COUNT; j++) bodies[1 + j] = &entry->variants[j];
+        for (int j = 0; j < 1 + ENCODING_COUNT; j++) {
+            if (!bodies[j]->header_len) continue;
+            bodies[j]->header_offset += strings_offset;
+            bodies[j]->not_modified_offset += strings_offset;
+        }
+    }
+
+    struct bundle_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.entry_count = entry_count;
+    header.index_slots = 16;
+    while (header.index_slots / 2 < entry_count) header.index_slots *= 2;
+    uint32_t *index = calloc(header.index_slots, sizeof(*index));
+    if (!index) fail("Memory allocation failed");
+    for (uint32_t i = 0; i < entry_count; i++) {
+        uint32_t slot = entries[i].hash & (header.index_slots - 1);
+        while (index[slot]) slot = (slot + 1) & (header.index_slots - 1);
+        index[slot] = i + 1;
+    }
+
+    header.entries_offset = write_data(entries, (size_t)entry_count * sizeof(*entries), _Alignof(struct bundle_entry));
+    header.index_offset = write_data(index, (size_t)header.index_slots * sizeof(*index), _Alignof(uint32_t));
+    long size = ftell(out);
+    if (size < 0) fail(out_path);
+    header.size = size;
+    if (fseek(out, 0, SEEK_SET) < 0 || fwrite(&header, sizeof(header), 1, out) != 1) fail(out_path);
+    free(index);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-z gzip_level] [-m mime.types] [-M manifest] web_root bundle\n", program);
+    fprintf(stderr, "  -z gzip_level  gzip text files without a .gz sibling at this level, 0 disables (default: %d)\n",
+            COMPRESSION_DEFAULT_LEVEL);
+    fprintf(stderr, "  -m mime.types  add the MIME types listed in this file, as server_v2 -m does\n");
+    fprintf(stderr, "  -M manifest    write every URL and its fingerprinted form (server_v2 -F) to this file, tab separated\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *mime_file = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "z:m:M:")) != -1) {
+        switch (option) {
+        case 'z':
+            gzip_level = atoi(optarg);
+            break;
+        case 'm':
+            mime_file = optarg;
+            break;
+        case 'M':
+            manifest_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    // Without a file only building the table can fail, and mime_types_init() has said so
+    if (mime_types_init(mime_file) < 0 && mime_file) {
+        fprintf(stderr, "Cannot read %s, using the built-in MIME types\n", mime_file);
+    }
+
+    // Written next to the bundle and renamed over it, so a server starting meanwhile never maps half a bundle
+    const char *root = argv[optind];
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", argv[optind + 1]);
+    out_path = temporary;
+    out = fopen(temporary, "wb");
+    if (!out) fail(temporary);
+    struct bundle_header placeholder = {{0}};
+    if (fwrite(&placeholder, sizeof(placeholder), 1, out) != 1) fail(temporary);
+
+    size_t root_len = strlen(root);
+    while (root_len > 1 && root[root_len - 1] == '/') root_len--;
+    char root_dir[4096];
+    snprintf(root_dir, sizeof(root_dir), "%.*s", (int)root_len, root);
+    if (web_root_open(root_dir) < 0) exit(1);
+    if (manifest_path && !(manifest = fopen(manifest_path, "w"))) fail(manifest_path);
+    pack_tree(root_dir, "");
+    finish();
+    if (manifest && fclose(manifest) != 0) fail(manifest_path);
+
+    if (fflush(out) != 0 || fsync(fileno(out)) < 0 || fclose(out) != 0) fail(temporary);
+    out = NULL;
+    if (rename(temporary, argv[optind + 1]) < 0) fail(argv[optind + 1]);
+    printf("Packed %u files into %s (%zu bytes of headers and names)\n", entry_count, argv[optind + 1], strings.len);
+    return 0;
+}
@@ -0,0 +1,319 @@
+#define _GNU_SOURCE // For getline() and memrchr()
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "cache_policy.h"
+
+#define EXTENSION_MAX 15 // Longer extensions never have a rule
+#define PATTERN_MAX 512   // Longer paths never match a request, see WEB_PATH_MAX
+#define IMMUTABLE_LINE "Cache-Control: public, max-age=31536000, immutable\r\n"
+
+const struct cache_policy cache_policy_immutable = {IMMUTABLE_LINE, sizeof(IMMUTABLE_LINE) - 1};
+
+/*
+ * Every rule but "*" lives in one open addressing table, its key telling the kinds apart: a path ("/sw.js"),
+   a directory ("/assets/") or an extension with its dot, lowercased (".css"). Normalized request paths never end
+   in '/', so a path and a directory never share a key.
+ * The table is only read once the workers run, so lookups take no lock.
+ */
+struct rule {
+    char *key; // NULL in an empty slot
+    size_t key_len;
+    uint64_t hash;
+    struct cache_policy policy;
+};
+
+static struct rule *slots;
+static uint64_t slot_mask;
+static struct cache_policy default_policy; // line is NULL without a "*" rule
+// Which kinds of rules exist, so a lookup skips the probes that cannot match
+static int has_paths;
+static int has_directories;
+static int has_extensions;
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+// FNV-1a leaves the low bits weak, so finish like MurmurHash3 before they pick the slot
+static uint64_t finish_hash(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static uint64_t hash_key(const char *key, size_t length) {
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)key[i]) * FNV_PRIME;
+    return finish_hash(hash);
+}
+
+static const struct cache_policy *find(const char *key, size_t length, uint64_t hash) {
+    for (uint64_t i = hash & slot_mask;; i = (i + 1) & slot_mask) {
+        const struct rule *rule = &slots[i];
+        if (!rule->key) return NULL;
+        if (rule->hash == hash && rule->key_len == length && memcmp(rule->key, key, length) == 0) return &rule->policy;
+    }
+}
+
+static void lowercase(const char *text, size_t length, char *out) {
+    for (size_t i = 0; i < length; i++) {
+        char c = text[i];
+        out[i] = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+}
+
+// Returns the start of the last segment of path, just behind its '/'
+static size_t last_segment(const char *path, size_t length) {
+    while (length > 0 && path[length - 1] != '/') length--;
+    return length;
+}
+
+const struct cache_policy *cache_policy_lookup(const char *path, size_t length) {
+    const struct cache_policy *policy;
+    if (has_paths && (policy = find(path, length, hash_key(path, length)))) return policy;
+
+    size_t segment = last_segment(path, length);
+    if (has_directories) {
+        // FNV-1a runs front to back, so one pass yields the hash of every directory the path lies in
+        uint64_t hashes[PATTERN_MAX / 2];
+        uint16_t ends[PATTERN_MAX / 2];
+        int depth = 0;
+        uint64_t hash = FNV_OFFSET;
+        for (size_t i = 0; i < segment && depth < PATTERN_MAX / 2; i++) {
+            hash = (hash ^ (unsigned char)path[i]) * FNV_PRIME;
+            if (path[i] == '/') {
+                hashes[depth] = hash;
+                ends[depth++] = i + 1;
+            }
+        }
+        while (depth-- > 0) {
+            if ((policy = find(path, ends[depth], finish_hash(hashes[depth])))) return policy;
+        }
+    }
+
+    const char *dot = has_extensions ? memrchr(path + segment, '.', length - segment) : NULL;
+    size_t extension_len = dot ? (size_t)(path + length - dot) : 0;
+    if (extension_len > 1 && extension_len <= EXTENSION_MAX + 1) {
+        char lowered[EXTENSION_MAX + 1];
+        lowercase(dot, extension_len, lowered);
+        if ((policy = find(lowered, extension_len, hash_key(lowered, extension_len)))) return policy;
+    }
+    return default_policy.line ? &default_policy : NULL;
+}
+
+// Whether a '/' pattern could ever equal a normalized path: no empty, "." or ".." segments
+static int normalized(const char *pattern, size_t length) {
+    size_t start = 1;
+    for (size_t i = 1; i <= length; i++) {
+        if (i < length && pattern[i] != '/') continue;
+        size_t segment_len = i - start;
+        if (i < length || segment_len > 0) {
+            if (segment_len == 0) return 0;
+            if (pattern[start] == '.' && (segment_len == 1 || (segment_len == 2 && pattern[start + 1] == '.'))) return 0;
+        }
+        start = i + 1;
+    }
+    return 1;
+}
+
+/*
+ * Turns a pattern into its key in the table: paths and directories as they are, "*.ext" into ".ext" lowercased.
+ * Returns the key length, 0 for "*", or -1 with *problem set.
+ */
+static int rule_key(const char *pattern, size_t length, char *key, const char **problem) {
+    if (length == 1 && pattern[0] == '*') return 0;
+    if (pattern[0] == '/') {
+        if (length >= PATTERN_MAX || !normalized(pattern, length)) {
+            *problem = "paths must look like normalized request paths, without \"//\", \".\" or \"..\"";
+            return -1;
+        }
+        memcpy(key, pattern, length);
+        has_directories |= pattern[length - 1] == '/';
+        has_paths |= pattern[length - 1] != '/';
+        return (int)length;
+    }
+    if (length >= 3 && pattern[0] == '*' && pattern[1] == '.' && length - 1 <= EXTENSION_MAX + 1 &&
+        !memchr(pattern + 2, '.', length - 2) && !memchr(pattern + 2, '/', length - 2) && !memchr(pattern + 2, '*', length - 2)) {
+        lowercase(pattern + 1, length - 1, key);
+        has_extensions = 1;
+        return (int)(length - 1);
+    }
+    *problem = "expected /path, /directory/, *.extension or * in front of the Cache-Control value";
+    return -1;
+}
+
+static const char *check_value(const char *value, size_t length) {
+    if (length == 0) return "missing Cache-Control value";
+    if (length > CACHE_POLICY_VALUE_MAX) return "Cache-Control value too long";
+    for (size_t i = 0; i < length; i++) {
+        if (value[i] < ' ' || value[i] > '~') return "Cache-Control value with a character headers cannot carry";
+    }
+    return NULL;
+}
+
+static int make_line(struct cache_policy *policy, const char *value, size_t length) {
+    char *line = malloc(CACHE_POLICY_LINE_MAX + 1);
+    if (!line) return -1;
+    policy->line_len = snprintf(line, CACHE_POLICY_LINE_MAX + 1, "Cache-Control: %.*s\r\n", (int)length, value);
+    policy->line = line;
+    return 0;
+}
+
+// Puts rule into the table, replacing the one with the same key
+static void insert(struct rule *rule) {
+    for (uint64_t i = rule->hash & slot_mask;; i = (i + 1) & slot_mask) {
+        struct rule *slot = &slots[i];
+        if (!slot->key) {
+            *slot = *rule;
+            return;
+        }
+        if (slot->hash == rule->hash && slot->key_len == rule->key_len && memcmp(slot->key, rule->key, rule->key_len) == 0) {
+            free(slot->key);
+            free((char *)slot->policy.line);
+            *slot = *rule;
+            return;
+        }
+    }
+}
+
+int cache_policy_init(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+
+    struct rule *rules = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    int number = 0;
+    int result = 0;
+    while (result == 0 && getline(&line, &line_size, file) > 0) {
+        number++;
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        char *pattern = line + strspn(line, " \t\r\n");
+        if (*pattern == '\0') continue;
+        size_t pattern_len = strcspn(pattern, " \t\r\n");
+        char *value = pattern + pattern_len;
+        value += strspn(value, " \t");
+        size_t value_len = strlen(value);
+        while (value_len > 0 && strchr(" \t\r\n", value[value_len - 1])) value_len--;
+
+        const char *problem = check_value(value, value_len);
+        char key[PATTERN_MAX];
+        int key_len = problem ? -1 : rule_key(pattern, pattern_len, key, &problem);
+        if (problem) {
+            fprintf(stderr, "%s:%d: %s\n", path, number, problem);
+            result = -1;
+        } else if (key_len == 0) {
+            free((char *)default_policy.line);
+            result = make_line(&default_policy, value, value_len);
+            if (result < 0) perror("Memory allocation failed");
+        } else {
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 32;
+                struct rule *grown = realloc(rules, capacity * sizeof(*rules));
+                if (!grown) {
+                    perror("Memory allocation failed");
+                    result = -1;
+                    break;
+                }
+                rules = grown;
+            }
+            struct rule *rule = &rules[count];
+            rule->key = malloc(key_len);
+            rule->key_len = key_len;
+            rule->hash = hash_key(key, key_len);
+            if (!rule->key || make_line(&rule->policy, value, value_len) < 0) {
+                free(rule->key);
+                perror("Memory allocation failed");
+                result = -1;
+                break;
+            }
+            memcpy(rule->key, key, key_len);
+            count++;
+        }
+    }
+    free(line);
+    fclose(file);
+
+    // At most half full, so probing stays short and always reaches an empty slot
+    uint64_t slot_count = 16;
+    while (slot_count < count * 2) slot_count *= 2;
+    if (result == 0 && !(slots = calloc(slot_count, sizeof(*slots)))) {
+        perror("Memory allocation failed");
+        result = -1;
+    }
+    if (result < 0) {
+        for (size_t i = 0; i < count; i++) {
+            free(rules[i].key);
+            free((char *)rules[i].policy.line);
+        }
+        free(rules);
+        has_paths = has_directories = has_extensions = 0;
+        return -1;
+    }
+    slot_mask = slot_count - 1;
+    for (size_t i = 0; i < count; i++) insert(&rules[i]);
+    free(rules);
+    return 0;
+}
+
+uint32_t cache_fingerprint(const char *data, size_t length) {
+    uLong crc = crc32(0, Z_NULL, 0);
+    while (length > 0) {
+        uInt chunk = length > (1u << 30) ? (1u << 30) : (uInt)length;
+        crc = crc32(crc, (const Bytef *)data, chunk);
+        data += chunk;
+        length -= chunk;
+    }
+    return (uint32_t)crc;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+int cache_fingerprint_strip(const char *path, size_t length, char *out, size_t size, uint32_t *fingerprint) {
+    // name.3f9a2c1d.ext: at least one character of name, the digits between two dots and an extension
+    size_t segment = last_segment(path, length);
+    const char *extension = memrchr(path + segment, '.', length - segment);
+    if (!extension || extension - (path + segment) < CACHE_FINGERPRINT_DIGITS + 2 || path + length - extension < 2) return -1;
+    const char *digits = extension - CACHE_FINGERPRINT_DIGITS;
+    if (digits[-1] != '.') return -1;
+    uint32_t value = 0;
+    for (int i = 0; i < CACHE_FINGERPRINT_DIGITS; i++) {
+        int digit = hex_digit(digits[i]);
+        if (digit < 0) return -1;
+        value = value << 4 | digit;
+    }
+
+    size_t name_len = digits - 1 - path;
+    size_t stripped_len = length - (CACHE_FINGERPRINT_DIGITS + 1);
+    if (stripped_len + 1 > size) return -1;
+    memcpy(out, path, name_len);
+    memcpy(out + name_len, extension, path + length - extension);
+    out[stripped_len] = '\0';
+    *fingerprint = value;
+    return (int)stripped_len;
+}
+
+int cache_fingerprint_insert(const char *path, uint32_t fingerprint, char *out, size_t size) {
+    size_t length = strlen(path);
+    size_t segment = last_segment(path, length);
+    const char *extension = memrchr(path + segment, '.', length - segment);
+    if (!extension || extension == path + segment || extension == path + length - 1) return -1;
+    int written = snprintf(out, size, "%.*s.%0*" PRIx32 "%s", (int)(extension - path), path, CACHE_FINGERPRINT_DIGITS,
+                           fingerprint, extension);
+    return written < 0 || (size_t)written >= size ? -1 : written;
+}
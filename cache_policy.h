@@ -0,0 +1,54 @@
+#ifndef CACHE_POLICY_H
+#define CACHE_POLICY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_POLICY_VALUE_MAX 128 // Longest Cache-Control value a rule may set
+#define CACHE_POLICY_LINE_MAX (sizeof("Cache-Control: \r\n") - 1 + CACHE_POLICY_VALUE_MAX)
+#define CACHE_FINGERPRINT_DIGITS 8 // Lowercase hex digits of a fingerprint in a URL, "/app.3f9a2c1d.js"
+
+// A Cache-Control header line, ready to be copied into responses
+struct cache_policy {
+    const char *line; // "Cache-Control: public, max-age=3600\r\n"
+    size_t line_len;
+};
+
+// For fingerprinted URLs: what they name never changes, a new version of the file gets a new URL
+extern const struct cache_policy cache_policy_immutable;
+
+/*
+ * Loads the rules of a policy file, one per line, '#' starts a comment:
+ *     /sw.js     no-cache
+ *     /assets/   public, max-age=604800
+ *     *.css      public, max-age=86400
+ *     *          no-cache
+ * The pattern is a URL path, a directory (ending in '/'), an extension or "*"; the rest of the line is the value.
+ * A path gets the rule for itself, else the one for the deepest directory it lies in, else the one for its extension
+   (matched case-insensitively), else "*". Without any, responses carry no Cache-Control line.
+ * A later rule for the same pattern replaces an earlier one.
+ * The rules are compiled into one hash table, so a lookup costs a few probes however many rules there are.
+ * Must be called before the workers start. Returns 0, or -1 with a message on stderr.
+ */
+int cache_policy_init(const char *path);
+
+// Returns the policy for a path from web_path_normalize(), or NULL if no rule applies.
+const struct cache_policy *cache_policy_lookup(const char *path, size_t length);
+
+// Returns the fingerprint of a file's content: its CRC-32, which goes into URLs as CACHE_FINGERPRINT_DIGITS hex digits.
+uint32_t cache_fingerprint(const char *data, size_t length);
+
+/*
+ * Recognizes a fingerprinted path, "/js/app.3f9a2c1d.js": the last segment has a fingerprint between its name and
+   its extension. Writes the path without it ("/js/app.js") to out and the fingerprint to *fingerprint.
+ * Returns the length of the path written, or -1 if path has no fingerprint or does not fit into size bytes.
+ */
+int cache_fingerprint_strip(const char *path, size_t length, char *out, size_t size, uint32_t *fingerprint);
+
+/*
+ * Writes path with fingerprint put in front of its extension, the reverse of cache_fingerprint_strip().
+ * Returns the length written, or -1 if the last segment has no extension or the result does not fit into size bytes.
+ */
+int cache_fingerprint_insert(const char *path, uint32_t fingerprint, char *out, size_t size);
+
+#endif
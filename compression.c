@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#include "compression.h"
+
+const char *const encoding_names[ENCODING_COUNT] = {"br", "gzip"};
+const char *const encoding_suffixes[ENCODING_COUNT] = {".br", ".gz"};
+
+// "q=0", "q=0.0", ... mark a coding the client refuses
+static int is_zero_quality(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (end - p < 3 || (p[0] != 'q' && p[0] != 'Q') || p[1] != '=' || p[2] != '0') return 0;
+    for (p += 3; p < end && (*p == '.' || *p == '0'); p++) {
+    }
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    return p == end;
+}
+
+int compression_accepted(const struct http_request *request) {
+    const struct http_slice *header = http_request_header(request, "Accept-Encoding");
+    if (!header) return 0;
+
+    int accepted = 0;
+    int named = 0;    // Codings listed by name, "*" does not change their answer
+    int wildcard = 0; // "*" accepts every coding not listed
+    const char *p = header->data;
+    const char *end = header->data + header->len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *coding = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        struct http_slice name = {.data = coding, .len = p - coding};
+        const char *parameters = p;
+        while (p < end && *p != ',') p++;
+
+        int refused = 0;
+        const char *semicolon = memchr(parameters, ';', p - parameters);
+        if (semicolon) refused = is_zero_quality(semicolon + 1, p);
+
+        if (http_slice_equals(name, "*")) wildcard = !refused;
+        for (int i = 0; i < ENCODING_COUNT; i++) {
+            if (http_slice_equals_nocase(name, encoding_names[i])) {
+                named |= 1 << i;
+                if (!refused) accepted |= 1 << i;
+            }
+        }
+    }
+    if (wildcard) accepted |= ((1 << ENCODING_COUNT) - 1) & ~named;
+    return accepted;
+}
+
+int compression_suitable(const char *mime_type) {
+    static const char *const types[] = {"application/javascript", "application/json", "application/xml", "application/wasm",
+                                        "application/vnd.ms-fontobject", "font/ttf", "font/otf"};
+    if (strncmp(mime_type, "text/", 5) == 0) return 1;
+    // Structured syntax suffixes: image/svg+xml, application/manifest+json, ...
+    size_t length = strlen(mime_type);
+    if (length > 5 && (strcmp(mime_type + length - 5, "+json") == 0 || strcmp(mime_type + length - 4, "+xml") == 0)) return 1;
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strcmp(mime_type, types[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+char *compression_gzip(const char *data, size_t length, int level, size_t *compressed_length) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 15 window bits plus 16 asks zlib for a gzip header and trailer instead of a zlib one
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+
+    size_t limit = length - length / 8;
+    uLong bound = deflateBound(&stream, length);
+    char *out = malloc(bound);
+    if (!out) {
+        deflateEnd(&stream);
+        return NULL;
+    }
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = length;
+    stream.next_out = (Bytef *)out;
+    stream.avail_out = bound;
+    int status = deflate(&stream, Z_FINISH);
+    *compressed_length = stream.total_out;
+    deflateEnd(&stream);
+
+    if (status != Z_STREAM_END || *compressed_length > limit) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
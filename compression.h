@@ -0,0 +1,33 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stddef.h>
+
+#include "http_parser.h"
+
+#define COMPRESSION_DEFAULT_LEVEL 6 // gzip level for files compressed in memory, 0 turns it off
+#define COMPRESSION_MIN_SIZE 256    // Smaller files are not worth the Content-Encoding header
+
+// Content codings the server can send, in order of preference
+enum content_encoding {
+    ENCODING_BR,
+    ENCODING_GZIP,
+    ENCODING_COUNT
+};
+
+extern const char *const encoding_names[ENCODING_COUNT];    // As in Accept-Encoding and Content-Encoding
+extern const char *const encoding_suffixes[ENCODING_COUNT]; // Extension of precompressed sibling files
+
+// Returns the codings the client accepts as a bit mask of 1 << enum content_encoding, from its Accept-Encoding header.
+int compression_accepted(const struct http_request *request);
+
+// Returns 1 for text-like MIME types that shrink when compressed. Images, archives and media are compressed already.
+int compression_suitable(const char *mime_type);
+
+/*
+ * Compresses length bytes of data into a malloc()ed gzip stream at the given level.
+ * Returns NULL if compression fails or would not save at least an eighth of the size.
+ */
+char *compression_gzip(const char *data, size_t length, int level, size_t *compressed_length);
+
+#endif
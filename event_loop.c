@@ -0,0 +1,764 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <linux/sockios.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "access_log.h"
+#include "admission.h"
+#include "event_loop.h"
+#include "event_loop_internal.h"
+#include "metrics.h"
+#include "pool.h"
+#include "rate_limit.h"
+
+// Per-loop state. Each worker thread has its own, so nothing in here is ever shared between threads.
+struct event_loop {
+    int epoll_fd;
+    int listen_fd;
+    request_handler handler;
+    time_t now; // Monotonic seconds, refreshed once per epoll_wait() wakeup
+    struct timer_wheel timers;
+    int draining; // No longer accepting, see event_loop_drain()
+};
+
+static enum event_loop_backend backend = EVENT_LOOP_EPOLL;
+
+/*
+ * One eventfd is shared by every loop. It is registered level-triggered and never read,
+   so once event_loop_stop() writes to it, every epoll_wait() in the process returns at once.
+ */
+static volatile sig_atomic_t stop_requested = 0;
+static int stop_fd = -1;
+static pthread_once_t stop_fd_once = PTHREAD_ONCE_INIT;
+static char stop_marker; // Its address tags the eventfd in the epoll set
+
+/*
+ * event_loop_drain() writes to a second eventfd. It is registered edge-triggered, so every loop is woken
+   once and then keeps serving its remaining connections without spinning on it.
+ */
+static volatile sig_atomic_t drain_requested = 0;
+static time_t drain_deadline;
+static int drain_fd = -1;
+static char drain_marker;
+
+/*
+ * Connections and their I/O buffers come from pools of the thread running the loop. A connection is
+   created, driven and destroyed by the same loop, so neither pool needs a lock.
+ */
+static __thread struct pool connection_pool = POOL_INITIALIZER(struct connection);
+static __thread struct pool io_pool = POOL_INITIALIZER(struct io_buffer);
+
+// Answers for requests that never reach the handler
+static const char bad_request_response[] =
+    "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char too_large_response[] =
+    "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+static void create_stop_fd(void) {
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    drain_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stop_fd < 0 || drain_fd < 0) {
+        perror("eventfd failed");
+        stop_fd = -1;
+    }
+}
+
+int event_loop_stop_fd(void) {
+    pthread_once(&stop_fd_once, create_stop_fd);
+    return stop_fd;
+}
+
+int event_loop_stopping(void) {
+    return stop_requested;
+}
+
+int event_loop_drain_fd(void) {
+    return drain_fd;
+}
+
+int event_loop_draining(void) {
+    return drain_requested;
+}
+
+int event_loop_drained(time_t now, int connections) {
+    return drain_requested && (connections == 0 || now >= drain_deadline);
+}
+
+void event_loop_set_backend(enum event_loop_backend value) {
+    backend = value;
+}
+
+void event_loop_stop(void) {
+    stop_requested = 1;
+    if (stop_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t ignored = write(stop_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+void event_loop_drain(int timeout) {
+    drain_deadline = event_loop_monotonic_seconds() + timeout;
+    drain_requested = 1;
+    if (drain_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t ignored = write(drain_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+time_t event_loop_monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+// Switch a descriptor to non-blocking mode so that no call on it can stall the loop.
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, time_t now) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->current = now;
+}
+
+static struct connection **timer_slot(struct timer_wheel *wheel, time_t second) {
+    return &wheel->slots[second & (TIMER_WHEEL_SLOTS - 1)];
+}
+
+void timer_wheel_each(struct timer_wheel *wheel, enum connection_timer timer,
+                      void (*callback)(void *arg, struct connection *conn), void *arg) {
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS && wheel->count > 0; slot++) {
+        struct connection *next;
+        for (struct connection *conn = wheel->slots[slot]; conn; conn = next) {
+            next = conn->timer_next;
+            if (conn->timer == timer) callback(arg, conn);
+        }
+    }
+}
+
+void timer_wheel_cancel(struct timer_wheel *wheel, struct connection *conn) {
+    if (conn->timer == TIMER_NONE) return;
+    if (conn->timer_prev) conn->timer_prev->timer_next = conn->timer_next;
+    else *timer_slot(wheel, conn->deadline) = conn->timer_next;
+    if (conn->timer_next) conn->timer_next->timer_prev = conn->timer_prev;
+    conn->timer_prev = conn->timer_next = NULL;
+    conn->timer = TIMER_NONE;
+    wheel->count--;
+}
+
+struct connection *timer_wheel_expired(struct timer_wheel *wheel, time_t now) {
+    if (wheel->count == 0) {
+        wheel->current = now + 1;
+        return NULL;
+    }
+    // After a long sleep one pass over the slots is enough, every slot stands for many seconds then
+    if (now - wheel->current >= TIMER_WHEEL_SLOTS) wheel->current = now - TIMER_WHEEL_SLOTS + 1;
+    for (; wheel->current <= now; wheel->current++) {
+        for (struct connection *conn = *timer_slot(wheel, wheel->current); conn; conn = conn->timer_next) {
+            if (conn->deadline <= now) return conn;
+        }
+    }
+    return NULL;
+}
+
+void connection_set_timer(struct timer_wheel *wheel, struct connection *conn, enum connection_timer timer, time_t now) {
+    static const int timeouts[] = {[TIMER_HEADER] = HEADER_TIMEOUT, [TIMER_SEND] = SEND_TIMEOUT, [TIMER_IDLE] = KEEPALIVE_TIMEOUT};
+    timer_wheel_cancel(wheel, conn);
+    if (timer == TIMER_SEND) {
+        conn->window_sent = 0;
+        // Nothing was ever sent before the first response, a later one may start behind bytes still queued
+        conn->window_queued = conn->requests_served ? -1 : 0;
+    }
+    conn->timer = timer;
+    conn->deadline = now + timeouts[timer];
+    struct connection **slot = timer_slot(wheel, conn->deadline);
+    conn->timer_prev = NULL;
+    conn->timer_next = *slot;
+    if (*slot) (*slot)->timer_prev = conn;
+    *slot = conn;
+    wheel->count++;
+}
+
+int connection_timed_out(struct timer_wheel *wheel, struct connection *conn, time_t now) {
+    static const enum metrics_counter reasons[] = {
+        [TIMER_HEADER] = METRIC_TIMEOUTS_HEADER, [TIMER_SEND] = METRIC_TIMEOUTS_SEND, [TIMER_IDLE] = METRIC_TIMEOUTS_IDLE};
+    if (conn->timer == TIMER_SEND) {
+        /*
+         * What we handed to the kernel says little about the client: once the socket buffer is full the kernel
+           may not take more for a long time. The bytes that left the send queue in this window are what the
+           client actually received.
+         */
+        int queued;
+        if (ioctl(conn->fd, SIOCOUTQ, &queued) < 0) queued = 0;
+        int64_t received = (int64_t)conn->window_sent + conn->window_queued - queued;
+        if (conn->window_queued < 0 || received >= (int64_t)SEND_MIN_RATE * SEND_TIMEOUT) {
+            // Fast enough, or the queue at the start was unknown: measure again over the next window
+            connection_set_timer(wheel, conn, TIMER_SEND, now);
+            conn->window_queued = queued;
+            return 0;
+        }
+    }
+    metrics_add(reasons[conn->timer], 1);
+    return 1;
+}
+
+void connection_queue_part(struct connection *conn, const struct iovec *pieces, int count) {
+    if (count > RESPONSE_MAX_IOV) count = RESPONSE_MAX_IOV;
+    memcpy(conn->iov, pieces, count * sizeof(*pieces));
+    conn->iov_count = count;
+    conn->iov_index = 0;
+    conn->file_fd = -1;
+    conn->body_remaining = 0;
+    conn->state = CONN_SEND_HEADERS;
+}
+
+void connection_send_buffers(struct connection *conn, const struct iovec *pieces, int count,
+                             void (*release)(void *), void *release_arg) {
+    // Every response starts with "HTTP/1.x NNN", its status is noted here for the metrics
+    const char *status_line = count > 0 ? pieces[0].iov_base : NULL;
+    conn->status = 0;
+    if (status_line && pieces[0].iov_len >= 12 && status_line[8] == ' ') {
+        conn->status = (status_line[9] - '0') * 100 + (status_line[10] - '0') * 10 + (status_line[11] - '0');
+    }
+    conn->release = release;
+    conn->release_arg = release_arg;
+    conn->next_part = NULL;
+    connection_queue_part(conn, pieces, count);
+}
+
+void connection_set_next_part(struct connection *conn, int (*next_part)(struct connection *conn, void *arg)) {
+    conn->next_part = next_part;
+}
+
+void connection_send_response(struct connection *conn, const char *response, size_t length) {
+    struct iovec piece = {.iov_base = (void *)response, .iov_len = length};
+    connection_send_buffers(conn, &piece, 1, NULL, NULL);
+}
+
+void connection_send_copy(struct connection *conn, const char *response, size_t length) {
+    if (length > sizeof(conn->io->header)) length = sizeof(conn->io->header);
+    memcpy(conn->io->header, response, length);
+    connection_send_response(conn, conn->io->header, length);
+}
+
+void connection_add_file_body(struct connection *conn, int file_fd, off_t offset, off_t length, int owns_fd) {
+    conn->file_fd = file_fd;
+    conn->owns_file_fd = owns_fd;
+    conn->file_offset = offset;
+    conn->body_remaining = length;
+    conn->use_splice = 0;
+    conn->response_bytes += length;
+}
+
+void connection_send_file(struct connection *conn, const char *header, size_t header_length, int file_fd, off_t length) {
+    if (header_length > sizeof(conn->io->header)) header_length = sizeof(conn->io->header);
+    memcpy(conn->io->header, header, header_length);
+    connection_send_response(conn, conn->io->header, header_length);
+    connection_add_file_body(conn, file_fd, 0, length, 1);
+}
+
+// Release everything a finished response was holding on to.
+void connection_reset_response(struct connection *conn) {
+    if (conn->file_fd >= 0 && conn->owns_file_fd) close(conn->file_fd);
+    conn->file_fd = -1;
+    if (conn->release) conn->release(conn->release_arg);
+    conn->release = NULL;
+    conn->next_part = NULL;
+    conn->iov_count = conn->iov_index = 0;
+    conn->file_offset = 0;
+    conn->body_remaining = 0;
+    conn->use_splice = 0;
+}
+
+// Takes an object from pool, counting the memory of any slab it had to allocate for it
+static void *pool_take(struct pool *pool) {
+    size_t bytes = pool->bytes;
+    void *object = pool_get(pool);
+    if (pool->bytes != bytes) metrics_add(METRIC_POOL_BYTES, pool->bytes - bytes);
+    return object;
+}
+
+static void release_io(struct connection *conn) {
+    if (!conn->io) return;
+    pool_put(&io_pool, conn->io);
+    conn->io = NULL;
+    metrics_add(METRIC_IO_BUFFERS_RETURNED, 1);
+}
+
+struct connection *connection_create(int fd, int admission_slot) {
+    struct connection *conn = pool_take(&connection_pool);
+    if (!conn) return NULL;
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fd;
+    conn->admission_slot = admission_slot;
+    conn->file_fd = -1;
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    conn->buffer_index = -1;
+    conn->state = CONN_READ_REQUEST;
+    metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+    return conn;
+}
+
+/*
+ * Any request bytes we never read are discarded before closing.
+ * Closing a socket with unread data makes the kernel send a RST, which can destroy the response
+   the client has not read yet. Draining first lets close() end the connection with a normal FIN.
+ */
+void connection_destroy(struct connection *conn) {
+    char discard[512];
+    while (recv(conn->fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+    }
+    connection_reset_response(conn);
+    if (conn->pipe_fds[0] >= 0) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+    }
+    close(conn->fd); // Closing the descriptor also removes it from the epoll set
+    admission_release(conn->admission_slot);
+    release_io(conn);
+    pool_put(&connection_pool, conn);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+}
+
+int connection_borrow_io(struct connection *conn) {
+    if (conn->io) return 0;
+    conn->io = pool_take(&io_pool);
+    if (!conn->io) return -1;
+    http_request_init(&conn->io->parser);
+    metrics_add(METRIC_IO_BUFFERS_BORROWED, 1);
+    return 0;
+}
+
+void connection_return_io(struct connection *conn) {
+    if (conn->request_len == 0) release_io(conn);
+}
+
+static void connection_close(struct event_loop *loop, struct connection *conn) {
+    timer_wheel_cancel(&loop->timers, conn);
+    connection_destroy(conn);
+}
+
+long connection_parse(struct connection *conn) {
+    if (conn->request_len == 0) return HTTP_PARSE_INCOMPLETE;
+    uint64_t start = metrics_now();
+    long status = http_parse_request(&conn->io->parser, conn->io->request, conn->request_len);
+    uint64_t end = metrics_now();
+    conn->parse_time += end - start;
+    if (status == HTTP_PARSE_INCOMPLETE && conn->request_len == sizeof(conn->io->request)) status = HTTP_PARSE_TOO_LARGE;
+    if (status != HTTP_PARSE_INCOMPLETE) conn->request_start = end; // Every later stage is timed from here
+    return status;
+}
+
+/*
+ * Reads until the socket would block or a full request head has been parsed.
+ * Bytes already buffered from an earlier read (pipelined requests) are parsed before reading again.
+ * The parser resumes where it stopped, so a request arriving in many small pieces is still only scanned once.
+ * Returns the length of the request head when one is ready, 0 when more data is needed and a negative
+   value when the connection must end: READ_CLOSED, or an http_parse_status the client should be told about.
+ */
+#define READ_CLOSED -100
+
+static long read_request(struct connection *conn) {
+    if (connection_borrow_io(conn) < 0) return READ_CLOSED;
+    for (;;) {
+        long status = connection_parse(conn);
+        if (status != HTTP_PARSE_INCOMPLETE) return status;
+
+        ssize_t n = recv(conn->fd, conn->io->request + conn->request_len, sizeof(conn->io->request) - conn->request_len, 0);
+        if (n > 0) {
+            conn->request_len += n;
+        } else if (n == 0) {
+            return READ_CLOSED;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            connection_return_io(conn); // Woken up without a byte of a request, e.g. by EPOLLOUT
+            return 0;
+        } else if (errno != EINTR) {
+            return READ_CLOSED;
+        }
+    }
+}
+
+/*
+ * Decides whether the connection stays open after this response.
+ * HTTP/1.1 keeps connections open unless the client sends "Connection: close",
+   HTTP/1.0 only does so when the client asks for "Connection: keep-alive".
+ * Requests with a body are not expected by this server; we cannot tell where the next pipelined
+   request would start, so such connections are closed after the response.
+ * The parser already rejected heads with a second Content-Length or with both framing headers,
+   so the first Content-Length is the only one.
+ */
+static int wants_keep_alive(const struct connection *conn, const struct http_request *request) {
+    if (conn->requests_served + 1 >= MAX_KEEPALIVE_REQUESTS) return 0;
+
+    if (http_request_header(request, "Transfer-Encoding")) return 0;
+    const struct http_slice *content_length = http_request_header(request, "Content-Length");
+    if (content_length && !http_slice_equals(*content_length, "0")) return 0;
+
+    // Connection is a list of options, "close, TE" closes as well
+    if (http_request_has_token(request, "Connection", "close")) return 0;
+    if (request->minor_version == 1) return 1;
+    return http_request_has_token(request, "Connection", "keep-alive");
+}
+
+void connection_sent(struct connection *conn, size_t n) {
+    if (!conn->first_byte_sent && n > 0) {
+        conn->first_byte_sent = 1;
+        metrics_record_latency(METRIC_STAGE_FIRST_BYTE, metrics_now() - conn->request_start);
+    }
+    conn->response_bytes += n;
+    conn->window_sent += n;
+    while (conn->iov_index < conn->iov_count && n >= conn->iov[conn->iov_index].iov_len) {
+        n -= conn->iov[conn->iov_index].iov_len;
+        conn->iov_index++;
+    }
+    if (conn->iov_index < conn->iov_count) {
+        conn->iov[conn->iov_index].iov_base = (char *)conn->iov[conn->iov_index].iov_base + n;
+        conn->iov[conn->iov_index].iov_len -= n;
+    }
+}
+
+void connection_dispatch(struct connection *conn, long length, request_handler handler) {
+    metrics_record_latency(METRIC_STAGE_PARSE, conn->parse_time);
+    if (length < 0) {
+        // The request cannot be parsed, tell the client why and hang up
+        conn->keep_alive = 0;
+        if (length == HTTP_PARSE_TOO_LARGE) connection_send_response(conn, too_large_response, sizeof(too_large_response) - 1);
+        else connection_send_response(conn, bad_request_response, sizeof(bad_request_response) - 1);
+        return;
+    }
+
+    conn->keep_alive = !drain_requested && wants_keep_alive(conn, &conn->io->parser); // A draining server says goodbye
+    conn->request_consumed = length;
+    if (!rate_limit_request(conn, conn->request_start)) return; // Answered with a 429
+    handler(conn, &conn->io->parser);
+    if (conn->state == CONN_READ_REQUEST) conn->state = CONN_CLOSE; // Handler chose not to answer
+}
+
+int connection_finish_response(struct connection *conn) {
+    uint64_t duration = metrics_now() - conn->request_start;
+    metrics_record_latency(METRIC_STAGE_RESPONSE, duration);
+    access_log_record(conn, duration); // Before the request slices go away below
+    rate_limit_charge(conn, conn->response_bytes);
+    metrics_record_response(conn->status, conn->mime_type, conn->response_bytes);
+    conn->parse_time = 0;
+    conn->first_byte_sent = 0;
+    conn->mime_type = NULL;
+    conn->response_bytes = 0;
+
+    connection_reset_response(conn);
+    conn->requests_served++;
+    if (!conn->keep_alive || drain_requested) {
+        conn->state = CONN_CLOSE;
+        return 0;
+    }
+
+    // Keep any pipelined bytes that arrived behind the request we just answered
+    conn->request_len -= conn->request_consumed;
+    memmove(conn->io->request, conn->io->request + conn->request_consumed, conn->request_len);
+    conn->request_consumed = 0;
+    http_request_init(&conn->io->parser);
+    connection_return_io(conn); // Unless the next request has already started to arrive
+    conn->state = CONN_READ_REQUEST;
+    return 1;
+}
+
+/*
+ * Writes as much of the queued memory pieces as the socket accepts, all pieces in one sendmsg() call.
+ * After a partial write the sent bytes are trimmed off the front of iov, so the next call resumes there.
+ * Returns 0 when everything is sent, 1 on EAGAIN, -1 on error.
+ * flags may add MSG_MORE to tell the kernel more data follows, so a short header is not sent in a segment of its own.
+ */
+static int send_pending(struct connection *conn, int flags) {
+    while (conn->iov_index < conn->iov_count) {
+        struct msghdr message = {.msg_iov = conn->iov + conn->iov_index, .msg_iovlen = conn->iov_count - conn->iov_index};
+        ssize_t n = sendmsg(conn->fd, &message, MSG_NOSIGNAL | flags);
+        if (n >= 0) {
+            connection_sent(conn, n);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 1;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Fallback for sources sendfile() refuses: the kernel moves the data file -> pipe -> socket with splice(),
+   still without copying it through user space.
+ * pipe_pending counts bytes already moved into the pipe but not yet written to the socket,
+   so a partial write simply resumes from the pipe on the next EPOLLOUT.
+ */
+static int splice_file_body(struct connection *conn) {
+    if (conn->pipe_fds[0] < 0 && pipe2(conn->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) return -1;
+
+    while (conn->body_remaining > 0 || conn->pipe_pending > 0) {
+        if (conn->pipe_pending == 0) {
+            size_t chunk = conn->body_remaining < SPLICE_CHUNK_SIZE ? (size_t)conn->body_remaining : SPLICE_CHUNK_SIZE;
+            // Seekable files are read at our own offset, since other connections may share the descriptor
+            loff_t *offset = conn->file_seekable ? &conn->file_offset : NULL;
+            ssize_t n = splice(conn->file_fd, offset, conn->pipe_fds[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return -1; // The source ended early or failed
+            conn->pipe_pending = n;
+            conn->body_remaining -= n;
+        }
+
+        unsigned int more = conn->body_remaining > 0 ? SPLICE_F_MORE : 0;
+        ssize_t n = splice(conn->pipe_fds[0], NULL, conn->fd, NULL, conn->pipe_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | more);
+        if (n > 0) {
+            conn->pipe_pending -= n;
+            conn->window_sent += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Sends the file body with sendfile(), which copies straight from the page cache to the socket.
+ * sendfile() advances file_offset itself, so after a partial write (EAGAIN) we resume exactly where it stopped.
+ * Returns 0 when the body is complete, 1 when the socket is full and -1 on error.
+ */
+static int send_file_body(struct connection *conn) {
+    while (conn->body_remaining > 0 && !conn->use_splice) {
+        ssize_t n = sendfile(conn->fd, conn->file_fd, &conn->file_offset, conn->body_remaining);
+        if (n > 0) {
+            conn->body_remaining -= n;
+            conn->window_sent += n;
+        } else if (n == 0) {
+            return -1; // The file shrank underneath us
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EINVAL || errno == ENOSYS) {
+            // The source does not support sendfile(), carry on from the same position with splice()
+            conn->file_seekable = lseek(conn->file_fd, 0, SEEK_CUR) >= 0;
+            conn->use_splice = 1;
+        } else {
+            return -1;
+        }
+    }
+    if (conn->use_splice) return splice_file_body(conn);
+    return 0;
+}
+
+/*
+ * Advances the connection as far as it can go without blocking.
+ * With edge-triggered epoll we only get told once that the socket became readable or writable,
+   so every state keeps going until the kernel answers EAGAIN.
+ * Returns 0 if the connection is still alive and -1 once it has been closed and freed.
+ */
+static int connection_drive(struct event_loop *loop, struct connection *conn) {
+    for (;;) {
+        switch (conn->state) {
+        case CONN_READ_REQUEST: {
+            long length = read_request(conn);
+            if (length == 0) {
+                // The keep-alive wait ends with the first byte, the whole head must follow within HEADER_TIMEOUT
+                if (conn->timer == TIMER_IDLE && conn->request_len > 0) {
+                    connection_set_timer(&loop->timers, conn, TIMER_HEADER, loop->now);
+                }
+                return 0;
+            }
+            if (length == READ_CLOSED) {
+                conn->state = CONN_CLOSE;
+                break;
+            }
+            connection_set_timer(&loop->timers, conn, TIMER_SEND, loop->now);
+            connection_dispatch(conn, length, loop->handler);
+            break;
+        }
+
+        case CONN_SEND_HEADERS: {
+            // With a file body or another part following, MSG_MORE lets the header share its segment with the next bytes
+            int flags = conn->body_remaining > 0 || conn->next_part ? MSG_MORE : 0;
+            int status = send_pending(conn, flags);
+            if (status > 0) return 0;
+            if (status < 0) {
+                conn->state = CONN_CLOSE;
+                break;
+            }
+            conn->state = CONN_SEND_BODY;
+            break;
+        }
+
+        case CONN_SEND_BODY: {
+            if (conn->body_remaining > 0 || conn->pipe_pending > 0) {
+                int status = send_file_body(conn);
+                if (status > 0) return 0;
+                if (status < 0) {
+                    conn->state = CONN_CLOSE;
+                    break;
+                }
+            }
+
+            // This part is out, a response sent in parts may have another one
+            if (conn->next_part && conn->next_part(conn, conn->release_arg)) {
+                conn->state = CONN_SEND_HEADERS;
+                break;
+            }
+
+            // The whole response is out, either wait for the next request or hang up.
+            if (connection_finish_response(conn)) connection_set_timer(&loop->timers, conn, TIMER_IDLE, loop->now);
+            break;
+        }
+
+        case CONN_CLOSE:
+            connection_close(loop, conn);
+            return -1;
+        }
+    }
+}
+
+// Accepts every pending client. The listener is edge-triggered, so we must keep going until EAGAIN.
+static void accept_connections(struct event_loop *loop) {
+    for (;;) {
+        int client_fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Accepting failed");
+                metrics_add(METRIC_ACCEPT_ERRORS, 1);
+            }
+            return;
+        }
+
+        int slot;
+        if (!admission_admit(client_fd, &slot)) continue; // Over a connection limit, answered with a 503 and closed
+
+        struct connection *conn = connection_create(client_fd, slot);
+        if (!conn) {
+            perror("Memory allocation failed");
+            metrics_add(METRIC_ACCEPT_ERRORS, 1);
+            admission_release(slot);
+            close(client_fd);
+            continue;
+        }
+
+        /*
+         * The socket is registered for both reading and writing once, with EPOLLET.
+         * Edge-triggered mode only reports changes, so we never need to switch the interest set
+           between the read and write phases of the state machine.
+         */
+        struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn};
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0) {
+            perror("epoll_ctl failed");
+            metrics_add(METRIC_ACCEPT_ERRORS, 1);
+            connection_destroy(conn);
+            continue;
+        }
+        connection_set_timer(&loop->timers, conn, TIMER_HEADER, loop->now);
+    }
+}
+
+// Closes connections that are too slow to send a request or to read their response, or idle for too long.
+static void expire_connections(struct event_loop *loop) {
+    struct connection *conn;
+    while ((conn = timer_wheel_expired(&loop->timers, loop->now))) {
+        if (connection_timed_out(&loop->timers, conn, loop->now)) connection_close(loop, conn);
+    }
+}
+
+static void close_idle_connection(void *arg, struct connection *conn) {
+    if (conn->request_len == 0) connection_close(arg, conn); // Nothing of a next request has arrived yet
+}
+
+static void start_draining(struct event_loop *loop) {
+    loop->draining = 1;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listen_fd, NULL);
+    timer_wheel_each(&loop->timers, TIMER_IDLE, close_idle_connection, loop);
+}
+
+int event_loop_run(int listen_fd, request_handler handler) {
+    if (event_loop_stop_fd() < 0) return -1;
+    if (backend == EVENT_LOOP_URING) return uring_loop_run(listen_fd, handler);
+
+    if (set_nonblocking(listen_fd) < 0) {
+        perror("Setting non-blocking mode failed");
+        return -1;
+    }
+
+    struct event_loop loop = {.listen_fd = listen_fd, .handler = handler, .now = event_loop_monotonic_seconds()};
+    timer_wheel_init(&loop.timers, loop.now);
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return -1;
+    }
+
+    // The listening socket is the only registration with a NULL pointer, that is how we tell it apart.
+    struct epoll_event event = {.events = EPOLLIN | EPOLLET, .data.ptr = NULL};
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0) {
+        perror("epoll_ctl failed");
+        close(loop.epoll_fd);
+        return -1;
+    }
+    struct epoll_event stop_event = {.events = EPOLLIN, .data.ptr = &stop_marker};
+    struct epoll_event drain_event = {.events = EPOLLIN | EPOLLET, .data.ptr = &drain_marker};
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, stop_fd, &stop_event) < 0 ||
+        epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, drain_fd, &drain_event) < 0) {
+        perror("epoll_ctl failed");
+        close(loop.epoll_fd);
+        return -1;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!stop_requested) {
+        // Only wake up periodically while there are connections that may time out
+        int timeout = loop.timers.count ? 1000 : -1;
+        int count = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR) continue; // A signal arrived, re-check the stop flag
+            perror("epoll_wait failed");
+            break;
+        }
+        loop.now = event_loop_monotonic_seconds();
+
+        for (int i = 0; i < count; i++) {
+            struct connection *conn = events[i].data.ptr;
+            if ((void *)conn == &stop_marker || (void *)conn == &drain_marker) continue;
+            if (!conn) {
+                if (!loop.draining) accept_connections(&loop);
+                continue;
+            }
+            if (events[i].events & EPOLLERR) {
+                conn->state = CONN_CLOSE;
+            }
+            connection_drive(&loop, conn);
+        }
+        expire_connections(&loop);
+
+        if (drain_requested && !loop.draining) start_draining(&loop);
+        if (event_loop_drained(loop.now, loop.timers.count)) break; // Every open connection sits on the wheel
+    }
+
+    close(loop.epoll_fd);
+    return 0;
+}
@@ -0,0 +1,195 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "http_parser.h"
+
+#define REQUEST_BUFFER_SIZE 2048 // Room for the request line and headers of one request, larger heads get a 431
+#define HEADER_BUFFER_SIZE 768   // Room for a formatted response header, Cache-Control line included
+#define HEADER_TAIL_SIZE 224     // Room for the Cache-Control, Date and Connection lines ending a pre-rendered header
+#define RESPONSE_MAX_IOV 4       // Memory pieces one response may be gathered from
+#define SPLICE_CHUNK_SIZE 65536  // Bytes moved per splice() when sendfile() cannot be used
+#define MAX_EVENTS 256           // Events handled per epoll_wait() call
+#define KEEPALIVE_TIMEOUT 5      // Seconds a connection may wait for its next request
+#define HEADER_TIMEOUT 10        // Seconds from accepting, or the first byte of a later request, until its head is complete
+#define SEND_TIMEOUT 10          // Seconds in a send window, see SEND_MIN_RATE
+#define SEND_MIN_RATE 1024       // Bytes per second a client must read on average over each send window
+#define MAX_KEEPALIVE_REQUESTS 100 // Requests served on one connection before it is closed
+
+/*
+ * Every connection moves through these states in order.
+ * After the body is sent the connection is either closed or, when keep_alive is set,
+   goes back to CONN_READ_REQUEST to wait for the next request.
+ */
+enum connection_state {
+    CONN_READ_REQUEST,
+    CONN_SEND_HEADERS,
+    CONN_SEND_BODY,
+    CONN_CLOSE
+};
+
+/*
+ * The timeout a connection is waiting on. There is always exactly one, so a connection sits on its
+   event loop's timer wheel from accept until close.
+ */
+enum connection_timer {
+    TIMER_NONE,
+    TIMER_HEADER, // Reading a request head, slow clients trickling in headers (slowloris) end here
+    TIMER_SEND,   // Sending a response, renewed every SEND_TIMEOUT while the client keeps reading fast enough
+    TIMER_IDLE    // Waiting for the next request on a kept-alive connection
+};
+
+/*
+ * The memory a connection needs only while a request is on its way in or a response on its way out.
+ * It is borrowed from a pool of the event loop's thread when the first byte of a request arrives and returned
+   once the response is sent and no pipelined bytes are left, so a connection waiting for its next request
+   holds just its struct connection.
+ */
+struct io_buffer {
+    char request[REQUEST_BUFFER_SIZE]; // Bytes received so far, may hold several pipelined requests
+    struct http_request parser; // Parsed request line and headers, slices into request
+    char header[HEADER_BUFFER_SIZE]; // Storage for headers built by the request handler
+    char header_tail[HEADER_TAIL_SIZE]; // Cache-Control, Date and Connection lines after a pre-rendered header, see http_header_tail()
+};
+
+struct connection {
+    int fd;                      // Non-blocking client socket
+    enum connection_state state;
+
+    struct io_buffer *io; // NULL while no request is in progress
+    size_t request_len;   // Bytes in io->request
+    size_t request_consumed; // Length of the request being answered, dropped from request once it is done
+
+    struct iovec iov[RESPONSE_MAX_IOV]; // Memory parts of the response, sent in order with one sendmsg()
+    int iov_count;
+    int iov_index; // First part not completely sent yet
+    void (*release)(void *); // Called once the memory behind iov is no longer needed
+    void *release_arg;
+    int (*next_part)(struct connection *, void *); // Queues the next part of a response sent in several parts
+
+    int file_fd;          // File streamed as the body, -1 when the response has no file body
+    off_t file_offset;    // Next file byte to send
+    off_t body_remaining; // File bytes not yet handed to the kernel
+    int owns_file_fd;     // Close file_fd once the response is done (otherwise release takes care of it)
+    int use_splice;       // sendfile() refused this file, use splice() through pipe_fds instead
+    int file_seekable;    // splice() reads at file_offset instead of the shared file position
+    int pipe_fds[2];      // Created on first use of splice(), kept for later responses
+    size_t pipe_pending;  // Bytes sitting in the pipe, not yet written to the socket
+
+    // io_uring backend only
+    int pending_ops;      // Operations submitted and not completed yet, conn is only freed once they are
+    int closing;          // Close once pending_ops drops to 0
+    struct msghdr message; // Must stay valid until the kernel has picked up the sendmsg
+    int buffer_index;     // Registered buffer the file body is read into, -1 when none is held
+    size_t chunk_len;     // Bytes read into that buffer
+    size_t chunk_sent;    // Bytes of the buffer already sent
+    struct connection *buffer_wait_next; // Next connection waiting for a free buffer
+
+    int keep_alive; // Wait for another request instead of closing once the response is sent
+    unsigned requests_served;
+
+    // Metrics of the request being answered, see metrics.h
+    uint64_t parse_time;     // Nanoseconds spent parsing its head
+    uint64_t request_start;  // metrics_now() once the head was parsed
+    int first_byte_sent;
+    int status;              // Read from the status line of the queued response
+    const char *mime_type;   // Type of the response body, a static string the handler may set
+    uint64_t response_bytes; // Memory bytes sent plus the length of every file body queued
+    char peer[48];           // Client address for the access log, looked up on its first line
+    int admission_slot;      // Returned to admission_release() on close, see admission.h
+    unsigned char address[16]; // Client address for rate limiting, IPv4 mapped into IPv6
+    int address_known;       // 1 once address is looked up, -1 if the client has none
+
+    // Slot on the event loop's timer wheel
+    enum connection_timer timer;
+    time_t deadline;
+    uint64_t window_sent; // Bytes sent in the current send window
+    int64_t window_queued; // Bytes in the socket's send queue when the window started, -1 if unknown
+    struct connection *timer_prev;
+    struct connection *timer_next;
+};
+
+/*
+ * A request handler is called once a full request head has arrived and been parsed.
+ * The slices in request point into the connection's buffer and are only valid during the call.
+ * It must queue a response with connection_send_response() or connection_send_file().
+ * If it queues nothing, the connection is closed.
+ * conn->keep_alive tells the handler whether the connection stays open after this response.
+   Responses must carry a Content-Length so the client knows where they end.
+ */
+typedef void (*request_handler)(struct connection *conn, const struct http_request *request);
+
+// Queue a response that is already complete in memory. The data must stay valid until it is sent.
+void connection_send_response(struct connection *conn, const char *response, size_t length);
+
+// Like connection_send_response(), but copies the response (at most HEADER_BUFFER_SIZE bytes) into the connection first.
+void connection_send_copy(struct connection *conn, const char *response, size_t length);
+
+/*
+ * Queue a response gathered from count (at most RESPONSE_MAX_IOV) pieces of memory, written with a single sendmsg().
+ * release(release_arg), if given, is called once the pieces are no longer needed (the response was sent or the connection closed).
+ */
+void connection_send_buffers(struct connection *conn, const struct iovec *pieces, int count,
+                             void (*release)(void *), void *release_arg);
+
+/*
+ * Queue a header followed by the first length bytes of file_fd. The connection takes ownership of file_fd.
+ * The body goes out with sendfile(), so file data never passes through user space.
+ */
+void connection_send_file(struct connection *conn, const char *header, size_t header_length, int file_fd, off_t length);
+
+/*
+ * For responses sent in several parts, e.g. the ranges of a multipart/byteranges response.
+ * Once the queued pieces and file body are sent, next_part(conn, release_arg) is called. It queues the
+   following part with connection_queue_part() (and connection_add_file_body()) and returns 1, or returns 0
+   when the response is complete. It should clear itself when it queues the last part, so that part is not
+   held back with MSG_MORE.
+ */
+void connection_set_next_part(struct connection *conn, int (*next_part)(struct connection *conn, void *arg));
+
+// Replaces the memory pieces of the current response without touching its release callback or next_part.
+void connection_queue_part(struct connection *conn, const struct iovec *pieces, int count);
+
+/*
+ * Adds length bytes of file_fd, starting at offset, after the memory pieces of the queued response.
+ * With owns_fd set the connection closes file_fd when done; otherwise file_fd must stay open until
+   the release callback of the response runs. The descriptor's own file position is never used,
+   so one descriptor can be shared by many connections.
+ */
+void connection_add_file_body(struct connection *conn, int file_fd, off_t offset, off_t length, int owns_fd);
+
+enum event_loop_backend {
+    EVENT_LOOP_EPOLL, // epoll readiness, non-blocking recv/sendmsg/sendfile (the default)
+    EVENT_LOOP_URING  // io_uring completions: accept, recv, send and file reads are submitted in batches
+};
+
+// Picks how event_loop_run() does its I/O. Must be called before any loop starts.
+void event_loop_set_backend(enum event_loop_backend backend);
+
+/*
+ * Runs an event loop (edge-triggered epoll, or io_uring if selected) that accepts clients on listen_fd
+   and drives every connection through its state machine on the calling thread.
+ * Several loops may run at once on different threads, each with its own listening socket.
+ * The loop runs until event_loop_stop() is called, or until it has drained after event_loop_drain().
+ * Returns 0 on a clean stop, -1 if the loop could not be set up.
+ */
+int event_loop_run(int listen_fd, request_handler handler);
+
+// Ask every running event loop to return. Only async-signal-safe calls are used, so signal handlers may call it.
+void event_loop_stop(void);
+
+/*
+ * Ask every running event loop to finish its work and return. A draining loop stops accepting (its listening
+   socket stays open, a new process may have taken it over), closes the connections waiting for another
+   request and answers the requests in flight with "Connection: close".
+ * A loop returns once its last connection is closed, or timeout seconds from now at the latest.
+ * Async-signal-safe, like event_loop_stop().
+ */
+void event_loop_drain(int timeout);
+
+#endif
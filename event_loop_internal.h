@@ -0,0 +1,105 @@
+#ifndef EVENT_LOOP_INTERNAL_H
+#define EVENT_LOOP_INTERNAL_H
+
+#include <time.h>
+
+#include "event_loop.h"
+
+/*
+ * Shared by the epoll (event_loop.c) and io_uring (uring_loop.c) backends.
+ * Everything about a request and its response is handled here the same way for both,
+   the backends only differ in how bytes get in and out of the sockets.
+ */
+
+#define TIMER_WHEEL_SLOTS 64 // A power of two, longer than any timeout
+
+/*
+ * The deadlines of every connection of one loop, to the second.
+ * A connection due at second d sits in the list of slot d % TIMER_WHEEL_SLOTS, so setting, moving and
+   cancelling a timer is O(1) however many connections there are, and expiring only looks at the slots
+   of the seconds that passed. A deadline further away than the wheel is skipped until its round comes.
+ */
+struct timer_wheel {
+    struct connection *slots[TIMER_WHEEL_SLOTS];
+    time_t current; // First second whose slot has not been expired yet
+    int count;      // Connections on the wheel, the loop only wakes up every second while there are any
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, time_t now);
+void timer_wheel_cancel(struct timer_wheel *wheel, struct connection *conn);
+
+// Calls callback(arg, conn) for every connection waiting on timer. The callback may close the connection.
+void timer_wheel_each(struct timer_wheel *wheel, enum connection_timer timer,
+                      void (*callback)(void *arg, struct connection *conn), void *arg);
+
+/*
+ * Returns a connection whose deadline is at or before now, or NULL when there is none.
+ * It is still on the wheel: move it to another timer or close it before calling again.
+ */
+struct connection *timer_wheel_expired(struct timer_wheel *wheel, time_t now);
+
+// Moves conn to the given timeout, starting now. TIMER_SEND also starts a new send window.
+void connection_set_timer(struct timer_wheel *wheel, struct connection *conn, enum connection_timer timer, time_t now);
+
+/*
+ * Decides about a connection that timer_wheel_expired() returned.
+ * A response still read at SEND_MIN_RATE gets another send window and 0 is returned. Otherwise the timeout
+   is counted and 1 is returned: the connection must be closed.
+ */
+int connection_timed_out(struct timer_wheel *wheel, struct connection *conn, time_t now);
+
+time_t event_loop_monotonic_seconds(void);
+
+// The eventfd event_loop_stop() writes to, created on first use. Every loop must watch it.
+int event_loop_stop_fd(void);
+int event_loop_stopping(void);
+
+// The eventfd event_loop_drain() writes to, created along with the stop eventfd. Every loop must watch it too.
+int event_loop_drain_fd(void);
+int event_loop_draining(void);
+
+// Returns 1 once a draining loop with this many connections left should return.
+int event_loop_drained(time_t now, int connections);
+
+/*
+ * Allocates a connection for an accepted socket that admission_admit() let in, waiting for its first request.
+ * connection_destroy() hands admission_slot back.
+ */
+struct connection *connection_create(int fd, int admission_slot);
+
+// Releases the response, drains unread input, closes the socket and returns conn and its io_buffer to their pools.
+void connection_destroy(struct connection *conn);
+
+// Gives conn an io_buffer to receive a request into, unless it holds one. Returns -1 when none can be allocated.
+int connection_borrow_io(struct connection *conn);
+
+// Hands conn's io_buffer back to the pool, unless bytes of a request are buffered in it.
+void connection_return_io(struct connection *conn);
+
+/*
+ * Parses the bytes buffered so far, conn must hold an io_buffer. Returns the length of a complete request head, HTTP_PARSE_INCOMPLETE,
+   or an http_parse_status to answer with (HTTP_PARSE_TOO_LARGE once the buffer is full).
+ */
+long connection_parse(struct connection *conn);
+
+/*
+ * Hands a complete request (length > 0) to handler, or queues the error response for a parse failure.
+ * Afterwards conn is in CONN_SEND_HEADERS, or CONN_CLOSE when the handler queued nothing.
+ */
+void connection_dispatch(struct connection *conn, long length, request_handler handler);
+
+// Drops n sent bytes off the front of the queued memory pieces.
+void connection_sent(struct connection *conn, size_t n);
+
+void connection_reset_response(struct connection *conn);
+
+/*
+ * Ends the response that was just sent. Returns 1 if the connection now waits for its next request
+   (pipelined bytes already buffered are kept), 0 if it must be closed.
+ */
+int connection_finish_response(struct connection *conn);
+
+// The io_uring backend, see event_loop_set_backend().
+int uring_loop_run(int listen_fd, request_handler handler);
+
+#endif
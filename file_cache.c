@@ -0,0 +1,524 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "compression.h"
+#include "file_cache.h"
+#include "http_header.h"
+#include "metrics.h"
+#include "web_root.h"
+
+#define CACHE_SHARDS 16   // Independent locks, so workers rarely wait on each other
+#define CACHE_BUCKETS 512 // Hash buckets per shard
+
+/*
+ * The cache is split into shards by path hash. Each shard has its own lock, hash table,
+   LRU list (most recently used first) and an equal share of the byte budget and open file limit.
+ * generation is bumped whenever a path of the shard is invalidated, see file_cache_put().
+ */
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_entry *buckets[CACHE_BUCKETS];
+    struct cache_entry *lru_head;
+    struct cache_entry *lru_tail;
+    size_t bytes;
+    unsigned long entries;
+    unsigned long open_files;
+    unsigned long generation;
+};
+
+static struct cache_shard shards[CACHE_SHARDS];
+static size_t shard_budget = 0;
+static unsigned long shard_open_files = 0;
+static size_t max_object_size = 0;
+static int compression_level = COMPRESSION_DEFAULT_LEVEL;
+static int watched = 0;
+static size_t root_len; // Of the prefix that stands for the web root, the rest of a key is the path below it
+
+static unsigned long stat_evictions, stat_invalidations; // Hits and misses are counted per thread in metrics.c
+
+void file_cache_init(size_t budget, size_t max_object) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+    shard_budget = budget / CACHE_SHARDS;
+    shard_open_files = CACHE_MAX_OPEN_FILES / CACHE_SHARDS;
+    max_object_size = max_object;
+}
+
+void file_cache_set_compression(int level) {
+    compression_level = level;
+}
+
+void file_cache_set_root(const char *root) {
+    root_len = strlen(root);
+    while (root_len > 0 && root[root_len - 1] == '/') root_len--;
+}
+
+void file_cache_set_watched(int value) {
+    __atomic_store_n(&watched, value, __ATOMIC_RELEASE);
+}
+
+int file_cache_key(const char *path, char *out, size_t size) {
+    size_t length = 0;
+    while (*path) {
+        if (*path == '/' && length > 0 && out[length - 1] == '/') {
+            path++; // Repeated slash
+            continue;
+        }
+        if (path[0] == '.' && path[1] == '/' && length > 0 && out[length - 1] == '/') {
+            path += 2; // "/./" segment
+            continue;
+        }
+        if (length + 1 >= size) return -1;
+        out[length++] = *path++;
+    }
+    out[length] = '\0';
+    return 0;
+}
+
+// FNV-1a, short paths make this cheaper than anything fancier
+static unsigned long hash_path(const char *path) {
+    unsigned long hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+static struct cache_shard *shard_for(unsigned long hash) {
+    return &shards[hash % CACHE_SHARDS];
+}
+
+static time_t monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static void lru_unlink(struct cache_shard *shard, struct cache_entry *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else shard->lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else shard->lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(struct cache_shard *shard, struct cache_entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->lru_prev = entry;
+    else shard->lru_tail = entry;
+    shard->lru_head = entry;
+}
+
+void file_cache_release(struct cache_entry *entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        for (int i = 0; i < ENCODING_COUNT; i++) {
+            if (entry->variants[i]) file_cache_release(entry->variants[i]);
+        }
+        if (entry->fd >= 0) close(entry->fd);
+        free(entry);
+    }
+}
+
+// Takes entry out of the table and drops the table's reference. Caller holds the shard lock.
+static void shard_remove(struct cache_shard *shard, struct cache_entry *entry) {
+    struct cache_entry **link = &shard->buckets[entry->hash % CACHE_BUCKETS];
+    while (*link != entry) link = &(*link)->hash_next;
+    *link = entry->hash_next;
+    lru_unlink(shard, entry);
+    shard->bytes -= entry->charge;
+    shard->entries--;
+    shard->open_files -= entry->open_files;
+    file_cache_release(entry);
+}
+
+static struct cache_entry *shard_find(struct cache_shard *shard, unsigned long hash, const char *key) {
+    for (struct cache_entry *entry = shard->buckets[hash % CACHE_BUCKETS]; entry; entry = entry->hash_next) {
+        if (entry->hash == hash && strcmp(entry->path, key) == 0) return entry;
+    }
+    return NULL;
+}
+
+static int same_file(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+struct cache_entry *file_cache_get(const char *path, unsigned long *generation) {
+    *generation = 0;
+    if (shard_budget == 0) return NULL;
+
+    char key[CACHE_PATH_MAX];
+    if (file_cache_key(path, key, sizeof(key)) < 0) return NULL;
+    unsigned long hash = hash_path(key);
+    struct cache_shard *shard = shard_for(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    struct cache_entry *entry = shard_find(shard, hash, key);
+    if (!entry) {
+        *generation = shard->generation;
+        pthread_mutex_unlock(&shard->lock);
+        metrics_add(METRIC_CACHE_MISSES, 1);
+        return NULL;
+    }
+    lru_unlink(shard, entry);
+    lru_push_front(shard, entry);
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+
+    int revalidate = 0;
+    if (!__atomic_load_n(&watched, __ATOMIC_ACQUIRE)) {
+        time_t now = monotonic_seconds();
+        revalidate = now - entry->checked_at >= CACHE_REVALIDATE_INTERVAL;
+        if (revalidate) entry->checked_at = now; // Other threads keep serving it while we check
+    }
+    unsigned long current_generation = shard->generation;
+    pthread_mutex_unlock(&shard->lock);
+
+    // The stat() happens outside the lock so a slow filesystem never stalls other workers
+    struct stat file_stat;
+    if (revalidate && (web_root_stat(key + root_len, &file_stat) < 0 || !same_file(&entry->file_stat, &file_stat))) {
+        pthread_mutex_lock(&shard->lock);
+        if (shard_find(shard, hash, key) == entry) shard_remove(shard, entry);
+        current_generation = ++shard->generation;
+        pthread_mutex_unlock(&shard->lock);
+        file_cache_release(entry);
+        *generation = current_generation;
+        metrics_add(METRIC_CACHE_MISSES, 1);
+        return NULL;
+    }
+
+    metrics_add(METRIC_CACHE_HITS, 1);
+    return entry;
+}
+
+/*
+ * Allocates an entry with its key, both headers and, for in-memory entries, room for the content, all in one block.
+ * encoding is the Content-Encoding of the content or NULL, vary adds "Vary: Accept-Encoding" to the headers.
+ * The caller fills in the content, or the descriptor for entries that are not kept in memory.
+ */
+static struct cache_entry *entry_create(const char *key, const char *mime_type, const char *encoding, int vary,
+                                        const struct file_validators *validators, off_t size, int in_memory) {
+    char header[HEADER_BUFFER_SIZE];
+    char not_modified[HEADER_BUFFER_SIZE];
+    size_t not_modified_len;
+    int header_len = http_header_file_templates(header, not_modified, &not_modified_len, mime_type, size, encoding, vary, validators);
+    if (header_len < 0) return NULL;
+
+    size_t key_len = strlen(key) + 1;
+    size_t body_len = in_memory ? (size_t)size : 0;
+    size_t charge = sizeof(struct cache_entry) + key_len + header_len + not_modified_len + body_len;
+    struct cache_entry *entry = malloc(charge);
+    if (!entry) return NULL;
+    char *key_copy = (char *)(entry + 1);
+    char *header_copy = key_copy + key_len;
+    char *not_modified_copy = header_copy + header_len;
+    char *body = not_modified_copy + not_modified_len;
+
+    memcpy(key_copy, key, key_len);
+    memcpy(header_copy, header, header_len);
+    memcpy(not_modified_copy, not_modified, not_modified_len);
+    entry->hash = hash_path(key);
+    entry->refs = 1;
+    entry->charge = charge;
+    entry->checked_at = monotonic_seconds();
+    entry->path = key_copy;
+    entry->header = header_copy;
+    entry->header_len = header_len;
+    entry->not_modified = not_modified_copy;
+    entry->not_modified_len = not_modified_len;
+    entry->validators = *validators;
+    entry->mime_type = mime_type;
+    entry->encoding = encoding;
+    memset(entry->variants, 0, sizeof(entry->variants));
+    entry->body = in_memory ? body : NULL;
+    entry->body_len = size;
+    entry->fd = -1;
+    entry->open_files = 0;
+    entry->fingerprinted = 0;
+    return entry;
+}
+
+/*
+ * Builds an entry for the opened file_fd: small files are read into memory and file_fd is closed,
+   larger ones keep file_fd open inside the entry.
+ * Returns NULL if the file could not be read, file_fd is then left to the caller.
+ */
+static struct cache_entry *entry_load(const char *key, int file_fd, const struct stat *file_stat, const char *mime_type,
+                                      const char *encoding, int vary) {
+    struct file_validators validators;
+    file_validators_init(&validators, file_stat);
+
+    // Content of small files is kept in memory, unless it alone would exceed this shard's share of the budget
+    size_t size = file_stat->st_size;
+    int in_memory = size <= max_object_size && sizeof(struct cache_entry) + CACHE_PATH_MAX + 2 * HEADER_BUFFER_SIZE + size <= shard_budget;
+    struct cache_entry *entry = entry_create(key, mime_type, encoding, vary, &validators, size, in_memory);
+    if (!entry) return NULL;
+
+    size_t done = 0;
+    while (in_memory && done < size) {
+        ssize_t n = pread(file_fd, (char *)entry->body + done, size - done, done);
+        if (n <= 0) {
+            free(entry); // The file changed size while we read it, let the caller stream it
+            return NULL;
+        }
+        done += n;
+    }
+    entry->file_stat = *file_stat;
+    if (in_memory) {
+        close(file_fd);
+    } else {
+        entry->fd = file_fd;
+        entry->open_files = 1;
+    }
+    return entry;
+}
+
+/*
+ * Looks for a precompressed sibling of the file (path.br, path.gz) and loads it.
+ * A sibling older than the file itself was not rebuilt after the file changed, so it is ignored.
+ */
+static struct cache_entry *variant_load(const char *key, const struct stat *file_stat, const char *mime_type, int encoding) {
+    char sibling[CACHE_PATH_MAX];
+    if (snprintf(sibling, sizeof(sibling), "%s%s", key, encoding_suffixes[encoding]) >= (int)sizeof(sibling)) return NULL;
+
+    int fd = web_root_open_file(sibling + root_len);
+    if (fd < 0) return NULL;
+    struct stat sibling_stat;
+    struct cache_entry *entry = NULL;
+    if (fstat(fd, &sibling_stat) == 0 && S_ISREG(sibling_stat.st_mode) && sibling_stat.st_mtim.tv_sec >= file_stat->st_mtim.tv_sec) {
+        entry = entry_load(sibling, fd, &sibling_stat, mime_type, encoding_names[encoding], 1);
+    }
+    if (!entry) close(fd);
+    return entry;
+}
+
+// Compresses an in-memory entry once, so no request ever waits for compression
+static struct cache_entry *variant_compress(const struct cache_entry *entry) {
+    size_t length;
+    char *compressed = compression_gzip(entry->body, entry->body_len, compression_level, &length);
+    if (!compressed) return NULL;
+
+    // The compressed bytes are a different representation and need their own ETag, "...-gz"
+    struct file_validators validators = entry->validators;
+    if (validators.etag_len + 3 < sizeof(validators.etag)) {
+        memcpy(validators.etag + validators.etag_len - 1, "-gz\"", 5);
+        validators.etag_len += 3;
+    }
+    struct cache_entry *variant = entry_create(entry->path, entry->mime_type, encoding_names[ENCODING_GZIP], 1,
+                                               &validators, length, 1);
+    if (variant) {
+        memcpy((char *)variant->body, compressed, length);
+        variant->file_stat = entry->file_stat;
+    }
+    free(compressed);
+    return variant;
+}
+
+struct cache_entry *file_cache_put(const char *path, unsigned long generation, int file_fd,
+                                   const struct stat *file_stat, const char *mime_type) {
+    if (shard_budget == 0 || !S_ISREG(file_stat->st_mode)) return NULL;
+
+    char key[CACHE_PATH_MAX];
+    if (file_cache_key(path, key, sizeof(key)) < 0) return NULL;
+
+    // Encoded versions made ahead of time are found next to the file
+    struct cache_entry *variants[ENCODING_COUNT] = {NULL};
+    int has_variants = 0;
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        variants[i] = variant_load(key, file_stat, mime_type, i);
+        if (variants[i]) has_variants = 1;
+    }
+
+    int compressible = compression_suitable(mime_type);
+    struct cache_entry *entry = entry_load(key, file_fd, file_stat, mime_type, NULL, compressible || has_variants);
+    if (!entry) {
+        for (int i = 0; i < ENCODING_COUNT; i++) {
+            if (variants[i]) file_cache_release(variants[i]);
+        }
+        return NULL;
+    }
+    if (entry->body) {
+        // While the content is still in the CPU cache from reading it
+        entry->fingerprint = cache_fingerprint(entry->body, entry->body_len);
+        entry->fingerprinted = 1;
+    }
+    if (!variants[ENCODING_GZIP] && compressible && compression_level > 0 && entry->body &&
+        entry->body_len >= COMPRESSION_MIN_SIZE) {
+        variants[ENCODING_GZIP] = variant_compress(entry);
+    }
+
+    // The entry holds the only reference to its variants and carries their cost
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        if (!variants[i]) continue;
+        entry->variants[i] = variants[i];
+        entry->charge += variants[i]->charge;
+        entry->open_files += variants[i]->open_files;
+    }
+    entry->refs = 2; // One for the table, one for the caller
+
+    struct cache_shard *shard = shard_for(entry->hash);
+    pthread_mutex_lock(&shard->lock);
+    if (shard->generation != generation) {
+        // The file changed while we were reading it, serve this response but do not keep it
+        pthread_mutex_unlock(&shard->lock);
+        entry->refs = 1;
+        return entry;
+    }
+
+    struct cache_entry *old = shard_find(shard, entry->hash, key);
+    if (old) shard_remove(shard, old);
+
+    struct cache_entry **bucket = &shard->buckets[entry->hash % CACHE_BUCKETS];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    lru_push_front(shard, entry);
+    shard->bytes += entry->charge;
+    shard->entries++;
+    shard->open_files += entry->open_files;
+
+    // Evict least recently used entries until the shard fits its budget and open file limit again
+    unsigned long evicted = 0;
+    while ((shard->bytes > shard_budget || shard->open_files > shard_open_files) && shard->lru_tail != entry) {
+        shard_remove(shard, shard->lru_tail);
+        evicted++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (evicted) __atomic_add_fetch(&stat_evictions, evicted, __ATOMIC_RELAXED);
+    return entry;
+}
+
+struct cache_entry *file_cache_negotiate(struct cache_entry *entry, const struct http_request *request) {
+    int any = 0;
+    for (int i = 0; i < ENCODING_COUNT; i++) any |= entry->variants[i] != NULL;
+    if (!any || http_request_header(request, "Range")) return entry;
+
+    int accepted = compression_accepted(request);
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        if ((accepted & (1 << i)) && entry->variants[i]) {
+            struct cache_entry *variant = entry->variants[i];
+            __atomic_add_fetch(&variant->refs, 1, __ATOMIC_RELAXED);
+            file_cache_release(entry);
+            return variant;
+        }
+    }
+    return entry;
+}
+
+void file_cache_invalidate(const char *path) {
+    if (shard_budget == 0) return;
+
+    char key[CACHE_PATH_MAX];
+    if (file_cache_key(path, key, sizeof(key)) < 0) return;
+    unsigned long hash = hash_path(key);
+    struct cache_shard *shard = shard_for(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    shard->generation++;
+    struct cache_entry *entry = shard_find(shard, hash, key);
+    if (entry) shard_remove(shard, entry);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (entry) __atomic_add_fetch(&stat_invalidations, 1, __ATOMIC_RELAXED);
+
+    // A precompressed sibling changed, the file it belongs to holds the old one as a variant
+    size_t key_len = strlen(key);
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        size_t suffix_len = strlen(encoding_suffixes[i]);
+        if (key_len > suffix_len && strcmp(key + key_len - suffix_len, encoding_suffixes[i]) == 0) {
+            key[key_len - suffix_len] = '\0';
+            file_cache_invalidate(key);
+            break;
+        }
+    }
+}
+
+void file_cache_invalidate_prefix(const char *prefix) {
+    if (shard_budget == 0) return;
+
+    char key[CACHE_PATH_MAX];
+    if (file_cache_key(prefix, key, sizeof(key)) < 0) return;
+    size_t key_len = strlen(key);
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &shards[i];
+        unsigned long removed = 0;
+        pthread_mutex_lock(&shard->lock);
+        shard->generation++;
+        struct cache_entry *entry = shard->lru_head;
+        while (entry) {
+            struct cache_entry *next = entry->lru_next;
+            if (strncmp(entry->path, key, key_len) == 0) {
+                shard_remove(shard, entry);
+                removed++;
+            }
+            entry = next;
+        }
+        pthread_mutex_unlock(&shard->lock);
+        if (removed) __atomic_add_fetch(&stat_invalidations, removed, __ATOMIC_RELAXED);
+    }
+}
+
+static void release_entry(void *entry) {
+    file_cache_release(entry);
+}
+
+void file_cache_send(struct connection *conn, struct cache_entry *entry, const struct cache_policy *policy) {
+    struct iovec pieces[3] = {
+        {.iov_base = (void *)entry->header, .iov_len = entry->header_len},
+        http_header_tail(conn, policy),
+        {.iov_base = (void *)entry->body, .iov_len = entry->body_len},
+    };
+    conn->mime_type = entry->mime_type;
+    if (entry->body) {
+        connection_send_buffers(conn, pieces, 3, release_entry, entry);
+    } else {
+        // The descriptor is shared by every connection sending this file, sendfile() keeps a private offset per connection
+        connection_send_buffers(conn, pieces, 2, release_entry, entry);
+        connection_add_file_body(conn, entry->fd, 0, entry->body_len, 0);
+    }
+}
+
+void file_cache_send_not_modified(struct connection *conn, struct cache_entry *entry, const struct cache_policy *policy) {
+    struct iovec pieces[2] = {
+        {.iov_base = (void *)entry->not_modified, .iov_len = entry->not_modified_len},
+        http_header_tail(conn, policy),
+    };
+    connection_send_buffers(conn, pieces, 2, release_entry, entry);
+}
+
+void file_cache_send_ranges(struct connection *conn, struct cache_entry *entry, const struct byte_range *ranges, int count,
+                            const struct cache_policy *policy) {
+    struct range_source source = {
+        .mime_type = entry->mime_type,
+        .validators = &entry->validators,
+        .cache_policy = policy,
+        .size = entry->body_len,
+        .data = entry->body,
+        .fd = entry->fd,
+        .owns_fd = 0,
+        .release = release_entry,
+        .release_arg = entry,
+    };
+    http_range_send(conn, ranges, count, &source);
+}
+
+void file_cache_get_stats(struct cache_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->hits = metrics_total(METRIC_CACHE_HITS);
+    stats->misses = metrics_total(METRIC_CACHE_MISSES);
+    stats->evictions = __atomic_load_n(&stat_evictions, __ATOMIC_RELAXED);
+    stats->invalidations = __atomic_load_n(&stat_invalidations, __ATOMIC_RELAXED);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        stats->entries += shards[i].entries;
+        stats->open_files += shards[i].open_files;
+        stats->bytes += shards[i].bytes;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
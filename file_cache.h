@@ -0,0 +1,148 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "cache_policy.h"
+#include "compression.h"
+#include "event_loop.h"
+#include "file_validators.h"
+#include "http_range.h"
+
+#define CACHE_DEFAULT_BUDGET (64 * 1024 * 1024) // Bytes of file content and headers kept in memory
+#define CACHE_DEFAULT_MAX_OBJECT (1024 * 1024)  // Larger files are only kept open and streamed with sendfile()
+#define CACHE_MAX_OPEN_FILES 1024               // Open descriptors held for large files
+#define CACHE_REVALIDATE_INTERVAL 1             // Seconds between stat() checks when no file watcher runs
+#define CACHE_PATH_MAX 512
+
+/*
+ * A cached file: its stat() metadata, the pre-rendered response header (status line, Content-Type,
+   Content-Length, Accept-Ranges, ETag, Last-Modified) and either the file content (small files) or an open descriptor (large files).
+ * The 304 Not Modified header is pre-rendered as well, along with the validators it is chosen by.
+ * Compressed versions of the file (precompressed siblings, or compressed in memory once when the entry is built)
+   hang off the entry as variants. They are entries of their own, but never in the table: they live and die with it.
+ * Headers stop before the Date and Connection lines, which change with time and request and are added when sending.
+ * Entries are reference counted. A response being sent holds a reference, so evicting an entry
+   never frees memory or closes a descriptor a connection is still sending from.
+ */
+struct cache_entry {
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+    unsigned long hash;
+    int refs;
+    size_t charge; // Bytes counted against the budget
+
+    struct stat file_stat; // Metadata of the file the entry was built from
+    time_t checked_at;
+
+    const char *path;
+    const char *header;
+    size_t header_len;
+    const char *not_modified; // Header of the 304 response
+    size_t not_modified_len;
+    struct file_validators validators;
+    const char *mime_type; // Static string, used for the headers of range responses
+    const char *encoding;  // Content-Encoding of the body, NULL for the file as is
+    struct cache_entry *variants[ENCODING_COUNT]; // Encoded versions, NULL where there is none
+    int open_files; // Descriptors held by this entry and its variants
+    const char *body; // File content, NULL when the entry holds fd instead
+    size_t body_len;
+    uint32_t fingerprint; // cache_fingerprint() of body, for in-memory entries of the file as is
+    int fingerprinted;
+    int fd; // Open file for large entries, -1 for in-memory ones
+};
+
+struct cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long invalidations;
+    unsigned long entries;
+    unsigned long open_files;
+    size_t bytes;
+};
+
+/*
+ * Sets the byte budget and the largest file whose content may be cached. A budget of 0 disables the cache.
+ * Must be called before the workers start.
+ */
+void file_cache_init(size_t budget, size_t max_object);
+
+/*
+ * Returns the cached entry for path with a reference held, or NULL on a miss.
+ * A hit costs a hash lookup under the lock of one shard. Unless a file watcher keeps the cache
+   up to date (see file_cache_set_watched()), the file is stat()ed again at most once per
+   CACHE_REVALIDATE_INTERVAL and a changed file is dropped.
+ * On a miss *generation receives a token that must be passed to file_cache_put().
+ */
+struct cache_entry *file_cache_get(const char *path, unsigned long *generation);
+
+/*
+ * Builds an entry for the already opened file_fd, described by file_stat, with a header for mime_type.
+ * Small files are read into memory and file_fd is closed; larger ones keep file_fd open inside the entry.
+ * The content of small files is fingerprinted along the way, for fingerprinted URLs.
+ * Precompressed siblings (path.br, path.gz) are loaded along with it. Without a gzip sibling, small files of a
+   compressible type are gzipped in memory here, once.
+ * If path was invalidated since the file_cache_get() that returned generation, the entry is still
+   returned but not stored, so a response built from an older version never sticks in the cache.
+ * Returns the entry with a reference held and owns file_fd from then on,
+   or NULL if nothing could be cached, in which case file_fd is left to the caller.
+ */
+struct cache_entry *file_cache_put(const char *path, unsigned long generation, int file_fd,
+                                   const struct stat *file_stat, const char *mime_type);
+
+/*
+ * Picks the variant of entry to send for request, following its Accept-Encoding.
+ * Returns the variant with a reference held in exchange for the one on entry, or entry itself.
+ * Requests with a Range header always get the file as is.
+ */
+struct cache_entry *file_cache_negotiate(struct cache_entry *entry, const struct http_request *request);
+
+// Drops a reference taken by file_cache_get() or file_cache_put().
+void file_cache_release(struct cache_entry *entry);
+
+/*
+ * Queues the cached response on conn, with the Cache-Control line of policy (NULL for none).
+ * Header, Connection line and the in-memory body go out in a single sendmsg(), a descriptor body follows with sendfile().
+ * The connection releases the entry once the response is sent.
+ */
+void file_cache_send(struct connection *conn, struct cache_entry *entry, const struct cache_policy *policy);
+
+// Queues the 304 Not Modified response for entry on conn, for a request file_validators_not_modified() accepted.
+void file_cache_send_not_modified(struct connection *conn, struct cache_entry *entry, const struct cache_policy *policy);
+
+// Queues a 206 response with count ranges from http_range_parse() of entry on conn.
+void file_cache_send_ranges(struct connection *conn, struct cache_entry *entry, const struct byte_range *ranges, int count,
+                            const struct cache_policy *policy);
+
+// Drops path from the cache. Safe to call from any thread.
+void file_cache_invalidate(const char *path);
+
+// Drops every entry whose path starts with prefix (a directory that was moved or deleted).
+void file_cache_invalidate_prefix(const char *prefix);
+
+// Sets the gzip level for files compressed in memory, 0 turns it off. Must be called before the workers start.
+void file_cache_set_compression(int level);
+
+/*
+ * Tells the cache that every path it gets starts with root ("./web/"), which stands for the web root opened with
+   web_root_open(). Precompressed siblings are opened and revalidated below that descriptor, so a symbolic link
+   cannot lead them out of the web root. Must be called before the workers start.
+ */
+void file_cache_set_root(const char *root);
+
+// Tells the cache that a file watcher reports every change, so hits no longer need stat().
+void file_cache_set_watched(int watched);
+
+/*
+ * Writes path to out in the form used as cache key: repeated slashes and "/./" segments are removed.
+ * Returns 0, or -1 if it does not fit into size bytes.
+ */
+int file_cache_key(const char *path, char *out, size_t size);
+
+void file_cache_get_stats(struct cache_stats *stats);
+
+#endif
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "file_validators.h"
+
+static const char month_names[12][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+void file_validators_init(struct file_validators *validators, const struct stat *file_stat) {
+    int weak = time(NULL) - file_stat->st_mtim.tv_sec < 1;
+    int length = snprintf(validators->etag, sizeof(validators->etag), "%s\"%llx-%llx-%llx.%lx\"", weak ? "W/" : "",
+                          (unsigned long long)file_stat->st_ino, (unsigned long long)file_stat->st_size,
+                          (unsigned long long)file_stat->st_mtim.tv_sec, (unsigned long)file_stat->st_mtim.tv_nsec);
+    validators->etag_len = length;
+
+    // strftime() names days and months after the locale, the server never changes it from "C"
+    struct tm tm;
+    gmtime_r(&file_stat->st_mtim.tv_sec, &tm);
+    validators->last_modified_len = strftime(validators->last_modified, sizeof(validators->last_modified),
+                                             "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    validators->mtime = file_stat->st_mtim.tv_sec;
+}
+
+int file_validators_format(const struct file_validators *validators, char *out, size_t size) {
+    return snprintf(out, size, "ETag: %s\r\nLast-Modified: %s\r\n", validators->etag, validators->last_modified);
+}
+
+static int parse_digits(const char *p, int count) {
+    int value = 0;
+    for (int i = 0; i < count; i++) {
+        if (p[i] < '0' || p[i] > '9') return -1;
+        value = value * 10 + (p[i] - '0');
+    }
+    return value;
+}
+
+// Parses an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"), the only format current clients send.
+static int parse_http_date(struct http_slice date, time_t *out) {
+    const char *p = date.data;
+    if (date.len != 29 || p[3] != ',' || p[4] != ' ' || p[7] != ' ' || p[11] != ' ' || p[16] != ' ' ||
+        p[19] != ':' || p[22] != ':' || memcmp(p + 25, " GMT", 4) != 0) {
+        return -1;
+    }
+
+    struct tm tm = {0};
+    tm.tm_mon = -1;
+    for (int i = 0; i < 12; i++) {
+        if (memcmp(p + 8, month_names[i], 3) == 0) tm.tm_mon = i;
+    }
+    tm.tm_mday = parse_digits(p + 5, 2);
+    tm.tm_year = parse_digits(p + 12, 4) - 1900;
+    tm.tm_hour = parse_digits(p + 17, 2);
+    tm.tm_min = parse_digits(p + 20, 2);
+    tm.tm_sec = parse_digits(p + 23, 2);
+    if (tm.tm_mon < 0 || tm.tm_mday < 1 || tm.tm_year < 0 || tm.tm_hour < 0 || tm.tm_min < 0 || tm.tm_sec < 0) return -1;
+
+    *out = timegm(&tm);
+    return 0;
+}
+
+// The part of an entity tag that is compared, without the "W/" prefix
+static struct http_slice opaque_tag(const char *tag, size_t length) {
+    if (length >= 2 && tag[0] == 'W' && tag[1] == '/') {
+        tag += 2;
+        length -= 2;
+    }
+    return (struct http_slice){.data = tag, .len = length};
+}
+
+// If-None-Match holds "*" or a comma separated list of entity tags
+static int etag_list_matches(struct http_slice list, const struct file_validators *validators) {
+    struct http_slice ours = opaque_tag(validators->etag, validators->etag_len);
+    const char *p = list.data;
+    const char *end = list.data + list.len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *tag = p;
+        while (p < end && *p != ',') p++;
+        const char *tag_end = p;
+        while (tag_end > tag && (tag_end[-1] == ' ' || tag_end[-1] == '\t')) tag_end--;
+        if (tag_end == tag) continue;
+
+        if (tag_end - tag == 1 && *tag == '*') return 1;
+        struct http_slice theirs = opaque_tag(tag, tag_end - tag);
+        if (theirs.len == ours.len && memcmp(theirs.data, ours.data, ours.len) == 0) return 1;
+    }
+    return 0;
+}
+
+int file_validators_not_modified(const struct file_validators *validators, const struct http_request *request) {
+    const struct http_slice *if_none_match = http_request_header(request, "If-None-Match");
+    if (if_none_match) return etag_list_matches(*if_none_match, validators);
+
+    const struct http_slice *if_modified_since = http_request_header(request, "If-Modified-Since");
+    if (!if_modified_since) return 0;
+
+    // Clients normally send back the Last-Modified value they got, which needs no date parsing
+    if (if_modified_since->len == validators->last_modified_len &&
+        memcmp(if_modified_since->data, validators->last_modified, validators->last_modified_len) == 0) {
+        return 1;
+    }
+    time_t since;
+    if (parse_http_date(*if_modified_since, &since) < 0) return 0; // An invalid date is ignored
+    return validators->mtime <= since;
+}
@@ -0,0 +1,45 @@
+#ifndef FILE_VALIDATORS_H
+#define FILE_VALIDATORS_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "http_parser.h"
+
+#define ETAG_SIZE 64      // "W/" prefix, quotes and three hex numbers
+#define HTTP_DATE_SIZE 32 // "Sun, 06 Nov 1994 08:49:37 GMT"
+
+/*
+ * The validators of a file (RFC 7232): an ETag and a Last-Modified date, both already formatted.
+ * They are computed once from stat() data, the file cache keeps them with each entry,
+   so checking a conditional request is a few string compares.
+ */
+struct file_validators {
+    char etag[ETAG_SIZE];
+    size_t etag_len;
+    char last_modified[HTTP_DATE_SIZE];
+    size_t last_modified_len;
+    time_t mtime;
+};
+
+/*
+ * Fills validators from file_stat.
+ * The ETag is built from inode, size and modification time. It is strong, unless the file was modified
+   within the last second: it may still be written to without its mtime moving, so the tag is marked weak.
+ */
+void file_validators_init(struct file_validators *validators, const struct stat *file_stat);
+
+/*
+ * Writes the "ETag: ...\r\nLast-Modified: ...\r\n" header lines to out.
+ * Returns their length like snprintf().
+ */
+int file_validators_format(const struct file_validators *validators, char *out, size_t size);
+
+/*
+ * Returns 1 if request is conditional and the client's copy is still current, so a 304 can be sent.
+ * If-None-Match is checked with the weak comparison, If-Modified-Since only when there is no If-None-Match.
+ */
+int file_validators_not_modified(const struct file_validators *validators, const struct http_request *request);
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "file_cache.h"
+#include "file_watch.h"
+
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+/*
+ * inotify reports events by watch descriptor and file name only, so we remember the directory path
+   of every watch descriptor. Watch descriptors are small increasing integers, a plain array indexed by them is enough.
+ * Only the watcher thread touches this table.
+ */
+static int inotify_fd = -1;
+static char **watched_dirs = NULL;
+static int watched_dirs_size = 0;
+
+static int remember_dir(int wd, const char *path) {
+    if (wd >= watched_dirs_size) {
+        int size = watched_dirs_size ? watched_dirs_size * 2 : 64;
+        while (size <= wd) size *= 2;
+        char **grown = realloc(watched_dirs, size * sizeof(*grown));
+        if (!grown) return -1;
+        memset(grown + watched_dirs_size, 0, (size - watched_dirs_size) * sizeof(*grown));
+        watched_dirs = grown;
+        watched_dirs_size = size;
+    }
+    free(watched_dirs[wd]);
+    watched_dirs[wd] = strdup(path);
+    return watched_dirs[wd] ? 0 : -1;
+}
+
+static void forget_dir(int wd) {
+    if (wd >= 0 && wd < watched_dirs_size) {
+        free(watched_dirs[wd]);
+        watched_dirs[wd] = NULL;
+    }
+}
+
+// Watches dir (which ends with '/') and all directories below it.
+static int watch_tree(const char *dir) {
+    int wd = inotify_add_watch(inotify_fd, dir, WATCH_MASK);
+    if (wd < 0) {
+        perror("inotify_add_watch failed");
+        return -1;
+    }
+    if (remember_dir(wd, dir) < 0) return -1;
+
+    DIR *handle = opendir(dir);
+    if (!handle) return 0; // Already gone again, its parent will tell us
+
+    int status = 0;
+    struct dirent *entry;
+    while (status == 0 && (entry = readdir(handle)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        char path[CACHE_PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s%s/", dir, entry->d_name) >= (int)sizeof(path)) continue;
+
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat file_stat;
+            is_dir = lstat(path, &file_stat) == 0 && S_ISDIR(file_stat.st_mode);
+        }
+        if (is_dir) status = watch_tree(path);
+    }
+    closedir(handle);
+    return status;
+}
+
+static void handle_event(const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        // Events were lost, we cannot know what changed so everything goes
+        file_cache_invalidate_prefix("");
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        forget_dir(event->wd);
+        return;
+    }
+    if (event->wd < 0 || event->wd >= watched_dirs_size || !watched_dirs[event->wd] || event->len == 0) return;
+
+    char path[CACHE_PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s%s", watched_dirs[event->wd], event->name) >= (int)sizeof(path) - 1) return;
+
+    if (event->mask & IN_ISDIR) {
+        strcat(path, "/");
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            file_cache_invalidate_prefix(path); // Replaces whatever was cached under that name before
+            if (watch_tree(path) < 0) {
+                // Changes below path would go unnoticed (e.g. max_user_watches ran out), go back to checking with stat()
+                fprintf(stderr, "Cannot watch %s, checking cached files with stat() again\n", path);
+                file_cache_set_watched(0);
+            }
+        } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            file_cache_invalidate_prefix(path);
+        }
+        return;
+    }
+    file_cache_invalidate(path);
+}
+
+static void *watch_main(void *arg) {
+    (void)arg;
+    // Aligned like struct inotify_event, large enough for many events per read()
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            perror("Reading inotify events failed");
+            break;
+        }
+        for (char *p = buffer; p < buffer + length;) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            handle_event(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    // Without events the cache can no longer trust its entries, go back to checking with stat()
+    file_cache_set_watched(0);
+    file_cache_invalidate_prefix("");
+    return NULL;
+}
+
+int file_watch_start(const char *root) {
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        perror("inotify_init1 failed");
+        return -1;
+    }
+
+    char dir[CACHE_PATH_MAX];
+    size_t length = strlen(root);
+    if (snprintf(dir, sizeof(dir), "%s%s", root, length > 0 && root[length - 1] == '/' ? "" : "/") >= (int)sizeof(dir) ||
+        watch_tree(dir) < 0) {
+        close(inotify_fd);
+        inotify_fd = -1;
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, watch_main, NULL) != 0) {
+        perror("Thread creation failed");
+        close(inotify_fd);
+        inotify_fd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+
+    // Watches are in place before anything is cached, so from now on no change can go unnoticed
+    file_cache_set_watched(1);
+    return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef FILE_WATCH_H
+#define FILE_WATCH_H
+
+/*
+ * Starts a background thread that watches root and every directory below it with inotify.
+ * Whenever a file is modified, created, renamed or deleted, its entry is dropped from the file cache,
+   so the next request loads the new version. While the watcher runs, cache hits skip stat() entirely.
+ * Returns 0 on success. On failure (no inotify, watch limit reached) the cache keeps revalidating with stat().
+ */
+int file_watch_start(const char *root);
+
+#endif
@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "handoff.h"
+
+extern char **environ;
+
+static int ready_fd = -1; // Our end of the handoff socket in a new process, until handoff_ready()
+
+// Copies the environment with HANDOFF_ENV set to fd, before fork() since the child may not allocate
+static char **handoff_environment(int fd) {
+    int count = 0;
+    while (environ[count]) count++;
+    char **env = calloc(count + 2, sizeof(*env));
+    if (!env) return NULL;
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (strncmp(environ[i], HANDOFF_ENV "=", sizeof(HANDOFF_ENV)) != 0) env[n++] = environ[i];
+    }
+    if (asprintf(&env[n], "%s=%d", HANDOFF_ENV, fd) < 0) {
+        free(env);
+        return NULL;
+    }
+    return env;
+}
+
+static int send_fds(int socket_fd, const int *fds, int count) {
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buffer,
+                             .msg_controllen = CMSG_SPACE(sizeof(int) * count)};
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(header), fds, sizeof(int) * count);
+    return sendmsg(socket_fd, &message, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+// Waits for the ready byte. Returns 0 when it came, -1 when the new process went away or took too long.
+static int wait_ready(int socket_fd) {
+    struct pollfd ready = {.fd = socket_fd, .events = POLLIN};
+    int n;
+    do {
+        n = poll(&ready, 1, HANDOFF_READY_TIMEOUT * 1000);
+    } while (n < 0 && errno == EINTR);
+    char byte;
+    return n == 1 && read(socket_fd, &byte, 1) == 1 ? 0 : -1;
+}
+
+int handoff_start(char *const argv[], const int *fds, int count) {
+    if (count > HANDOFF_MAX_FDS) count = HANDOFF_MAX_FDS;
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0) {
+        perror("socketpair failed");
+        return -1;
+    }
+    char **env = handoff_environment(sockets[1]);
+    if (!env) {
+        perror("Memory allocation failed");
+        close(sockets[0]);
+        close(sockets[1]);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Only async-signal-safe calls between fork() and exec: the other threads' locks may be held
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        fcntl(sockets[1], F_SETFD, 0); // This end survives the exec
+        execvpe(argv[0], argv, env);
+        _exit(127);
+    }
+    int last = 0;
+    while (env[last + 1]) last++;
+    free(env[last]); // Our variable, the others belong to environ
+    free(env);
+    close(sockets[1]);
+    if (pid < 0) {
+        perror("fork failed");
+        close(sockets[0]);
+        return -1;
+    }
+
+    if (send_fds(sockets[0], fds, count) < 0 || wait_ready(sockets[0]) < 0) {
+        fprintf(stderr, "The new server did not start, this one keeps serving\n");
+        close(sockets[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    close(sockets[0]);
+    return 0;
+}
+
+int handoff_receive(int *fds, int max) {
+    const char *value = getenv(HANDOFF_ENV);
+    if (!value) return 0;
+    int socket_fd = atoi(value);
+    unsetenv(HANDOFF_ENV);
+    fcntl(socket_fd, F_SETFD, FD_CLOEXEC); // Not for a process we start ourselves later
+
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buffer,
+                             .msg_controllen = sizeof(control.buffer)};
+    ssize_t n;
+    do {
+        n = recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    struct cmsghdr *header = n == 1 ? CMSG_FIRSTHDR(&message) : NULL;
+    if (!header || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "Receiving the listening sockets failed\n");
+        close(socket_fd);
+        return -1;
+    }
+
+    int count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int received[HANDOFF_MAX_FDS];
+    memcpy(received, CMSG_DATA(header), sizeof(int) * count);
+    for (int i = max; i < count; i++) close(received[i]);
+    if (count > max) count = max;
+    memcpy(fds, received, sizeof(int) * count);
+    ready_fd = socket_fd;
+    return count;
+}
+
+void handoff_ready(void) {
+    if (ready_fd < 0) return;
+    char byte = 1;
+    ssize_t ignored = write(ready_fd, &byte, 1);
+    (void)ignored;
+    close(ready_fd);
+    ready_fd = -1;
+}
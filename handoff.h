@@ -0,0 +1,30 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#define HANDOFF_ENV "SERVER_HANDOFF_FD" // Tells a new process which descriptor the old one hands the sockets over on
+#define HANDOFF_MAX_FDS 256
+#define HANDOFF_READY_TIMEOUT 10        // Seconds the old process waits for the new one to start serving
+
+/*
+ * Zero-downtime upgrade. The old process starts the new binary and passes it its listening sockets over a
+   Unix socket (SCM_RIGHTS). The new process accepts on the very same sockets, so connections queued in their
+   backlog are not lost and no client is refused while the old process drains.
+ */
+
+/*
+ * Starts argv[0] with argv, hands it count listening sockets and waits until it reports ready.
+ * Returns 0 once the new process serves, -1 if it could not be started or failed before becoming ready
+   (the old process should then simply keep serving).
+ */
+int handoff_start(char *const argv[], const int *fds, int count);
+
+/*
+ * In a process started by handoff_start(): receives the listening sockets into fds (at most max).
+ * Returns how many arrived, 0 when the process was not started by a handoff, or -1 on error.
+ */
+int handoff_receive(int *fds, int max);
+
+// Tells the old process that this one serves now, so it can drain. Does nothing without a handoff.
+void handoff_ready(void);
+
+#endif
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hdr_histogram.h"
+
+/*
+ * Bucket b holds the values from sub_bucket_half_count << b up to twice that, in sub_bucket_half_count steps of 1 << b.
+ * Bucket 0 also covers the values below sub_bucket_half_count, one per count.
+ */
+static int bucket_index(const struct hdr_histogram *histogram, int64_t value) {
+    int pow2_ceiling = 64 - __builtin_clzll((uint64_t)(value | histogram->sub_bucket_mask));
+    return pow2_ceiling - (histogram->sub_bucket_half_count_magnitude + 1);
+}
+
+static int counts_index(const struct hdr_histogram *histogram, int64_t value) {
+    int bucket = bucket_index(histogram, value);
+    int sub_bucket = (int)(value >> bucket);
+    return ((bucket + 1) << histogram->sub_bucket_half_count_magnitude) + (sub_bucket - histogram->sub_bucket_half_count);
+}
+
+// The highest value that is counted at index, what a percentile reports
+static int64_t highest_value_at(const struct hdr_histogram *histogram, int index) {
+    int bucket = (index >> histogram->sub_bucket_half_count_magnitude) - 1;
+    int sub_bucket = (index & (histogram->sub_bucket_half_count - 1)) + histogram->sub_bucket_half_count;
+    if (bucket < 0) {
+        sub_bucket -= histogram->sub_bucket_half_count;
+        bucket = 0;
+    }
+    return ((int64_t)sub_bucket << bucket) + ((int64_t)1 << bucket) - 1;
+}
+
+int hdr_init(struct hdr_histogram *histogram, int64_t highest, int significant_figures) {
+    if (highest < 2 || significant_figures < 1 || significant_figures > 5) return -1;
+    memset(histogram, 0, sizeof(*histogram));
+
+    // Sub-buckets are a power of two, at least 2 * 10^figures so a step is below one part in 10^figures
+    int64_t largest_single_unit = 2;
+    for (int i = 0; i < significant_figures; i++) largest_single_unit *= 10;
+    int sub_bucket_count_magnitude = 0;
+    while (((int64_t)1 << sub_bucket_count_magnitude) < largest_single_unit) sub_bucket_count_magnitude++;
+
+    histogram->highest = highest;
+    histogram->significant_figures = significant_figures;
+    histogram->sub_bucket_half_count_magnitude = sub_bucket_count_magnitude - 1;
+    histogram->sub_bucket_half_count = 1 << (sub_bucket_count_magnitude - 1);
+    histogram->sub_bucket_mask = ((int64_t)1 << sub_bucket_count_magnitude) - 1;
+
+    int64_t smallest_untrackable = (int64_t)1 << sub_bucket_count_magnitude;
+    histogram->bucket_count = 1;
+    while (smallest_untrackable <= highest) {
+        histogram->bucket_count++;
+        if (smallest_untrackable > INT64_MAX / 2) break;
+        smallest_untrackable <<= 1;
+    }
+    histogram->counts_len = (histogram->bucket_count + 1) * histogram->sub_bucket_half_count;
+    histogram->counts = calloc(histogram->counts_len, sizeof(*histogram->counts));
+    if (!histogram->counts) return -1;
+    hdr_reset(histogram);
+    return 0;
+}
+
+void hdr_free(struct hdr_histogram *histogram) {
+    free(histogram->counts);
+    histogram->counts = NULL;
+}
+
+void hdr_reset(struct hdr_histogram *histogram) {
+    memset(histogram->counts, 0, histogram->counts_len * sizeof(*histogram->counts));
+    histogram->total = 0;
+    histogram->min = INT64_MAX;
+    histogram->max = 0;
+    histogram->sum = 0;
+}
+
+void hdr_record(struct hdr_histogram *histogram, int64_t value) {
+    if (value < 1) value = 1;
+    if (value > histogram->highest) value = histogram->highest;
+    histogram->counts[counts_index(histogram, value)]++;
+    histogram->total++;
+    histogram->sum += value;
+    if (value < histogram->min) histogram->min = value;
+    if (value > histogram->max) histogram->max = value;
+}
+
+void hdr_add(struct hdr_histogram *histogram, const struct hdr_histogram *source) {
+    for (int i = 0; i < histogram->counts_len && i < source->counts_len; i++) {
+        histogram->counts[i] += source->counts[i];
+    }
+    histogram->total += source->total;
+    histogram->sum += source->sum;
+    if (source->min < histogram->min) histogram->min = source->min;
+    if (source->max > histogram->max) histogram->max = source->max;
+}
+
+int64_t hdr_value_at_percentile(const struct hdr_histogram *histogram, double percentile) {
+    if (histogram->total == 0) return 0;
+    if (percentile > 100) percentile = 100;
+    uint64_t wanted = (uint64_t)(percentile / 100 * histogram->total + 0.5);
+    if (wanted < 1) wanted = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < histogram->counts_len; i++) {
+        seen += histogram->counts[i];
+        if (seen >= wanted) {
+            int64_t value = highest_value_at(histogram, i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+double hdr_mean(const struct hdr_histogram *histogram) {
+    return histogram->total ? histogram->sum / histogram->total : 0;
+}
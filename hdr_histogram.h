@@ -0,0 +1,48 @@
+#ifndef HDR_HISTOGRAM_H
+#define HDR_HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * A High Dynamic Range histogram: values from 1 to highest are counted with a fixed number of significant
+   decimal digits, so 1 us and 10 s are both kept within 0.1% using a few hundred kilobytes.
+ * Each power of two range is split into the same number of linear sub-buckets, recording is a shift and an add.
+ * Not thread safe, keep one per thread and merge them with hdr_add().
+ */
+struct hdr_histogram {
+    int64_t highest;
+    int significant_figures;
+    int sub_bucket_half_count_magnitude;
+    int sub_bucket_half_count;
+    int64_t sub_bucket_mask;
+    int bucket_count;
+    int counts_len;
+    uint64_t *counts;
+    uint64_t total;
+    int64_t min;
+    int64_t max;
+    double sum;
+};
+
+/*
+ * Sets up a histogram for values from 1 to highest with significant_figures digits (1 to 5).
+ * Returns 0, or -1 if the parameters are out of range or memory is short.
+ */
+int hdr_init(struct hdr_histogram *histogram, int64_t highest, int significant_figures);
+
+void hdr_free(struct hdr_histogram *histogram);
+
+void hdr_reset(struct hdr_histogram *histogram);
+
+// Counts value once. Values below 1 count as 1, values above highest as highest.
+void hdr_record(struct hdr_histogram *histogram, int64_t value);
+
+// Adds the counts of source, set up with the same parameters, to histogram.
+void hdr_add(struct hdr_histogram *histogram, const struct hdr_histogram *source);
+
+// Returns the value below or at which percentile (0 to 100) percent of the recorded values lie, 0 if it is empty.
+int64_t hdr_value_at_percentile(const struct hdr_histogram *histogram, double percentile);
+
+double hdr_mean(const struct hdr_histogram *histogram);
+
+#endif
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "http_header.h"
+
+#define ITERATIONS 10000000
+
+static struct file_validators validators;
+static const char mime_type[] = "application/javascript";
+static const long long size = 59780;
+
+// How serve_file() built its header before http_header.c, with a Date line formatted the usual way added
+static size_t with_snprintf(char *out, struct connection *conn) {
+    char validator_lines[HEADER_BUFFER_SIZE];
+    file_validators_format(&validators, validator_lines, sizeof(validator_lines));
+    char date[HTTP_DATE_SIZE];
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return snprintf(out, HEADER_BUFFER_SIZE,
+                    "HTTP/1.1 200 OK\r\nServer: web-server\r\nContent-Type: %s\r\nContent-Length: %lld\r\n"
+                    "Accept-Ranges: bytes\r\n%sDate: %s\r\nConnection: %s\r\n\r\n",
+                    mime_type, size, validator_lines, date, conn->keep_alive ? "keep-alive" : "close");
+}
+
+// The same header from fragments, as the uncached path in server_v2 builds it now
+static size_t with_builder(char *out, struct connection *conn) {
+    struct header_builder header;
+    http_header_start(&header, out, HEADER_BUFFER_SIZE, 200);
+    http_header_add_literal(&header, "Content-Type: ");
+    http_header_add(&header, mime_type, sizeof(mime_type) - 1);
+    http_header_add_literal(&header, "\r\nContent-Length: ");
+    http_header_add_number(&header, size);
+    http_header_add_literal(&header, "\r\nAccept-Ranges: bytes\r\n");
+    http_header_add_validators(&header, &validators);
+    http_header_finish(&header, conn);
+    return header.len;
+}
+
+// A cached file: the template is ready, only the Date and Connection lines are added
+static char template_header[HEADER_BUFFER_SIZE];
+static char template_not_modified[HEADER_BUFFER_SIZE];
+static size_t template_len;
+
+static size_t with_template(char *out, struct connection *conn) {
+    (void)out;
+    struct iovec tail = http_header_tail(conn, NULL);
+    return template_len + tail.iov_len;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, size_t (*build)(char *out, struct connection *conn), struct connection *conn) {
+    static char out[HEADER_BUFFER_SIZE];
+    unsigned long checksum = 0;
+    double start = now();
+    for (long i = 0; i < ITERATIONS; i++) {
+        conn->keep_alive = i & 1;
+        checksum += build(out, conn) + (unsigned char)out[i % 64]; // Keeps the compiler from dropping the call
+    }
+    double elapsed = now() - start;
+    printf("%-22s %6.1f ns/header (checksum %lu)\n", name, elapsed * 1e9 / ITERATIONS, checksum);
+}
+
+int main(void) {
+    struct stat file_stat = {.st_ino = 1234567, .st_size = size, .st_mtim = {.tv_sec = 1700000000, .tv_nsec = 123456789}};
+    file_validators_init(&validators, &file_stat);
+    size_t not_modified_len;
+    template_len = http_header_file_templates(template_header, template_not_modified, &not_modified_len, mime_type, size,
+                                              NULL, 0, &validators);
+    static struct io_buffer io;
+    static struct connection conn = {.io = &io};
+
+    char out[HEADER_BUFFER_SIZE];
+    size_t length = with_builder(out, &conn);
+    printf("%.*s", (int)length, out);
+    printf("%d headers each\n\n", ITERATIONS);
+
+    run("snprintf + strftime", with_snprintf, &conn);
+    run("fragments", with_builder, &conn);
+    run("template + cached tail", with_template, &conn);
+    return 0;
+}
@@ -0,0 +1,163 @@
+#include <string.h>
+#include <time.h>
+
+#include "http_header.h"
+
+#define DATE_LINE_SIZE 38 // "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n" and the NUL strftime() writes
+
+static const char keep_alive_line[] = "Connection: keep-alive\r\n\r\n";
+static const char close_line[] = "Connection: close\r\n\r\n";
+
+_Static_assert(CACHE_POLICY_LINE_MAX + DATE_LINE_SIZE - 1 + sizeof(keep_alive_line) - 1 <= HEADER_TAIL_SIZE,
+               "The tail must fit into the connection");
+
+// Per thread, so the Date line costs one call to time() per response and gmtime_r() once a second
+static __thread time_t cached_second = -1;
+static __thread char date_line[DATE_LINE_SIZE];
+static __thread size_t date_line_len;
+
+struct status_line {
+    int status;
+    const char *line;
+    size_t length;
+};
+
+#define STATUS_LINE(status, text) {status, "HTTP/1.1 " #status " " text "\r\n" HTTP_SERVER_LINE, \
+                                   sizeof("HTTP/1.1 " #status " " text "\r\n" HTTP_SERVER_LINE) - 1}
+
+static const struct status_line status_lines[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(206, "Partial Content"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(416, "Range Not Satisfiable"),
+    STATUS_LINE(429, "Too Many Requests"),
+    STATUS_LINE(500, "Internal Server Error"),
+    STATUS_LINE(503, "Service Unavailable"),
+};
+
+static void update_date(void) {
+    time_t now = time(NULL);
+    if (now == cached_second) return;
+    // strftime() names days and months after the locale, the server never changes it from "C"
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    date_line_len = strftime(date_line, sizeof(date_line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    cached_second = now;
+}
+
+void http_header_add(struct header_builder *header, const char *data, size_t length) {
+    if (length > header->size - header->len) {
+        header->overflowed = 1;
+        return;
+    }
+    memcpy(header->data + header->len, data, length);
+    header->len += length;
+}
+
+void http_header_start(struct header_builder *header, char *buffer, size_t size, int status) {
+    header->data = buffer;
+    header->len = 0;
+    header->size = size;
+    header->overflowed = 0;
+    for (size_t i = 0; i < sizeof(status_lines) / sizeof(status_lines[0]); i++) {
+        if (status_lines[i].status == status) {
+            http_header_add(header, status_lines[i].line, status_lines[i].length);
+            return;
+        }
+    }
+    http_header_add_literal(header, "HTTP/1.1 500 Internal Server Error\r\n" HTTP_SERVER_LINE);
+}
+
+void http_header_add_number(struct header_builder *header, uint64_t value) {
+    char digits[20];
+    int start = sizeof(digits);
+    do {
+        digits[--start] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    http_header_add(header, digits + start, sizeof(digits) - start);
+}
+
+void http_header_add_validators(struct header_builder *header, const struct file_validators *validators) {
+    http_header_add_literal(header, "ETag: ");
+    http_header_add(header, validators->etag, validators->etag_len);
+    http_header_add_literal(header, "\r\nLast-Modified: ");
+    http_header_add(header, validators->last_modified, validators->last_modified_len);
+    http_header_add_literal(header, "\r\n");
+}
+
+void http_header_add_cache_policy(struct header_builder *header, const struct cache_policy *policy) {
+    if (policy) http_header_add(header, policy->line, policy->line_len);
+}
+
+int http_header_finish(struct header_builder *header, struct connection *conn) {
+    update_date();
+    http_header_add(header, date_line, date_line_len);
+    if (conn->keep_alive) {
+        http_header_add_literal(header, keep_alive_line);
+    } else {
+        http_header_add_literal(header, close_line);
+    }
+    if (header->overflowed) {
+        static const char failed[] = "HTTP/1.1 500 Internal Server Error\r\n" HTTP_SERVER_LINE
+                                     "Content-Length: 0\r\nConnection: close\r\n\r\n";
+        _Static_assert(sizeof(failed) <= HEADER_BUFFER_SIZE, "Must fit into any header buffer");
+        memcpy(header->data, failed, sizeof(failed) - 1);
+        header->len = sizeof(failed) - 1;
+        conn->keep_alive = 0;
+        return -1;
+    }
+    return 0;
+}
+
+struct iovec http_header_tail(struct connection *conn, const struct cache_policy *policy) {
+    update_date();
+    size_t length = 0;
+    if (policy) {
+        memcpy(conn->io->header_tail, policy->line, policy->line_len);
+        length = policy->line_len;
+    }
+    memcpy(conn->io->header_tail + length, date_line, date_line_len);
+    length += date_line_len;
+    if (conn->keep_alive) {
+        memcpy(conn->io->header_tail + length, keep_alive_line, sizeof(keep_alive_line) - 1);
+        length += sizeof(keep_alive_line) - 1;
+    } else {
+        memcpy(conn->io->header_tail + length, close_line, sizeof(close_line) - 1);
+        length += sizeof(close_line) - 1;
+    }
+    return (struct iovec){.iov_base = conn->io->header_tail, .iov_len = length};
+}
+
+int http_header_file_templates(char *header_buffer, char *not_modified_buffer, size_t *not_modified_len, const char *mime_type,
+                               uint64_t length, const char *encoding, int vary, const struct file_validators *validators) {
+    struct header_builder header;
+    http_header_start(&header, header_buffer, HEADER_BUFFER_SIZE, 200);
+    http_header_add_literal(&header, "Content-Type: ");
+    http_header_add(&header, mime_type, strlen(mime_type));
+    http_header_add_literal(&header, "\r\nContent-Length: ");
+    http_header_add_number(&header, length);
+    http_header_add_literal(&header, "\r\n");
+    // Ranges are only served from the file as is, encoded variants do not advertise them
+    if (encoding) {
+        http_header_add_literal(&header, "Content-Encoding: ");
+        http_header_add(&header, encoding, strlen(encoding));
+        http_header_add_literal(&header, "\r\n");
+    } else {
+        http_header_add_literal(&header, "Accept-Ranges: bytes\r\n");
+    }
+    if (vary) http_header_add_literal(&header, "Vary: Accept-Encoding\r\n");
+    http_header_add_validators(&header, validators);
+
+    struct header_builder not_modified;
+    http_header_start(&not_modified, not_modified_buffer, HEADER_BUFFER_SIZE, 304);
+    if (vary) http_header_add_literal(&not_modified, "Vary: Accept-Encoding\r\n");
+    http_header_add_validators(&not_modified, validators);
+
+    if (header.overflowed || not_modified.overflowed) return -1;
+    *not_modified_len = not_modified.len;
+    return (int)header.len;
+}
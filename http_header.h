@@ -0,0 +1,69 @@
+#ifndef HTTP_HEADER_H
+#define HTTP_HEADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "cache_policy.h"
+#include "event_loop.h"
+#include "file_validators.h"
+
+#define HTTP_SERVER_LINE "Server: web-server\r\n"
+
+/*
+ * A response header assembled in the caller's buffer from fragments: status lines come pre-rendered from a table,
+   numbers are formatted by hand and the Date line is formatted once per second per thread, so building a header
+   costs a few copies and no snprintf().
+ * A fragment that does not fit is dropped and marks the header as overflowed.
+ */
+struct header_builder {
+    char *data;
+    size_t len;
+    size_t size;
+    int overflowed;
+};
+
+// Starts a header with the status line for status and the Server line.
+void http_header_start(struct header_builder *header, char *buffer, size_t size, int status);
+
+void http_header_add(struct header_builder *header, const char *data, size_t length);
+
+// Appends a string literal, its length known at compile time
+#define http_header_add_literal(header, text) http_header_add(header, text, sizeof(text) - 1)
+
+// Appends value in decimal.
+void http_header_add_number(struct header_builder *header, uint64_t value);
+
+// Appends "ETag: ...\r\nLast-Modified: ...\r\n" from the already formatted validators.
+void http_header_add_validators(struct header_builder *header, const struct file_validators *validators);
+
+// Appends the Cache-Control line of policy, nothing for NULL.
+void http_header_add_cache_policy(struct header_builder *header, const struct cache_policy *policy);
+
+/*
+ * Ends the header with the Date and Connection lines (from conn->keep_alive) and the blank line.
+   Send header->len bytes from header->data.
+ * Returns 0, or -1 if the header overflowed its buffer (of at least HEADER_BUFFER_SIZE bytes). It is then replaced by
+   a bodiless 500 Internal Server Error and conn->keep_alive is cleared: send it without the response's body.
+ */
+int http_header_finish(struct header_builder *header, struct connection *conn);
+
+/*
+ * Ends a pre-rendered header on conn: copies the Cache-Control line of policy (if not NULL), this second's Date line,
+   the Connection line and the blank line into the connection (the thread's Date may change before the response
+   is sent) and returns them as one piece.
+ * The Cache-Control line is chosen per response, so one template serves a path under any policy.
+ */
+struct iovec http_header_tail(struct connection *conn, const struct cache_policy *policy);
+
+/*
+ * Renders the parts of a file's 200 and 304 headers that stay the same for every response, up to the Date line:
+   status line, Server, Content-Type, Content-Length, Content-Encoding or Accept-Ranges, Vary and the validators.
+ * encoding is the Content-Encoding of the body or NULL, vary adds "Vary: Accept-Encoding".
+ * Returns the length of the 200 header, or -1 if either does not fit into HEADER_BUFFER_SIZE.
+ */
+int http_header_file_templates(char *header, char *not_modified, size_t *not_modified_len, const char *mime_type,
+                               uint64_t length, const char *encoding, int vary, const struct file_validators *validators);
+
+#endif
@@ -0,0 +1,255 @@
+#include <string.h>
+#include <strings.h>
+
+#include "http_parser.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_PARSER_X86 1
+#endif
+
+// Control characters other than tab are not allowed in header values.
+static const char *find_control_scalar(const char *p, const char *end) {
+    for (; p < end; p++) {
+        unsigned char c = *p;
+        if ((c < 0x20 && c != '\t') || c == 0x7f) return p;
+    }
+    return NULL;
+}
+
+/*
+ * Byte scanning.
+ * Finding the end of each line is where a parser spends most of its time, so on x86 we compare
+   32 bytes at a time with AVX2 (16 with SSE2 on older CPUs) instead of one at a time.
+ * Header values are checked for control characters with SSE4.2 PCMPESTRI, which tests 16 bytes
+   against several byte ranges in one instruction.
+ * The CPU is checked once at runtime, so the same binary runs everywhere.
+ */
+#ifdef HTTP_PARSER_X86
+static int cpu_has_avx2 = -1;
+static int cpu_has_sse42 = -1;
+static int scalar_only; // Set by http_parser_set_simd(HTTP_SIMD_NONE)
+
+static void detect_cpu(void) {
+    __builtin_cpu_init();
+    cpu_has_sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    cpu_has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+}
+
+// The plain loop, which the SIMD versions must agree with (memchr() elsewhere)
+static const char *find_byte_scalar(const char *p, const char *end, char c) {
+    for (; p < end; p++) {
+        if (*p == c) return p;
+    }
+    return NULL;
+}
+
+__attribute__((target("avx2"))) static const char *find_byte_avx2(const char *p, const char *end, char c) {
+    __m256i needle = _mm256_set1_epi8(c);
+    for (; end - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return find_byte_scalar(p, end, c);
+}
+
+static const char *find_byte_sse2(const char *p, const char *end, char c) {
+    __m128i needle = _mm_set1_epi8(c);
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return find_byte_scalar(p, end, c);
+}
+
+__attribute__((target("sse4.2"))) static const char *find_control_sse42(const char *p, const char *end) {
+    static const char ranges[16] __attribute__((aligned(16))) = "\x00\x08\x0a\x1f\x7f\x7f";
+    __m128i set = _mm_load_si128((const __m128i *)ranges);
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        int index = _mm_cmpestri(set, 6, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (index < 16) return p + index;
+    }
+    return find_control_scalar(p, end);
+}
+#endif
+
+static const char *find_byte(const char *p, const char *end, char c) {
+#ifdef HTTP_PARSER_X86
+    if (cpu_has_avx2 < 0) detect_cpu();
+    if (scalar_only) return find_byte_scalar(p, end, c);
+    return cpu_has_avx2 ? find_byte_avx2(p, end, c) : find_byte_sse2(p, end, c);
+#else
+    return memchr(p, c, end - p);
+#endif
+}
+
+static const char *find_control(const char *p, const char *end) {
+#ifdef HTTP_PARSER_X86
+    if (cpu_has_sse42 < 0) detect_cpu();
+    if (cpu_has_sse42) return find_control_sse42(p, end);
+#endif
+    return find_control_scalar(p, end);
+}
+
+int http_parser_set_simd(int level) {
+#ifdef HTTP_PARSER_X86
+    detect_cpu();
+    if (level < HTTP_SIMD_AVX2) cpu_has_avx2 = 0;
+    if (level < HTTP_SIMD_SSE) cpu_has_sse42 = 0;
+    scalar_only = level == HTTP_SIMD_NONE;
+    if (scalar_only) return HTTP_SIMD_NONE;
+    return cpu_has_avx2 ? HTTP_SIMD_AVX2 : HTTP_SIMD_SSE;
+#else
+    (void)level;
+    return HTTP_SIMD_NONE;
+#endif
+}
+
+// Characters allowed in methods and header names (RFC 7230 "tchar")
+static int is_token_char(unsigned char c) {
+    static const char extra[] = "!#$%&'*+-.^_`|~";
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c && strchr(extra, c));
+}
+
+static int is_token(const char *p, size_t length) {
+    if (length == 0) return 0;
+    for (size_t i = 0; i < length; i++) {
+        if (!is_token_char(p[i])) return 0;
+    }
+    return 1;
+}
+
+// "METHOD SP request-target SP HTTP/1.x"
+static int parse_request_line(struct http_request *request, const char *line, const char *end) {
+    const char *space = find_byte(line, end, ' ');
+    if (!space || !is_token(line, space - line)) return -1;
+    request->method.data = line;
+    request->method.len = space - line;
+
+    const char *uri = space + 1;
+    space = find_byte(uri, end, ' ');
+    if (!space || space == uri) return -1;
+    for (const char *p = uri; p < space; p++) {
+        if ((unsigned char)*p <= 0x20 || *p == 0x7f) return -1;
+    }
+    request->uri.data = uri;
+    request->uri.len = space - uri;
+
+    const char *version = space + 1;
+    if (end - version != 8 || memcmp(version, "HTTP/1.", 7) != 0 || (version[7] != '0' && version[7] != '1')) return -1;
+    request->version.data = version;
+    request->version.len = 8;
+    request->minor_version = version[7] - '0';
+    return 0;
+}
+
+// Only one way to tell where the body ends: a single Content-Length of digits, or Transfer-Encoding without one
+static int check_body_length(struct http_request *request, const struct http_header *header) {
+    if (http_slice_equals_nocase(header->name, "Content-Length")) {
+        if (request->have_content_length || request->have_transfer_encoding || header->value.len == 0) return -1;
+        for (size_t i = 0; i < header->value.len; i++) {
+            if (header->value.data[i] < '0' || header->value.data[i] > '9') return -1;
+        }
+        request->have_content_length = 1;
+    } else if (http_slice_equals_nocase(header->name, "Transfer-Encoding")) {
+        if (request->have_content_length) return -1;
+        request->have_transfer_encoding = 1;
+    }
+    return 0;
+}
+
+// "name: value", surrounding whitespace of the value is not part of it
+static int parse_header_line(struct http_request *request, const char *line, const char *end) {
+    const char *colon = find_byte(line, end, ':');
+    if (!colon || !is_token(line, colon - line)) return -1; // Also rejects obsolete folded lines, which start with a space
+    if (request->header_count == HTTP_MAX_HEADERS) return -2;
+
+    const char *value = colon + 1;
+    while (value < end && (*value == ' ' || *value == '\t')) value++;
+    const char *value_end = end;
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+    if (find_control(value, value_end)) return -1;
+
+    struct http_header *header = &request->headers[request->header_count++];
+    header->name.data = line;
+    header->name.len = colon - line;
+    header->value.data = value;
+    header->value.len = value_end - value;
+    return check_body_length(request, header);
+}
+
+void http_request_init(struct http_request *request) {
+    request->header_count = 0;
+    request->line_start = 0;
+    request->scanned = 0;
+    request->have_request_line = 0;
+    request->have_content_length = 0;
+    request->have_transfer_encoding = 0;
+}
+
+long http_parse_request(struct http_request *request, const char *buffer, size_t length) {
+    const char *end = buffer + length;
+
+    for (;;) {
+        const char *line = buffer + request->line_start;
+        const char *newline = find_byte(buffer + request->scanned, end, '\n');
+        if (!newline) {
+            request->scanned = length;
+            return HTTP_PARSE_INCOMPLETE;
+        }
+        request->line_start = request->scanned = newline + 1 - buffer;
+
+        // Lines end with CRLF, a bare LF is accepted as well
+        const char *line_end = newline;
+        if (line_end > line && line_end[-1] == '\r') line_end--;
+
+        if (!request->have_request_line) {
+            if (line_end == line) continue; // Empty lines before a request are ignored (RFC 7230 3.5)
+            if (parse_request_line(request, line, line_end) < 0) return HTTP_PARSE_INVALID;
+            request->have_request_line = 1;
+            continue;
+        }
+
+        if (line_end == line) return request->line_start; // The blank line ends the head
+
+        int status = parse_header_line(request, line, line_end);
+        if (status == -2) return HTTP_PARSE_TOO_LARGE;
+        if (status < 0) return HTTP_PARSE_INVALID;
+    }
+}
+
+const struct http_slice *http_request_header(const struct http_request *request, const char *name) {
+    for (int i = 0; i < request->header_count; i++) {
+        if (http_slice_equals_nocase(request->headers[i].name, name)) return &request->headers[i].value;
+    }
+    return NULL;
+}
+
+int http_request_has_token(const struct http_request *request, const char *name, const char *token) {
+    for (int i = 0; i < request->header_count; i++) {
+        if (!http_slice_equals_nocase(request->headers[i].name, name)) continue;
+        const char *p = request->headers[i].value.data;
+        const char *end = p + request->headers[i].value.len;
+        while (p < end) {
+            const char *comma = memchr(p, ',', end - p);
+            const char *element_end = comma ? comma : end;
+            while (p < element_end && (*p == ' ' || *p == '\t')) p++;
+            const char *last = element_end;
+            while (last > p && (last[-1] == ' ' || last[-1] == '\t')) last--;
+            if (http_slice_equals_nocase((struct http_slice){.data = p, .len = last - p}, token)) return 1;
+            p = element_end + 1;
+        }
+    }
+    return 0;
+}
+
+int http_slice_equals(struct http_slice slice, const char *text) {
+    return strlen(text) == slice.len && memcmp(slice.data, text, slice.len) == 0;
+}
+
+int http_slice_equals_nocase(struct http_slice slice, const char *text) {
+    return strlen(text) == slice.len && strncasecmp(slice.data, text, slice.len) == 0;
+}
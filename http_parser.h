@@ -0,0 +1,87 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+
+#define HTTP_MAX_HEADERS 32 // More header lines than this are answered with 431
+
+// A piece of the request buffer. Slices are not NUL-terminated and stay valid as long as the buffer does.
+struct http_slice {
+    const char *data;
+    size_t len;
+};
+
+struct http_header {
+    struct http_slice name;
+    struct http_slice value;
+};
+
+/*
+ * Parse result and parser state for one HTTP/1.x request head.
+ * Nothing is copied: method, uri, version and headers point into the buffer given to http_parse_request().
+ * The parser remembers how far it got, so when a request arrives in several reads,
+   every call only looks at the bytes added since the previous one.
+ */
+struct http_request {
+    struct http_slice method;
+    struct http_slice uri;
+    struct http_slice version;
+    int minor_version; // 0 for HTTP/1.0, 1 for HTTP/1.1
+    struct http_header headers[HTTP_MAX_HEADERS];
+    int header_count;
+
+    // Parser state, offsets into the buffer
+    size_t line_start;     // Start of the line being parsed
+    size_t scanned;        // Bytes already searched for the end of that line
+    int have_request_line; // The request line is done, the lines that follow are headers
+    int have_content_length;
+    int have_transfer_encoding;
+};
+
+enum http_parse_status {
+    HTTP_PARSE_INCOMPLETE = 0, // Need more bytes
+    HTTP_PARSE_INVALID = -1,   // Malformed request or ambiguous body length, answer 400
+    HTTP_PARSE_TOO_LARGE = -2, // Too many header lines, answer 431
+};
+
+// Instruction sets the byte scanners may use
+enum http_parser_simd {
+    HTTP_SIMD_NONE = 0, // Plain loops
+    HTTP_SIMD_SSE = 1,  // SSE2 line search, SSE4.2 control character check where the CPU has it
+    HTTP_SIMD_AVX2 = 2, // AVX2 line search
+};
+
+/*
+ * Limits the parser to an instruction set, for parser_test and parser_bench; by default it uses the best the CPU has.
+ * Returns the level actually used, lower if the CPU does not support the one asked for (always HTTP_SIMD_NONE off x86).
+ * Not thread-safe, call it before parsing.
+ */
+int http_parser_set_simd(int level);
+
+// Resets the parser for a new request.
+void http_request_init(struct http_request *request);
+
+/*
+ * Parses the request head in buffer[0..length). The buffer must be the same (with more bytes appended)
+   across calls for one request.
+ * Returns the length of the complete head including the blank line, or an http_parse_status.
+ * A head with more than one Content-Length, one that is not a number, or both Content-Length and Transfer-Encoding
+   is invalid: whoever forwarded it may see a different body length than we do (request smuggling).
+ * A head that fills the caller's whole buffer without completing is the caller's to reject (431).
+ */
+long http_parse_request(struct http_request *request, const char *buffer, size_t length);
+
+// Looks up a header by name, ignoring case. Returns NULL if the request does not have it.
+const struct http_slice *http_request_header(const struct http_request *request, const char *name);
+
+/*
+ * Tells whether a header with a comma-separated list value (e.g. "Connection: keep-alive, Upgrade") has token
+   in the list of any of its lines, ignoring case and the whitespace around each element.
+ */
+int http_request_has_token(const struct http_request *request, const char *name, const char *token);
+
+// Compares a slice with a NUL-terminated string, case sensitive or not.
+int http_slice_equals(struct http_slice slice, const char *text);
+int http_slice_equals_nocase(struct http_slice slice, const char *text);
+
+#endif
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "http_header.h"
+#include "http_range.h"
+
+#define BOUNDARY_SIZE 24
+
+/*
+ * A multipart/byteranges response in progress. Part i is its own header followed by range i of the file,
+   the closing boundary is the last part. The event loop asks for each part once the previous one is sent.
+ */
+struct multipart {
+    struct byte_range ranges[RANGE_MAX];
+    int count;
+    int next; // Next range to queue, count once only the closing boundary is left
+    char boundary[BOUNDARY_SIZE];
+    char part_header[HEADER_BUFFER_SIZE];
+    struct range_source source;
+};
+
+static unsigned long boundary_counter;
+
+// Parses up to 18 digits, so the value always fits in an off_t. Returns the number of digits read.
+static int parse_number(const char *p, const char *end, off_t *value) {
+    int digits = 0;
+    *value = 0;
+    while (p + digits < end && p[digits] >= '0' && p[digits] <= '9') {
+        if (digits == 18) return 0;
+        *value = *value * 10 + (p[digits] - '0');
+        digits++;
+    }
+    return digits;
+}
+
+// If-Range holds either an entity tag or a date. Either must match exactly, and weak tags never do.
+static int if_range_matches(struct http_slice if_range, const struct file_validators *validators) {
+    if (if_range.len > 0 && (if_range.data[0] == '"' || if_range.data[0] == 'W')) {
+        if (validators->etag[0] == 'W') return 0;
+        return http_slice_equals(if_range, validators->etag);
+    }
+    return http_slice_equals(if_range, validators->last_modified);
+}
+
+int http_range_parse(const struct http_request *request, off_t size, const struct file_validators *validators,
+                     struct byte_range *ranges) {
+    const struct http_slice *range = http_request_header(request, "Range");
+    if (!range || range->len < 6 || strncasecmp(range->data, "bytes=", 6) != 0) return 0;
+
+    const struct http_slice *if_range = http_request_header(request, "If-Range");
+    if (if_range && !if_range_matches(*if_range, validators)) return 0; // The client's partial copy is outdated
+
+    const char *p = range->data + 6;
+    const char *end = range->data + range->len;
+    int count = 0;
+    int specs = 0;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p == end) break;
+        if (++specs > RANGE_MAX) return 0;
+
+        // "first-last", "first-" or "-suffix_length"
+        off_t first = -1, last = -1, number;
+        int digits = parse_number(p, end, &number);
+        if (digits > 0) {
+            first = number;
+            p += digits;
+        }
+        if (p == end || *p != '-') return 0;
+        p++;
+        digits = parse_number(p, end, &number);
+        if (digits > 0) {
+            last = number;
+            p += digits;
+        }
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p < end && *p != ',') return 0;
+
+        off_t start, stop;
+        if (first >= 0) {
+            if (last >= 0 && last < first) return 0;
+            if (first >= size) continue; // Starts past the end, this range is unsatisfiable
+            start = first;
+            stop = last >= 0 && last < size ? last + 1 : size;
+        } else {
+            if (last < 0) return 0; // A lone "-"
+            if (last == 0) continue;
+            start = last < size ? size - last : 0;
+            stop = size;
+        }
+        if (start >= stop) continue;
+        ranges[count].start = start;
+        ranges[count].length = stop - start;
+        count++;
+    }
+
+    if (specs == 0) return 0;
+    return count > 0 ? count : -1;
+}
+
+void http_range_send_unsatisfiable(struct connection *conn, off_t size) {
+    struct header_builder header;
+    http_header_start(&header, conn->io->header, sizeof(conn->io->header), 416);
+    http_header_add_literal(&header, "Content-Range: bytes */");
+    http_header_add_number(&header, size);
+    http_header_add_literal(&header, "\r\nContent-Length: 0\r\n");
+    http_header_finish(&header, conn);
+    connection_send_response(conn, header.data, header.len);
+}
+
+static int format_part_header(const struct multipart *multipart, int index, char *out, size_t size) {
+    const struct byte_range *range = &multipart->ranges[index];
+    return snprintf(out, size, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    multipart->boundary, multipart->source.mime_type, (long long)range->start,
+                    (long long)(range->start + range->length - 1), (long long)multipart->source.size);
+}
+
+static void release_multipart(void *arg) {
+    struct multipart *multipart = arg;
+    if (multipart->source.owns_fd) close(multipart->source.fd);
+    if (multipart->source.release) multipart->source.release(multipart->source.release_arg);
+    free(multipart);
+}
+
+/*
+ * Queues the next part, after the pieces in prefix (the response header for the first part).
+ * Returns 0 once the closing boundary has been sent as well.
+ */
+static int queue_part(struct connection *conn, struct multipart *multipart, const struct iovec *prefix, int prefix_count) {
+    struct iovec pieces[RESPONSE_MAX_IOV];
+    int count = 0;
+    while (count < prefix_count) {
+        pieces[count] = prefix[count];
+        count++;
+    }
+
+    if (multipart->next > multipart->count) return 0;
+    if (multipart->next == multipart->count) {
+        int length = snprintf(multipart->part_header, sizeof(multipart->part_header), "\r\n--%s--\r\n", multipart->boundary);
+        pieces[count++] = (struct iovec){.iov_base = multipart->part_header, .iov_len = length};
+        connection_queue_part(conn, pieces, count);
+        connection_set_next_part(conn, NULL); // Nothing follows, let the last bytes go out at once
+        multipart->next++;
+        return 1;
+    }
+
+    const struct byte_range *range = &multipart->ranges[multipart->next];
+    int length = format_part_header(multipart, multipart->next, multipart->part_header, sizeof(multipart->part_header));
+    pieces[count++] = (struct iovec){.iov_base = multipart->part_header, .iov_len = length};
+    if (multipart->source.data) {
+        pieces[count++] = (struct iovec){.iov_base = (void *)(multipart->source.data + range->start), .iov_len = range->length};
+        connection_queue_part(conn, pieces, count);
+    } else {
+        connection_queue_part(conn, pieces, count);
+        connection_add_file_body(conn, multipart->source.fd, range->start, range->length, 0);
+    }
+    multipart->next++;
+    return 1;
+}
+
+static int next_part(struct connection *conn, void *arg) {
+    return queue_part(conn, arg, NULL, 0);
+}
+
+static void send_single(struct connection *conn, const struct byte_range *range, const struct range_source *source) {
+    struct header_builder header;
+    http_header_start(&header, conn->io->header, sizeof(conn->io->header), 206);
+    http_header_add_literal(&header, "Content-Type: ");
+    http_header_add(&header, source->mime_type, strlen(source->mime_type));
+    http_header_add_literal(&header, "\r\nContent-Length: ");
+    http_header_add_number(&header, range->length);
+    http_header_add_literal(&header, "\r\nContent-Range: bytes ");
+    http_header_add_number(&header, range->start);
+    http_header_add_literal(&header, "-");
+    http_header_add_number(&header, range->start + range->length - 1);
+    http_header_add_literal(&header, "/");
+    http_header_add_number(&header, source->size);
+    http_header_add_literal(&header, "\r\n");
+    http_header_add_validators(&header, source->validators);
+    http_header_add_cache_policy(&header, source->cache_policy);
+    int complete = http_header_finish(&header, conn) == 0; // Otherwise a 500 goes out without the range
+    struct iovec pieces[2] = {
+        {.iov_base = header.data, .iov_len = header.len},
+        {.iov_base = (void *)(source->data + range->start), .iov_len = range->length},
+    };
+    if (source->data) {
+        connection_send_buffers(conn, pieces, complete ? 2 : 1, source->release, source->release_arg);
+    } else {
+        connection_send_buffers(conn, pieces, 1, source->release, source->release_arg);
+        if (complete) {
+            connection_add_file_body(conn, source->fd, range->start, range->length, source->owns_fd);
+        } else if (source->owns_fd) {
+            close(source->fd);
+        }
+    }
+}
+
+void http_range_send(struct connection *conn, const struct byte_range *ranges, int count, const struct range_source *source) {
+    conn->mime_type = source->mime_type;
+
+    if (count == 1) {
+        send_single(conn, &ranges[0], source);
+        return;
+    }
+
+    struct multipart *multipart = malloc(sizeof(*multipart));
+    if (!multipart) {
+        // Nothing is queued, so the connection is closed
+        if (source->owns_fd) close(source->fd);
+        if (source->release) source->release(source->release_arg);
+        return;
+    }
+    memcpy(multipart->ranges, ranges, count * sizeof(*ranges));
+    multipart->count = count;
+    multipart->next = 0;
+    multipart->source = *source;
+    multipart->source.validators = NULL; // Only needed for the response header below
+    const struct file_validators *validators = source->validators;
+    unsigned long unique = __atomic_add_fetch(&boundary_counter, 1, __ATOMIC_RELAXED) ^ ((unsigned long)time(NULL) << 20);
+    snprintf(multipart->boundary, sizeof(multipart->boundary), "%016lx", unique * 0x9e3779b97f4a7c15ul);
+
+    // Every part header is formatted once up front to know the Content-Length
+    off_t content_length = snprintf(NULL, 0, "\r\n--%s--\r\n", multipart->boundary);
+    int parts_fit = 1;
+    for (int i = 0; i < count; i++) {
+        int length = format_part_header(multipart, i, NULL, 0);
+        if (length >= (int)sizeof(multipart->part_header)) parts_fit = 0;
+        content_length += length + ranges[i].length;
+    }
+
+    struct header_builder builder;
+    http_header_start(&builder, conn->io->header, sizeof(conn->io->header), 206);
+    http_header_add_literal(&builder, "Content-Type: multipart/byteranges; boundary=");
+    http_header_add(&builder, multipart->boundary, strlen(multipart->boundary));
+    http_header_add_literal(&builder, "\r\nContent-Length: ");
+    http_header_add_number(&builder, content_length);
+    http_header_add_literal(&builder, "\r\n");
+    http_header_add_validators(&builder, validators);
+    http_header_add_cache_policy(&builder, source->cache_policy);
+    if (!parts_fit) builder.overflowed = 1; // A part header would be cut short, answer with the 500 instead
+    int complete = http_header_finish(&builder, conn) == 0;
+    struct iovec header = {.iov_base = builder.data, .iov_len = builder.len};
+    connection_send_buffers(conn, &header, 1, release_multipart, multipart);
+    if (!complete) return; // The 500 goes out alone
+    connection_set_next_part(conn, next_part);
+    queue_part(conn, multipart, &header, 1);
+}
@@ -0,0 +1,53 @@
+#ifndef HTTP_RANGE_H
+#define HTTP_RANGE_H
+
+#include <sys/types.h>
+
+#include "cache_policy.h"
+#include "event_loop.h"
+#include "file_validators.h"
+#include "http_parser.h"
+
+#define RANGE_MAX 8 // Requests for more ranges get the whole file, so a request cannot multiply the response
+
+struct byte_range {
+    off_t start;
+    off_t length;
+};
+
+/*
+ * Reads the Range header of request for a file of the given size (RFC 7233).
+ * Returns the number of ranges written to ranges (at most RANGE_MAX), 0 if the whole file should be sent
+   (no Range header, a syntax error, an unknown unit, too many ranges or an If-Range that no longer matches)
+   and -1 if no range overlaps the file, which is answered with 416.
+ * If-Range matches only the exact Last-Modified date or a strong ETag equal to ours.
+ */
+int http_range_parse(const struct http_request *request, off_t size, const struct file_validators *validators,
+                     struct byte_range *ranges);
+
+/*
+ * The file a range response is cut from: its content in memory, or a descriptor to send from.
+ * mime_type must stay valid until the response is sent, validators only during http_range_send().
+ */
+struct range_source {
+    const char *mime_type;
+    const struct file_validators *validators;
+    const struct cache_policy *cache_policy; // Cache-Control of the response, NULL for none
+    off_t size;
+    const char *data; // File content, NULL to send from fd
+    int fd;
+    int owns_fd; // Close fd once the response is done
+    void (*release)(void *); // Called once the response no longer needs data or fd
+    void *release_arg;
+};
+
+/*
+ * Queues a 206 response on conn: the single range as the body, or several as multipart/byteranges.
+ * Every range is sent straight from source at its offset, with sendfile() for a descriptor.
+ */
+void http_range_send(struct connection *conn, const struct byte_range *ranges, int count, const struct range_source *source);
+
+// Queues the 416 response for a file of the given size.
+void http_range_send_unsatisfiable(struct connection *conn, off_t size);
+
+#endif
@@ -0,0 +1,281 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_cache.h"
+#include "http_header.h"
+#include "metrics.h"
+
+__thread struct thread_metrics *metrics_current;
+
+static struct thread_metrics *threads[METRICS_MAX_THREADS];
+static int thread_count;
+static struct thread_metrics overflow; // Written by every thread past METRICS_MAX_THREADS, never read
+
+static const char *const stage_names[METRIC_STAGE_COUNT] = {"parse", "open", "first_byte", "response"};
+
+struct thread_metrics *metrics_register_thread(void) {
+    struct thread_metrics *metrics = aligned_alloc(64, sizeof(*metrics));
+    int index = __atomic_fetch_add(&thread_count, 1, __ATOMIC_RELAXED);
+    if (!metrics || index >= METRICS_MAX_THREADS) {
+        free(metrics);
+        metrics_current = &overflow;
+        return metrics_current;
+    }
+    memset(metrics, 0, sizeof(*metrics));
+    __atomic_store_n(&threads[index], metrics, __ATOMIC_RELEASE);
+    metrics_current = metrics;
+    return metrics;
+}
+
+void metrics_record_latency(enum metrics_stage stage, uint64_t nanoseconds) {
+    struct thread_metrics *metrics = metrics_local();
+    // Bucket b holds what is below 2^b microseconds, so finding it is a count of leading zeros
+    uint64_t microseconds = nanoseconds / 1000;
+    int bucket = microseconds ? 64 - __builtin_clzll(microseconds) : 0;
+    if (bucket > METRICS_LATENCY_BUCKETS) bucket = METRICS_LATENCY_BUCKETS;
+    metrics_add_to(&metrics->latency[stage][bucket], 1);
+    metrics_add_to(&metrics->latency_sum_ns[stage], nanoseconds);
+}
+
+void metrics_record_response(int status, const char *mime_type, uint64_t bytes) {
+    struct thread_metrics *metrics = metrics_local();
+    if (status >= METRICS_STATUS_MIN && status <= METRICS_STATUS_MAX) {
+        metrics_add_to(&metrics->status[status - METRICS_STATUS_MIN], 1);
+    } else {
+        metrics_add_to(&metrics->status_other, 1);
+    }
+    metrics_add_to(&metrics->counters[METRIC_BYTES_SENT], bytes);
+    if (!mime_type) return;
+
+    // MIME types are static strings, so the pointer itself is the key
+    unsigned slot = ((uintptr_t)mime_type >> 3) * 0x9e3779b97f4a7c15ull >> 59;
+    for (int probe = 0; probe < METRICS_TYPE_SLOTS; probe++) {
+        struct metrics_type_count *entry = &metrics->types[(slot + probe) % METRICS_TYPE_SLOTS];
+        if (entry->type == mime_type) {
+            metrics_add_to(&entry->count, 1);
+            return;
+        }
+        if (!entry->type) {
+            entry->count = 1;
+            __atomic_store_n(&entry->type, mime_type, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+    metrics_add_to(&metrics->types_other, 1);
+}
+
+static struct thread_metrics *thread_at(int index) {
+    return __atomic_load_n(&threads[index], __ATOMIC_ACQUIRE);
+}
+
+static int registered_threads(void) {
+    int count = __atomic_load_n(&thread_count, __ATOMIC_RELAXED);
+    return count < METRICS_MAX_THREADS ? count : METRICS_MAX_THREADS;
+}
+
+static uint64_t load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_total(enum metrics_counter counter) {
+    uint64_t total = 0;
+    int count = registered_threads();
+    for (int i = 0; i < count; i++) {
+        struct thread_metrics *metrics = thread_at(i);
+        if (metrics) total += load(&metrics->counters[counter]);
+    }
+    return total;
+}
+
+struct text {
+    char *data;
+    size_t len;
+    size_t capacity;
+    int failed;
+};
+
+static void append(struct text *text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(struct text *text, const char *format, ...) {
+    if (text->failed) return;
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(text->data + text->len, text->capacity - text->len, format, args);
+        va_end(args);
+        if (length < 0) {
+            text->failed = 1;
+            return;
+        }
+        if ((size_t)length < text->capacity - text->len) {
+            text->len += length;
+            return;
+        }
+        size_t capacity = text->capacity * 2 + length;
+        char *data = realloc(text->data, capacity);
+        if (!data) {
+            text->failed = 1;
+            return;
+        }
+        text->data = data;
+        text->capacity = capacity;
+    }
+}
+
+static void append_counter(struct text *text, const char *name, const char *help, const char *type, uint64_t value) {
+    append(text, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name, (unsigned long long)value);
+}
+
+static void append_statuses(struct text *text, int count) {
+    append(text, "# HELP http_responses_total Responses sent completely, by status code.\n"
+                 "# TYPE http_responses_total counter\n");
+    uint64_t other = 0;
+    for (int i = 0; i < count; i++) {
+        struct thread_metrics *metrics = thread_at(i);
+        if (metrics) other += load(&metrics->status_other);
+    }
+    for (int status = METRICS_STATUS_MIN; status <= METRICS_STATUS_MAX; status++) {
+        uint64_t total = 0;
+        for (int i = 0; i < count; i++) {
+            struct thread_metrics *metrics = thread_at(i);
+            if (metrics) total += load(&metrics->status[status - METRICS_STATUS_MIN]);
+        }
+        if (total) append(text, "http_responses_total{code=\"%d\"} %llu\n", status, (unsigned long long)total);
+    }
+    if (other) append(text, "http_responses_total{code=\"other\"} %llu\n", (unsigned long long)other);
+}
+
+// Every thread has its own slots, so one type may sit in several of them (and with separate copies of the string)
+static void append_types(struct text *text, int count) {
+    append(text, "# HELP http_responses_by_type_total Responses with a body sent completely, by Content-Type.\n"
+                 "# TYPE http_responses_by_type_total counter\n");
+    const char *types[METRICS_TYPE_SLOTS * 4];
+    uint64_t totals[METRICS_TYPE_SLOTS * 4];
+    int type_count = 0;
+    uint64_t other = 0;
+    for (int i = 0; i < count; i++) {
+        struct thread_metrics *metrics = thread_at(i);
+        if (!metrics) continue;
+        other += load(&metrics->types_other);
+        for (int slot = 0; slot < METRICS_TYPE_SLOTS; slot++) {
+            const char *type = __atomic_load_n(&metrics->types[slot].type, __ATOMIC_ACQUIRE);
+            if (!type) continue;
+            uint64_t value = load(&metrics->types[slot].count);
+            int j;
+            for (j = 0; j < type_count && strcmp(types[j], type) != 0; j++) {
+            }
+            if (j == type_count) {
+                if (type_count == (int)(sizeof(types) / sizeof(types[0]))) {
+                    other += value;
+                    continue;
+                }
+                types[type_count] = type;
+                totals[type_count++] = 0;
+            }
+            totals[j] += value;
+        }
+    }
+    for (int j = 0; j < type_count; j++) {
+        append(text, "http_responses_by_type_total{type=\"%s\"} %llu\n", types[j], (unsigned long long)totals[j]);
+    }
+    if (other) append(text, "http_responses_by_type_total{type=\"other\"} %llu\n", (unsigned long long)other);
+}
+
+static void append_latencies(struct text *text, int count) {
+    append(text, "# HELP http_request_stage_seconds Latency of each stage of a request.\n"
+                 "# TYPE http_request_stage_seconds histogram\n");
+    for (int stage = 0; stage < METRIC_STAGE_COUNT; stage++) {
+        uint64_t buckets[METRICS_LATENCY_BUCKETS + 1] = {0};
+        uint64_t sum_ns = 0;
+        for (int i = 0; i < count; i++) {
+            struct thread_metrics *metrics = thread_at(i);
+            if (!metrics) continue;
+            for (int b = 0; b <= METRICS_LATENCY_BUCKETS; b++) buckets[b] += load(&metrics->latency[stage][b]);
+            sum_ns += load(&metrics->latency_sum_ns[stage]);
+        }
+
+        // Prometheus buckets are cumulative: each counts everything at or below its bound
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_LATENCY_BUCKETS; b++) {
+            cumulative += buckets[b];
+            append(text, "http_request_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", stage_names[stage],
+                   (double)(1ull << b) / 1e6, (unsigned long long)cumulative);
+        }
+        cumulative += buckets[METRICS_LATENCY_BUCKETS];
+        append(text, "http_request_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[stage],
+               (unsigned long long)cumulative);
+        append(text, "http_request_stage_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[stage], sum_ns / 1e9);
+        append(text, "http_request_stage_seconds_count{stage=\"%s\"} %llu\n", stage_names[stage],
+               (unsigned long long)cumulative);
+    }
+}
+
+void metrics_send(struct connection *conn) {
+    struct text text = {.capacity = 16384};
+    text.data = malloc(text.capacity);
+    if (!text.data) return; // Nothing queued, the connection is closed
+
+    int count = registered_threads();
+    uint64_t accepted = metrics_total(METRIC_CONNECTIONS_ACCEPTED);
+    uint64_t closed = metrics_total(METRIC_CONNECTIONS_CLOSED);
+    append_counter(&text, "http_connections_accepted_total", "Client connections accepted.", "counter", accepted);
+    append_counter(&text, "http_connections_active", "Client connections open now.", "gauge",
+                   accepted > closed ? accepted - closed : 0);
+    uint64_t borrowed = metrics_total(METRIC_IO_BUFFERS_BORROWED);
+    uint64_t returned = metrics_total(METRIC_IO_BUFFERS_RETURNED);
+    append_counter(&text, "http_io_buffers_active", "Connections holding request and response buffers now, the others wait idle.",
+                   "gauge", borrowed > returned ? borrowed - returned : 0);
+    append_counter(&text, "http_connection_pool_bytes", "Memory allocated for connections and their buffers.", "gauge",
+                   metrics_total(METRIC_POOL_BYTES));
+    append_counter(&text, "http_accept_errors_total", "Failed accept() calls and connections that could not be set up.",
+                   "counter", metrics_total(METRIC_ACCEPT_ERRORS));
+    append_counter(&text, "http_response_bytes_total", "Bytes of responses sent completely, headers included.", "counter",
+                   metrics_total(METRIC_BYTES_SENT));
+    append(&text, "# HELP http_connections_timed_out_total Connections closed by a timeout: request head too slow, "
+                  "response read too slowly, or kept alive without a request.\n"
+                  "# TYPE http_connections_timed_out_total counter\n"
+                  "http_connections_timed_out_total{reason=\"header\"} %llu\n"
+                  "http_connections_timed_out_total{reason=\"send\"} %llu\n"
+                  "http_connections_timed_out_total{reason=\"idle\"} %llu\n",
+           (unsigned long long)metrics_total(METRIC_TIMEOUTS_HEADER), (unsigned long long)metrics_total(METRIC_TIMEOUTS_SEND),
+           (unsigned long long)metrics_total(METRIC_TIMEOUTS_IDLE));
+    append(&text, "# HELP http_connections_rejected_total Clients answered with a 503 because a connection limit was reached.\n"
+                  "# TYPE http_connections_rejected_total counter\n"
+                  "http_connections_rejected_total{limit=\"connections\"} %llu\n"
+                  "http_connections_rejected_total{limit=\"per_address\"} %llu\n",
+           (unsigned long long)metrics_total(METRIC_REJECTED_CONNECTIONS),
+           (unsigned long long)metrics_total(METRIC_REJECTED_PER_ADDRESS));
+    append_counter(&text, "access_log_dropped_total", "Access log lines dropped because the writer fell behind.",
+                   "counter", metrics_total(METRIC_ACCESS_LOG_DROPPED));
+    append_statuses(&text, count);
+    append_types(&text, count);
+    append_latencies(&text, count);
+
+    struct cache_stats stats;
+    file_cache_get_stats(&stats);
+    append_counter(&text, "file_cache_hits_total", "File cache lookups that found the file.", "counter", stats.hits);
+    append_counter(&text, "file_cache_misses_total", "File cache lookups that did not.", "counter", stats.misses);
+    append_counter(&text, "file_cache_evictions_total", "Files dropped to stay within the budget.", "counter", stats.evictions);
+    append_counter(&text, "file_cache_invalidations_total", "Files dropped because they changed.", "counter", stats.invalidations);
+    append_counter(&text, "file_cache_entries", "Files in the cache.", "gauge", stats.entries);
+    append_counter(&text, "file_cache_bytes", "Memory held by cached files.", "gauge", stats.bytes);
+    append_counter(&text, "file_cache_open_files", "Large cached files kept open instead of in memory.", "gauge", stats.open_files);
+
+    if (text.failed) {
+        free(text.data);
+        return;
+    }
+    struct header_builder header;
+    http_header_start(&header, conn->io->header, sizeof(conn->io->header), 200);
+    http_header_add_literal(&header, "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\nContent-Length: ");
+    http_header_add_number(&header, text.len);
+    http_header_add_literal(&header, "\r\nCache-Control: no-store\r\n");
+    int complete = http_header_finish(&header, conn) == 0;
+    struct iovec pieces[2] = {
+        {.iov_base = header.data, .iov_len = header.len},
+        {.iov_base = text.data, .iov_len = text.len},
+    };
+    connection_send_buffers(conn, pieces, complete ? 2 : 1, free, text.data);
+}
@@ -0,0 +1,104 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "event_loop.h"
+
+#define METRICS_PATH "/metrics"     // Reserved URL answered with metrics_send() instead of a file
+#define METRICS_MAX_THREADS 256     // Threads beyond this share a block that is never reported
+#define METRICS_LATENCY_BUCKETS 24  // Powers of two from 1 us up to 8.4 s, slower lands in +Inf
+#define METRICS_TYPE_SLOTS 32       // MIME types counted per thread, more go to "other"
+#define METRICS_STATUS_MIN 100
+#define METRICS_STATUS_MAX 599
+
+enum metrics_counter {
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_ACCEPT_ERRORS,
+    METRIC_BYTES_SENT,
+    METRIC_CACHE_HITS,
+    METRIC_CACHE_MISSES,
+    METRIC_ACCESS_LOG_DROPPED,
+    METRIC_TIMEOUTS_HEADER, // Connections closed for not sending a complete request head in time
+    METRIC_TIMEOUTS_SEND,   // Connections closed for reading their response slower than SEND_MIN_RATE
+    METRIC_TIMEOUTS_IDLE,   // Kept-alive connections closed after waiting KEEPALIVE_TIMEOUT for a request
+    METRIC_REJECTED_CONNECTIONS, // Clients turned away with a 503 because the server had its most connections open
+    METRIC_REJECTED_PER_ADDRESS, // Clients turned away with a 503 because their address had its most connections open
+    METRIC_IO_BUFFERS_BORROWED,  // See struct io_buffer, the difference to the returned ones is held now
+    METRIC_IO_BUFFERS_RETURNED,
+    METRIC_POOL_BYTES,           // Allocated for the connection and io_buffer pools, which never shrink
+    METRIC_COUNTER_COUNT
+};
+
+// Stages of a request whose latency is recorded, each measured from the end of parsing except METRIC_STAGE_PARSE
+enum metrics_stage {
+    METRIC_STAGE_PARSE,      // CPU time spent parsing the request head
+    METRIC_STAGE_OPEN,       // Until the file is found: cache lookup, or open() and fstat()
+    METRIC_STAGE_FIRST_BYTE, // Until the first response byte is handed to the kernel
+    METRIC_STAGE_RESPONSE,   // Until the last response byte is handed to the kernel
+    METRIC_STAGE_COUNT
+};
+
+struct metrics_type_count {
+    const char *type; // Set once, published with a release store
+    uint64_t count;
+};
+
+/*
+ * The counters of one thread. Only that thread writes them, with plain relaxed stores and no locked
+   instructions, and each block starts on its own cache line, so counting never bounces lines between CPUs.
+ * metrics_send() sums every block with relaxed loads, so a scrape sees each counter whole but the
+   counters of one block not necessarily at the same instant.
+ */
+struct thread_metrics {
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    uint64_t status[METRICS_STATUS_MAX - METRICS_STATUS_MIN + 1];
+    uint64_t status_other;
+    struct metrics_type_count types[METRICS_TYPE_SLOTS];
+    uint64_t types_other;
+    uint64_t latency[METRIC_STAGE_COUNT][METRICS_LATENCY_BUCKETS + 1];
+    uint64_t latency_sum_ns[METRIC_STAGE_COUNT];
+} __attribute__((aligned(64)));
+
+extern __thread struct thread_metrics *metrics_current;
+
+// Allocates and registers the block of the calling thread on its first count.
+struct thread_metrics *metrics_register_thread(void);
+
+static inline struct thread_metrics *metrics_local(void) {
+    return metrics_current ? metrics_current : metrics_register_thread();
+}
+
+// Single writer, so a load and a store are enough and readers never see a torn value
+static inline void metrics_add_to(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_add(enum metrics_counter counter, uint64_t n) {
+    metrics_add_to(&metrics_local()->counters[counter], n);
+}
+
+// Monotonic nanoseconds, the time base of every latency
+static inline uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void metrics_record_latency(enum metrics_stage stage, uint64_t nanoseconds);
+
+// Counts a completed response by status code and, if it has a body of a known type, by mime_type (a static string).
+void metrics_record_response(int status, const char *mime_type, uint64_t bytes);
+
+// Returns the sum of counter over every thread.
+uint64_t metrics_total(enum metrics_counter counter);
+
+/*
+ * Queues the metrics of every thread in the Prometheus text format (version 0.0.4) as the response on conn.
+ * Nothing is locked: the blocks are read while their threads keep counting.
+ */
+void metrics_send(struct connection *conn);
+
+#endif
@@ -0,0 +1,325 @@
+#define _GNU_SOURCE // For getline()
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mime_types.h"
+
+#define MAX_DISPLACEMENT 65535 // Displacements are stored in 16 bits
+#define SEED_ATTEMPTS 64       // Seeds tried before the table is made larger
+
+struct mime_entry {
+    char extension[MIME_EXTENSION_MAX + 1]; // Lowercase, all zero in an empty slot
+    const char *type;
+};
+
+static const struct mime_entry builtin_types[] = {
+    // Documents and code
+    {"html", "text/html"}, {"htm", "text/html"}, {"shtml", "text/html"}, {"xhtml", "application/xhtml+xml"},
+    {"css", "text/css"}, {"js", "application/javascript"}, {"mjs", "application/javascript"},
+    {"json", "application/json"}, {"map", "application/json"}, {"jsonld", "application/ld+json"},
+    {"webmanifest", "application/manifest+json"}, {"xml", "application/xml"}, {"xsl", "application/xml"},
+    {"atom", "application/atom+xml"}, {"rss", "application/rss+xml"}, {"txt", "text/plain"},
+    {"text", "text/plain"}, {"log", "text/plain"}, {"md", "text/markdown"}, {"markdown", "text/markdown"},
+    {"csv", "text/csv"}, {"tsv", "text/tab-separated-values"}, {"ics", "text/calendar"}, {"vcf", "text/vcard"},
+    {"yaml", "application/yaml"}, {"yml", "application/yaml"}, {"toml", "application/toml"},
+    {"wasm", "application/wasm"}, {"pdf", "application/pdf"}, {"rtf", "application/rtf"},
+    {"epub", "application/epub+zip"},
+    {"doc", "application/msword"}, {"xls", "application/vnd.ms-excel"}, {"ppt", "application/vnd.ms-powerpoint"},
+    {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
+    {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+    {"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
+    {"odt", "application/vnd.oasis.opendocument.text"}, {"ods", "application/vnd.oasis.opendocument.spreadsheet"},
+    {"odp", "application/vnd.oasis.opendocument.presentation"},
+    // Images
+    {"png", "image/png"}, {"apng", "image/apng"}, {"jpg", "image/jpeg"}, {"jpeg", "image/jpeg"},
+    {"jpe", "image/jpeg"}, {"gif", "image/gif"}, {"webp", "image/webp"}, {"avif", "image/avif"},
+    {"jxl", "image/jxl"}, {"heic", "image/heic"}, {"svg", "image/svg+xml"}, {"ico", "image/x-icon"},
+    {"cur", "image/x-icon"}, {"bmp", "image/bmp"}, {"tif", "image/tiff"}, {"tiff", "image/tiff"},
+    // Fonts
+    {"woff", "font/woff"}, {"woff2", "font/woff2"}, {"ttf", "font/ttf"}, {"otf", "font/otf"},
+    {"eot", "application/vnd.ms-fontobject"},
+    // Audio and video
+    {"mp3", "audio/mpeg"}, {"m4a", "audio/mp4"}, {"aac", "audio/aac"}, {"ogg", "audio/ogg"},
+    {"oga", "audio/ogg"}, {"opus", "audio/ogg"}, {"flac", "audio/flac"}, {"wav", "audio/wav"},
+    {"weba", "audio/webm"}, {"mid", "audio/midi"}, {"midi", "audio/midi"},
+    {"mp4", "video/mp4"}, {"m4v", "video/mp4"}, {"webm", "video/webm"}, {"ogv", "video/ogg"},
+    {"mov", "video/quicktime"}, {"mkv", "video/x-matroska"}, {"avi", "video/x-msvideo"},
+    {"mpeg", "video/mpeg"}, {"mpg", "video/mpeg"}, {"ts", "video/mp2t"}, {"m3u8", "application/vnd.apple.mpegurl"},
+    {"mpd", "application/dash+xml"}, {"vtt", "text/vtt"}, {"srt", "application/x-subrip"},
+    // Archives and packages
+    {"zip", "application/zip"}, {"gz", "application/gzip"}, {"tgz", "application/gzip"},
+    {"bz2", "application/x-bzip2"}, {"xz", "application/x-xz"}, {"zst", "application/zstd"},
+    {"tar", "application/x-tar"}, {"7z", "application/x-7z-compressed"}, {"rar", "application/vnd.rar"},
+    {"jar", "application/java-archive"}, {"apk", "application/vnd.android.package-archive"},
+    {"deb", "application/vnd.debian.binary-package"}, {"rpm", "application/x-rpm"},
+    {"dmg", "application/x-apple-diskimage"}, {"iso", "application/x-iso9660-image"},
+    {"exe", "application/vnd.microsoft.portable-executable"}, {"msi", "application/x-msi"},
+    {"bin", "application/octet-stream"},
+};
+
+/*
+ * The table is a perfect hash built once by mime_types_init() (hash and displace): the extension's hash picks
+   a bucket, and the bucket's displacement moves all of its extensions to slots no other extension uses.
+ * Building it at startup rather than at compile time lets a mime.types file extend it.
+ */
+static struct mime_entry *slots;
+static uint16_t *displacements;
+static uint32_t slot_mask;
+static uint32_t bucket_mask;
+static uint64_t seed;
+static int entry_count;
+
+// Lowercases the extension into lowered while hashing it
+static uint64_t hash_extension(const char *extension, size_t length, char *lowered) {
+    uint64_t hash = 0xcbf29ce484222325ull ^ seed; // FNV-1a
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = extension[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        lowered[i] = c;
+        hash = (hash ^ c) * 0x100000001b3ull;
+    }
+    lowered[length] = '\0';
+    // FNV-1a leaves the low bits weak, so finish like MurmurHash3 before they pick the bucket
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// The bucket uses the low bits, the slot is the high half stepped by an odd stride, so every slot is reachable
+static uint32_t slot_of(uint64_t hash, uint32_t displacement) {
+    uint32_t first = hash >> 32;
+    uint32_t step = (uint32_t)(hash >> 16) | 1;
+    return (first + displacement * step) & slot_mask;
+}
+
+const char *mime_type_lookup(const char *path) {
+    const char *end = path + strlen(path);
+    const char *extension = end;
+    while (extension > path && extension[-1] != '.' && extension[-1] != '/') extension--;
+    if (extension == path || extension[-1] != '.') return MIME_DEFAULT_TYPE;
+
+    size_t length = end - extension;
+    if (length == 0 || length > MIME_EXTENSION_MAX || !slots) return MIME_DEFAULT_TYPE;
+    char lowered[MIME_EXTENSION_MAX + 1];
+    uint64_t hash = hash_extension(extension, length, lowered);
+    const struct mime_entry *entry = &slots[slot_of(hash, displacements[hash & bucket_mask])];
+    return memcmp(entry->extension, lowered, length + 1) == 0 ? entry->type : MIME_DEFAULT_TYPE;
+}
+
+int mime_types_count(void) {
+    return entry_count;
+}
+
+// An extension to put in the table, order decides which of several entries for one extension wins
+struct candidate {
+    struct mime_entry entry;
+    int order;
+};
+
+struct candidates {
+    struct candidate *items;
+    int count;
+    int capacity;
+};
+
+static int add_candidate(struct candidates *list, const char *extension, size_t length, const char *type) {
+    if (length == 0 || length > MIME_EXTENSION_MAX) return 0;
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        struct candidate *items = realloc(list->items, capacity * sizeof(*items));
+        if (!items) return -1;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    struct candidate *candidate = &list->items[list->count];
+    memset(candidate, 0, sizeof(*candidate));
+    for (size_t i = 0; i < length; i++) {
+        char c = extension[i];
+        candidate->entry.extension[i] = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+    candidate->entry.type = type;
+    candidate->order = list->count;
+    list->count++;
+    return 0;
+}
+
+// Reads a mime.types file. The type strings are kept for the life of the process, cache entries point to them.
+static int load_file(const char *path, struct candidates *list) {
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, file) >= 0) {
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char *position;
+        char *type = strtok_r(line, " \t\r\n", &position);
+        if (!type) continue;
+        const char *kept = NULL;
+        char *extension;
+        while ((extension = strtok_r(NULL, " \t\r\n", &position)) != NULL) {
+            if (!kept && !(kept = strdup(type))) break;
+            if (add_candidate(list, extension, strlen(extension), kept) < 0) break;
+        }
+    }
+    free(line);
+    fclose(file);
+    return 0;
+}
+
+static int compare_candidates(const void *a, const void *b) {
+    const struct candidate *first = a, *second = b;
+    int result = strcmp(first->entry.extension, second->entry.extension);
+    return result ? result : first->order - second->order;
+}
+
+// Bucket sizes are compared first, the most crowded buckets are placed while the table is still empty
+struct placement {
+    uint32_t bucket;
+    uint32_t size;
+};
+
+static int compare_placements(const void *a, const void *b) {
+    const struct placement *first = a, *second = b;
+    if (first->size != second->size) return first->size > second->size ? -1 : 1;
+    return (first->bucket > second->bucket) - (first->bucket < second->bucket);
+}
+
+/*
+ * Tries to place every entry with the current seed and table size.
+ * members holds the entry indexes grouped by bucket, in the order of placements.
+ */
+static int place_entries(const struct mime_entry *entries, const uint64_t *hashes, const struct placement *placements,
+                         uint32_t bucket_count, const int *members) {
+    uint32_t slot_list[64];
+    const int *member = members;
+    for (uint32_t i = 0; i < bucket_count && placements[i].size > 0; i++) {
+        uint32_t size = placements[i].size;
+        if (size > sizeof(slot_list) / sizeof(slot_list[0])) return -1;
+
+        uint32_t displacement;
+        for (displacement = 0; displacement <= MAX_DISPLACEMENT; displacement++) {
+            uint32_t placed;
+            for (placed = 0; placed < size; placed++) {
+                uint32_t slot = slot_of(hashes[member[placed]], displacement);
+                if (slots[slot].extension[0]) break;
+                uint32_t other;
+                for (other = 0; other < placed && slot_list[other] != slot; other++) {
+                }
+                if (other < placed) break;
+                slot_list[placed] = slot;
+            }
+            if (placed == size) break;
+        }
+        if (displacement > MAX_DISPLACEMENT) return -1;
+
+        displacements[placements[i].bucket] = displacement;
+        for (uint32_t j = 0; j < size; j++) {
+            slots[slot_list[j]] = entries[member[j]];
+        }
+        member += size;
+    }
+    return 0;
+}
+
+static int build_table(const struct mime_entry *entries, int count) {
+    uint32_t slot_count = 16;
+    while (slot_count < (uint32_t)count + (uint32_t)count / 4) slot_count *= 2;
+
+    uint64_t *hashes = malloc(count * sizeof(*hashes));
+    int *members = malloc(count * sizeof(*members));
+    for (; hashes && members && slot_count <= (1u << 24); slot_count *= 2) {
+        uint32_t bucket_count = slot_count / 2;
+        struct placement *placements = calloc(bucket_count, sizeof(*placements));
+        uint32_t *starts = malloc(bucket_count * sizeof(*starts));
+        free(slots);
+        free(displacements);
+        slots = calloc(slot_count, sizeof(*slots));
+        displacements = calloc(bucket_count, sizeof(*displacements));
+        if (!placements || !starts || !slots || !displacements) {
+            free(placements);
+            free(starts);
+            break;
+        }
+        slot_mask = slot_count - 1;
+        bucket_mask = bucket_count - 1;
+
+        for (int attempt = 0; attempt < SEED_ATTEMPTS; attempt++) {
+            seed = attempt * 0x9e3779b97f4a7c15ull;
+            char lowered[MIME_EXTENSION_MAX + 1];
+            for (uint32_t i = 0; i < bucket_count; i++) {
+                placements[i] = (struct placement){.bucket = i, .size = 0};
+            }
+            for (int i = 0; i < count; i++) {
+                hashes[i] = hash_extension(entries[i].extension, strlen(entries[i].extension), lowered);
+                placements[hashes[i] & bucket_mask].size++;
+            }
+            qsort(placements, bucket_count, sizeof(*placements), compare_placements);
+
+            // Group the entry indexes by bucket, in placement order
+            uint32_t start = 0;
+            for (uint32_t i = 0; i < bucket_count; i++) {
+                starts[placements[i].bucket] = start;
+                start += placements[i].size;
+            }
+            for (int i = 0; i < count; i++) {
+                members[starts[hashes[i] & bucket_mask]++] = i;
+            }
+
+            memset(slots, 0, slot_count * sizeof(*slots));
+            memset(displacements, 0, bucket_count * sizeof(*displacements));
+            if (place_entries(entries, hashes, placements, bucket_count, members) == 0) {
+                free(placements);
+                free(starts);
+                free(hashes);
+                free(members);
+                return 0;
+            }
+        }
+        free(placements);
+        free(starts);
+    }
+    free(hashes);
+    free(members);
+    free(slots);
+    free(displacements);
+    slots = NULL;
+    displacements = NULL;
+    return -1;
+}
+
+int mime_types_init(const char *path) {
+    struct candidates list = {0};
+    int status = 0;
+    // Entries from the file come first, so they win over the built-in ones for the same extension
+    if (path && load_file(path, &list) < 0) status = -1;
+    for (size_t i = 0; i < sizeof(builtin_types) / sizeof(builtin_types[0]); i++) {
+        const struct mime_entry *builtin = &builtin_types[i];
+        if (add_candidate(&list, builtin->extension, strlen(builtin->extension), builtin->type) < 0) break;
+    }
+
+    // Sorting puts each extension's entries together, the first of them is kept
+    qsort(list.items, list.count, sizeof(*list.items), compare_candidates);
+    struct mime_entry *entries = malloc((list.count ? list.count : 1) * sizeof(*entries));
+    int count = 0;
+    for (int i = 0; entries && i < list.count; i++) {
+        if (count > 0 && strcmp(entries[count - 1].extension, list.items[i].entry.extension) == 0) continue;
+        entries[count++] = list.items[i].entry;
+    }
+    free(list.items);
+
+    if (!entries || build_table(entries, count) < 0) {
+        fprintf(stderr, "Failed to build the MIME type table\n");
+        count = 0;
+        status = -1;
+    }
+    free(entries);
+    entry_count = count;
+    return status;
+}
@@ -0,0 +1,22 @@
+#ifndef MIME_TYPES_H
+#define MIME_TYPES_H
+
+#define MIME_DEFAULT_TYPE "application/octet-stream" // For files without a known extension
+#define MIME_EXTENSION_MAX 15                         // Longer extensions are never known
+
+/*
+ * Builds the extension table from the built-in types plus, unless path is NULL, a mime.types file
+   ("type ext ext ..." per line, '#' starts a comment) whose entries take precedence.
+ * The table is a perfect hash, so a lookup is one hash and one compare.
+ * Must be called before the workers start. Returns 0, or -1 if path cannot be read,
+   in which case the built-in types are used alone.
+ */
+int mime_types_init(const char *path);
+
+// Returns the MIME type for the extension of path, matched case-insensitively, or MIME_DEFAULT_TYPE.
+const char *mime_type_lookup(const char *path);
+
+// Returns the number of extensions in the table.
+int mime_types_count(void);
+
+#endif
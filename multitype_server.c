@@ -3,42 +3,94 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
-#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/stat.h>
 
+#include "event_loop.h"
+#include "file_cache.h"
+#include "file_validators.h"
+#include "file_watch.h"
+#include "http_header.h"
+#include "http_range.h"
+#include "metrics.h"
+#include "mime_types.h"
+#include "web_root.h"
+
 #define PORT 8080
 #define WEB_ROOT "./"  // Serve files from the current directory
+#define WEB_ROOT_PREFIX_LEN (sizeof(WEB_ROOT) - 2) // ".", a path below the root follows with its leading '/'
 #define DEFAULT_FILE "index.html"
 
-// Function to identify the MIME type
-const char *get_mime_type(const char *path) {
+/*
+ * send_cached_file() picks the response for a file we have in the cache.
+ * Usually that is the whole file ("200 OK"), but the request may ask for less:
+ * "304 Not Modified" when the browser's copy is still current (see serve_file() below).
+ * "206 Partial Content" when the Range header asks for parts of the file, for example a PDF viewer jumping to page 40
+   or a download that was interrupted and continues where it stopped.
+ * "416 Range Not Satisfiable" when none of the requested parts exist, e.g. they start after the end of the file.
+ */
+static void send_cached_file(struct connection *conn, const struct http_request *request, struct cache_entry *cached) {
+    /*
+     * Text files (HTML, CSS, JavaScript, JSON) shrink a lot when compressed, so they take less time to send.
+     * The cache keeps compressed versions next to the file: .br and .gz files made ahead of time
+       (e.g. "brotli style.css" creates style.css.br), or a gzip copy it compressed itself, once, when it loaded the file.
+     * The browser lists what it can decompress in its Accept-Encoding header, e.g. "gzip, deflate, br".
+     * file_cache_negotiate() picks the best version the browser understands and hands us that entry instead.
+       Its header carries "Content-Encoding: br" (or gzip), so the browser knows to decompress it.
+     */
+    cached = file_cache_negotiate(cached, request);
+
+    /*
+     * A browser that visited before keeps the files it downloaded, together with the ETag and Last-Modified headers we sent.
+     * When it asks again, it sends them back in If-None-Match and If-Modified-Since.
+     * If the file did not change since, we answer "304 Not Modified" without a body and the browser uses its own copy.
+     * The cache entry holds both the validators and the ready-made 304 header, so this check costs no more than a hit.
+     */
+    if (file_validators_not_modified(&cached->validators, request)) {
+        file_cache_send_not_modified(conn, cached, NULL);
+        return;
+    }
+
     /*
-     * strrchr() function is used to find the last occurance of a specific character and return a pointer to it.
-     * In this case we are getting the '.' (dot)'s location and return the pointer to it.
+     * http_range_parse() reads the Range header, e.g. "Range: bytes=0-1023" for the first kilobyte.
+     * It returns how many ranges were asked for, 0 if the whole file should be sent and -1 for a 416.
+     * Each range is sent straight from its offset in the file, nothing before it is read and thrown away.
      */
-    const char *dot = strrchr(path, '.');
-    if (!dot) return "application/octet-stream"; // Default for unknown files
-
-    if (strcmp(dot, ".html") == 0) return "text/html";
-    if (strcmp(dot, ".css") == 0) return "text/css";
-    if (strcmp(dot, ".js") == 0) return "application/javascript";
-    if (strcmp(dot, ".png") == 0) return "image/png";
-    if (strcmp(dot, ".jpg") == 0 || strcmp(dot, ".jpeg") == 0) return "image/jpeg";
-    if (strcmp(dot, ".gif") == 0) return "image/gif";
-    if (strcmp(dot, ".json") == 0) return "application/json";
-    if (strcmp(dot, ".txt") == 0) return "text/plain";
-    if (strcmp(dot, ".pdf") == 0) return "application/pdf";
-    
-    return "application/octet-stream"; // Default for unknown files
+    struct byte_range ranges[RANGE_MAX];
+    int range_count = http_range_parse(request, cached->body_len, &cached->validators, ranges);
+    if (range_count < 0) {
+        http_range_send_unsatisfiable(conn, cached->body_len);
+        file_cache_release(cached); // This response does not use the entry
+    } else if (range_count > 0) {
+        file_cache_send_ranges(conn, cached, ranges, range_count, NULL);
+    } else {
+        file_cache_send(conn, cached, NULL);
+    }
 }
 
 /*
- * serve_file() function is used to send a file to a client over a socket.
- * It takes 2 arguments.
- * First argument is the file descriptor of the client socket.
- * Second argument is the file to serve and the file path will not be changed inside the function.
+ * serve_file() function is used to queue a file as the response to a client connection.
+ * It takes 3 arguments.
+ * First argument is the connection the response belongs to. The event loop sends the response later, whenever the socket is ready.
+ * Second argument is the parsed request. Its headers tell us whether the browser already has a copy of the file.
+ * Third argument is the file to serve and the file path will not be changed inside the function.
  */
-void serve_file(int client_socket, const char *file_path) {
+void serve_file(struct connection *conn, const struct http_request *request, const char *file_path) {
+    /*
+     * Popular files (like index.html) are requested over and over again, so they are kept in memory.
+     * file_cache_get() looks the path up in the cache. On a hit we already have the file content and a ready-made header,
+       so we can answer without touching the disk at all, the whole response goes out in a single write.
+     * Large files are not kept in memory, but the cache still holds them open so a hit skips stat() and open().
+     * On a miss, generation remembers the state of the cache so file_cache_put() can tell if the file changed in the meantime.
+     */
+    unsigned long generation;
+    struct cache_entry *cached = file_cache_get(file_path, &generation);
+    if (cached) {
+        send_cached_file(conn, request, cached);
+        return;
+    }
+
     /*
      * The stat struct comes from sys/stat.h header file.
      * That structure holds information about a file such as file size, permissions. type of file and etc.
@@ -46,196 +98,186 @@ void serve_file(int client_socket, const char *file_path) {
     struct stat file_stat;
 
     /*
-     * stat() function can be used to get file information by passing 2 arguments.
-     * First argument specifies the file path.
-     * Second argument is the location where you want to save the information about the file.
-       It should be a pointer in the type of stat struct.
-     * If stat() function failed to find the file in the specified path, it will return -1.
-     * Even though stat() function was able to access the specified file path, it could be a directory. In that case, it should not be served.
-     * So, S_ISDIR() function will be used to check whether the accessed file is a directory or not.
-     * If conditions are not met, a 404 page will be showed.
+     * web_root_open_file() opens the file for reading relative to the web root, which main() opened once (see web_root.c).
+     * It uses openat2() with RESOLVE_BENEATH, so the kernel refuses any path that would end up outside the web root,
+       even through a symbolic link inside it.
+     * It also opens with O_NONBLOCK. A FIFO (named pipe) in the web root would otherwise make open() wait for a writer,
+       and with it the whole event loop and every other client.
+     * fstat() then fills file_stat for the file that was actually opened, so nothing can swap the file in between.
+     * Only regular files are served: not directories, FIFOs or devices. Anything else gets the 404 page.
      */
-    if (stat(file_path, &file_stat) < 0 || S_ISDIR(file_stat.st_mode)) {
-        const char *error_msg = 
-            "HTTP/1.1 404 Not Found\r\nContent-Type: text/html\r\n\r\n"
+    int file_fd = web_root_open_file(file_path + WEB_ROOT_PREFIX_LEN);
+    if (file_fd < 0 || fstat(file_fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+        if (file_fd >= 0) close(file_fd);
+        static const char error_msg[] =
+            "HTTP/1.1 404 Not Found\r\nContent-Type: text/html\r\nContent-Length: 48\r\n\r\n"
             "<html><body><h1>404 Not Found</h1></body></html>";
         /*
-         * send() function is used to send data through a socket.
-         * First argument specifies the socket descriptor representing the connection with the client.
-         * Second argument is the message that will be sent (a string).
-         * Third argument specifies the length of the message or how many bytes to send.
-         * Forth argument is 0 as we do not need special options.
-         */
-        send(client_socket, error_msg, strlen(error_msg), 0);
-        /*
-         * After sending the 404 response, the server stops writing but ensures the client has time to process the response before closing the connection.
+         * connection_send_response() queues a response that is already complete in memory.
+         * The event loop writes it to the socket, then either waits for the next request on the same connection or closes it.
+         * Content-Length tells the browser where this response ends, so it can reuse the connection for its next request.
+         * The message is static, so it stays valid until the event loop has sent all of it.
          */
-        shutdown(client_socket, SHUT_WR); // Stop sending but still allow reading
-        close(client_socket); // Fully close the connection.
+        connection_send_response(conn, error_msg, sizeof(error_msg) - 1);
         return;
     }
 
     /*
-     * Open the file at file_path for reading (r) in binary mode (b).
-     * Binary mode is for serving both text and binary files.
+     * The validators of a file are made from the stat() information we already have.
+     * ETag combines the inode number, size and modification time, so it changes whenever the file does.
+     * Last-Modified is the modification time as a date, for clients that only understand dates.
+     * If the browser's copy is still current, there is no need to read the file.
      */
-    FILE *file = fopen(file_path, "rb"); // 'rb' is for opening the file for reading in binary mode.
-
-    const char *mime_type = get_mime_type(file_path); // Get MIME type of the file
-
-    if (!file) {    
-        if (strcmp(mime_type, "text/html") == 0) {
-            // If it's an HTML page, show a 404 error page
-            const char *error_msg =
-                "HTTP/1.1 404 Not Found\r\nContent-Type: text/html\r\n\r\n"
-                "<html><body><h1>404 Not Found</h1></body></html>";
-            send(client_socket, error_msg, strlen(error_msg), 0);
-            shutdown(client_socket, SHUT_WR);
-            usleep(1000);
-            close(client_socket);
-        } 
-        else {
-            // For other files (images, CSS, JS, etc.), just send a 404 response
-            const char *error_msg =
-                "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-            send(client_socket, error_msg, strlen(error_msg), 0);
-        }
+    struct file_validators validators;
+    file_validators_init(&validators, &file_stat);
+    struct header_builder header;
+    if (file_validators_not_modified(&validators, request)) {
+        close(file_fd);
+        /*
+         * Headers are put together with the header builder (see http_header.c) right in the connection's header buffer,
+           which stays valid until the response is sent.
+         * http_header_start() writes the status line and the Server line, http_header_finish() the Date line,
+           the Connection line and the blank line that ends the header. header.data and header.len are what to send.
+         * A header that would not fit into the buffer is never cut short: it becomes a "500 Internal Server Error" instead,
+           and http_header_finish() returns -1 so we know not to send a body after it.
+         */
+        http_header_start(&header, conn->io->header, sizeof(conn->io->header), 304);
+        http_header_add_validators(&header, &validators);
+        http_header_finish(&header, conn);
+        connection_send_response(conn, header.data, header.len);
+        return;
     }
 
-    /*
-     * Send HTTP Header, so the browser know how to handle the file properly.
-     */
-    char header[256];
-    
-    /*
-     * snprintf() function formats a string safely into header, ensuring it does not exceed 256 bytes.
-     * First argument specifies where to write the formatted string.
-     * Second argument specifies the maximum size of the string, more than that will not formatted.
-     * Third argument is the string to be formatted.
-     * Other arguments are values for formatting the string.
-     */
-    snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n\r\n", mime_type);
-    send(client_socket, header, strlen(header), 0);
-
-    char buffer[4096]; // To temporarily hold data before sending to the client.
-    size_t bytes_read; // To track how much data is read from the file.
+    const char *mime_type = mime_type_lookup(file_path); // Get MIME type of the file, see mime_types.c
 
     /*
-     * After completing the confirmations about the file, we can send the file to the client using send().
-     * If the file we are sending is large, it is not an efficient way to send the whole file at once. So, we send the file chunk by chunk.
-     * fread() reads up to sizeof(buffer) from file into buffer.
-     * bytes_read holds the actual number of bytes read. In the last chunk, it will be lesser than the buffer size.
-     * First argument is the buffer which is where we store data temporarily for sending.
-     * Second argument tells fread() that read the file byte by byte.
-     * Third argument specify how many bytes to store (size of the buffer)
-     * Final argument is the pointer to the file we need to read.
+     * file_cache_put() reads the whole file into memory, so the next request for it becomes a cache hit.
+     * Files larger than the cache's object limit are kept open instead and streamed with sendfile() on every hit.
+     * From here on the cache owns file_fd. Only when the cache is turned off do we stream the file ourselves below.
      */
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        send(client_socket, buffer, bytes_read, 0);
+    cached = file_cache_put(file_path, generation, file_fd, &file_stat, mime_type);
+    if (cached) {
+        send_cached_file(conn, request, cached);
+        return;
     }
 
-    fclose(file); // Closes the file that was opened by fopen() and resources are freed.
-    
     /*
-     * Tell the client that the server will not send any more data.
-     * But the client might still send data back.
-     * This helps ensuring the client processes the full response.
+     * Without the cache, ranges are sent from file_fd at their offsets.
+     * range_source describes where the bytes come from. With owns_fd set, the connection closes file_fd when it is done.
      */
-    shutdown(client_socket, SHUT_WR);
+    struct byte_range ranges[RANGE_MAX];
+    int range_count = http_range_parse(request, file_stat.st_size, &validators, ranges);
+    if (range_count < 0) {
+        close(file_fd);
+        http_range_send_unsatisfiable(conn, file_stat.st_size);
+        return;
+    }
+    if (range_count > 0) {
+        struct range_source source = {.mime_type = mime_type, .validators = &validators, .size = file_stat.st_size,
+                                      .fd = file_fd, .owns_fd = 1};
+        http_range_send(conn, ranges, range_count, &source);
+        return;
+    }
 
     /*
-     * Before we close the socket, client needs a moment to fully receive the shutdown signal before closing the socket.
-     * So, we can pause the execution for 1 millisecond (1000 microseconds).
-     * Without this some clients might not receive the data properly.
+     * Send HTTP Header, so the browser know how to handle the file properly.
+     * Content-Length comes from the fstat() call above. With it the browser knows when the file is complete,
+       so it does not need us to close the connection and can send its next request (CSS, JS, images) on the same one.
+     * Accept-Ranges tells the browser it may ask for parts of this file with a Range header.
+     * http_header_add_validators() adds the ETag and Last-Modified headers, so the browser can ask for this file conditionally next time.
+     * http_header_finish() adds the Connection header, which tells the browser whether we keep the connection open after this response.
+       The event loop decides that from the request (HTTP version, the client's Connection header and how many requests this connection has made).
      */
-    usleep(1000);
+    http_header_start(&header, conn->io->header, sizeof(conn->io->header), 200);
+    http_header_add_literal(&header, "Content-Type: ");
+    http_header_add(&header, mime_type, strlen(mime_type));
+    http_header_add_literal(&header, "\r\nContent-Length: ");
+    http_header_add_number(&header, file_stat.st_size);
+    http_header_add_literal(&header, "\r\nAccept-Ranges: bytes\r\n");
+    http_header_add_validators(&header, &validators);
 
     /*
-     * Closes the socket and free up system resources.
-     * After this, no further communication can happen on this socket.
-     * But, server still runs until you close.
-    */
-    close(client_socket);
+     * connection_send_response() queues the header, connection_add_file_body() the file content after it.
+     * The file is sent with sendfile(), so the kernel copies it straight from the page cache to the socket.
+       It never passes through a buffer in our program, which saves a copy and many read()/send() calls per file.
+     * The header is sent with MSG_MORE, so it goes out in the same TCP segment as the first bytes of the file.
+     * It only sends while the socket can take more data, so a slow client never makes the whole server wait.
+     * The connection now owns file_fd and closes it once the file has been sent.
+     * If the header became a 500, the file must not follow it: the browser would take it for the next response.
+     */
+    if (http_header_finish(&header, conn) < 0) {
+        close(file_fd);
+        connection_send_response(conn, header.data, header.len);
+        return;
+    }
+    connection_send_response(conn, header.data, header.len);
+    connection_add_file_body(conn, file_fd, 0, file_stat.st_size, 1);
+    conn->mime_type = mime_type; // Counted in the metrics once the response is sent
 }
 
 /*
- * We created a thread for each client and inside the thread we are running handle_client() function to perform necessary tasks on client request.
- * handle_client() function returns NULL after the execution, thus we used return type as void pointer.
- * pthread_create() function passes a void pointer (4th arg in that function) as the parameter of the function which is performing inside the thread.
-   you can see that as 'void *arg' here.
+ * handle_client() function is called by the event loop once a full request has arrived from a client.
+ * The event loop already parsed the request. Its request line has 3 parts:
+ * Method refers to the HTTP method of the request.
+ * URI specifies the requested URL (e.g., /index.html).
+ * Version specifies the HTTP protocol version (e.g., HTTP/1.1).
+ * The headers that follow (Host, Connection, ...) are in request->headers.
+ * None of these are copied, they are slices (a pointer and a length) into the bytes we received.
+   So they are not NUL-terminated strings, we compare them with http_slice_equals() instead of strcmp().
+ * handle_client() must not block, it only decides which response to queue on the connection.
  */
-void *handle_client(void *arg) {
-    int client_socket = *(int *)arg; // Gets the client socket's file descriptor which we need when we work with OS.
-    free(arg); // While we got the file descriptor of client socket, we are freeing that memory allocated for arg (client_socket in main function), so we will not have memory leaks later on.
-
-    char buffer[2048]; // To temporarily store incoming requests from the client.
-
-    /*
-     * recv() function is used to read data from the client_socket and store in buffer.
-     * Third argument specifies the size of buffer size with a 1 space left which will be used to store a null terminator (\0).
-     * Forth argument is used to specify extra options. But, we have used default which is 0.
-     */
-    recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-
-    /*
-     * Client's HTTP request is consist of 3 parts, Method, URL and Protocol.
-     * We will need to extract those 3 parts seperately to handle the user request efficiently.
-     * Method refers to the HTTP method of the request.
-     * URL specifies the requested URL (e.g., /index.html).
-     * Protocol specifies the HTTP protocol version (e.g., HTTP/1.1).
-
-     * After defining the strings (array of characters) for those 3 parts, use sscanf function will be used to capture different parts in the HTTP request.
-     * As the first argument in the sscanf() function, add the source.
-     * As the second argument, specify the format how you want to seperate the source. If you are extracting a string, amke sure you keep 1 space for null terminator.
-     * Other arguments are the pointers to the locations where the separated parts are stored. 
-     * While array variables are already a pointer, do not use & (e.g., &method).
-     */
-    char method[16], url[256], protocol[32];
-    sscanf(buffer, "%15s %255s %31s", method, url, protocol);
-
+void handle_client(struct connection *conn, const struct http_request *request) {
     /*
      * The server is lightweight and it will only handle GET request.
      * That means server will serve static files.
      * So, if a user make a request other than a GET, server will stop serving to that user.
+     * Returning without queuing a response tells the event loop to close the connection.
      */
-    if (strcmp(method, "GET") != 0) {
-        close(client_socket);
-        return NULL;
+    if (!http_slice_equals(request->method, "GET")) {
+        return;
     }
 
-    /* 
-     * Not mandatory, but if somebody tries to access files in other directories than where you serve
-       This code snippet will stop it. 
-     * '..' means "go up one directory". If this was found in the user will be directed to the DEFAULT_FILE which is homepage.
-     * To serve any file, we will use serve_file().
+    /*
+     * The URL is turned into the path of a file below the web root by web_path_normalize() (see web_root.c):
+     * %XX escapes are decoded ("a%20b.html" is "a b.html") and the query string ("?v=2") is dropped.
+     * "." and ".." segments are resolved, so "/css/../index.html" is "/index.html". A ".." that would climb
+       above the web root gets "403 Forbidden", a URL that cannot be decoded "400 Bad Request".
+     * A URL ending in '/' gets DEFAULT_FILE appended, so "/" is "/index.html".
+     * The path goes right behind "." (WEB_ROOT without its slash), so file_path is "./index.html",
+       the form the cache and the MIME lookup use.
      */
-    if (strstr(url, "..")) {
-        serve_file(client_socket, DEFAULT_FILE);
-        return NULL;
+    char file_path[WEB_ROOT_PREFIX_LEN + WEB_PATH_MAX];
+    memcpy(file_path, WEB_ROOT, WEB_ROOT_PREFIX_LEN);
+    char *path = file_path + WEB_ROOT_PREFIX_LEN;
+    int path_len = web_path_normalize(request->uri, DEFAULT_FILE, path, WEB_PATH_MAX);
+    if (path_len == WEB_PATH_FORBIDDEN) {
+        static const char forbidden[] = "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n\r\n";
+        connection_send_response(conn, forbidden, sizeof(forbidden) - 1);
+        return;
+    }
+    if (path_len < 0) {
+        static const char bad_request[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+        connection_send_response(conn, bad_request, sizeof(bad_request) - 1);
+        return;
     }
 
-    char file_path[512]; // This is used to store the correct file path to serve the client.
-    if (strcmp(url, "/") == 0) {
-        /*
-         * snprintf() function can be used to make a formatted string and store it inside a variable.
-         * First argument specifies the variable, where the formatted string is saved.
-         * Second argument specifies the size of that variable or maximum number of characters that can be stored.
-         * Third argument specifies the format of the string.
-         * Other arguments will be necessary values for the specified format.
-         */
-        snprintf(file_path, sizeof(file_path), "%s%s", WEB_ROOT, DEFAULT_FILE); // If requested file is '/', send the DEFAULT_FILE.
-    } else {
-        snprintf(file_path, sizeof(file_path), "%s%s", WEB_ROOT, url + 1); // Remove leading "/"
+    /*
+     * /metrics is not a file: it answers with what the server has counted so far (requests by status code,
+       bytes sent, open connections, cache hits, how long requests take, ...).
+     * The format is the plain text one Prometheus reads, so a monitoring system can collect it every few seconds.
+     */
+    if (strcmp(path, METRICS_PATH) == 0) {
+        metrics_send(conn);
+        return;
     }
 
-    // Finally, serve the file using serve_file() function by passing the client_socket and file_path.
-    serve_file(client_socket, file_path);
-    return NULL;
+    // Finally, serve the file using serve_file() function by passing the connection and file_path.
+    serve_file(conn, request, file_path);
 }
 
 int main() {
     int server_socket; //For the file descriptor, the file descriptor will be used to handle the socket by OS.
-    struct sockaddr_in server_address, client_address; //To store IPV4 address information
+    struct sockaddr_in server_address; //To store IPV4 address information
     /*
     Structure of sockaddr_in
     struct sockaddr_in{
@@ -245,7 +287,6 @@ int main() {
         char sin_zero[8]; // Padding to make the sockaddr_in structure the same size as sockaddr structure which is used for other address families.
     }
     */
-    socklen_t address_len = sizeof(client_address); // Getting the size of client_address, it will be used when accepting a connection to store the size of client's address.
 
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
     /*
@@ -291,47 +332,54 @@ int main() {
         exit(1);
     }
 
-    printf("Server is running on http://localhost:%d\n", PORT);
+    /*
+    * Build the table that maps file extensions to MIME types (".html" to "text/html", ".woff2" to "font/woff2", ...).
+    * It is built once here, so looking up a type later costs one hash and one string compare per request.
+    * Passing a path like "/etc/mime.types" instead of NULL would add every type listed in that file.
+    */
+    mime_types_init(NULL);
 
-    // Run an infinity loop that will accept new clients continuously.
-    while (1) {
-        int *client_socket = malloc(sizeof(int)); //Dinamically allocate memmory for an int to store the client's socket descriptor.
-        if (!client_socket) {
-            perror("Memory allocation failed");
-            continue; //If memory allocation fails, loop will continue running.
-        }
+    /*
+    * Set up the in-memory file cache with its default size limits.
+    * The cache holds at most CACHE_DEFAULT_BUDGET bytes; when it is full, the least recently used files are dropped first.
+    */
+    file_cache_init(CACHE_DEFAULT_BUDGET, CACHE_DEFAULT_MAX_OBJECT);
 
-        /*
-        * When a new client tries to connect, a new socket descriptor is assigned to *client_socket.
-        * If accept() fails, it will print an error message and free the client_socket and continue the loop again.
-        */
-        *client_socket = accept(server_socket, (struct sockaddr *)&client_address, &address_len);
-        if (*client_socket < 0) {
-            perror("Accepting failed");
-            free(client_socket);
-            continue;
-        }
+    /*
+    * The web root is opened once. serve_file() and the cache open every file (and its .gz and .br versions)
+      relative to it (see web_root.c), so a symbolic link in the web root cannot make it serve a file from elsewhere.
+    */
+    if (web_root_open(WEB_ROOT) < 0) {
+        exit(1);
+    }
+    file_cache_set_root(WEB_ROOT);
 
-        /*
-        * If the program waits until completing the tasks for a single client, then requests from other clients will be rejected.
-        * So, we can use threads which is a lightweight mini-process that runs inside a program. It allows a program to do multiple things at the same time.
-        * In this program, each client gets its own thread. So, multiple clients can be handled simultaneosly.
-        */
-        pthread_t thread_id; // Declares a thread identifier (a unique ID for the thread)
+    /*
+    * A background thread uses inotify to get told by the OS whenever a file under WEB_ROOT changes.
+    * It drops changed files from the cache right away, so new versions are served within milliseconds
+      and cached files never need to be checked with stat() again.
+    * If inotify is not available, the cache checks files with stat() about once per second instead.
+    */
+    file_watch_start(WEB_ROOT);
 
-        /*
-        * pthread_create() function will create a new thread and run the necessary process inside it.
-        * In the first argument, you pass the identifier of the thread.
-        * Second argument is to specify attributes of the thread. In this program, it is NULL as we want it as a default.
-        * Third argument specify the process to run inside the thread, which is a function that returns a void pointer and takes a single argument that is a void pointer.
-        * Forth argument is a void pointer which is the argument that we should pass to run the function we defined in third argument.
-        */
-        if (pthread_create(&thread_id, NULL, handle_client, client_socket) != 0) {
-            perror("Thread creation failed");
-            free(client_socket);
-        }
-
-        pthread_detach(thread_id); // You tells the system that you don't need this thread anymore and clean its resources when it finishes.
+    /*
+    * Writing to a connection the client already closed raises SIGPIPE, which ends the program by default.
+    * send() is told not to with MSG_NOSIGNAL, but sendfile() has no such flag, so the signal is ignored for the whole process.
+      The write then just fails with EPIPE and the event loop closes that one connection.
+    */
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Server is running on http://localhost:%d\n", PORT);
+
+    /*
+    * Instead of creating a thread for every client, a single thread runs an event loop.
+    * The event loop uses epoll, which lets the OS tell us which of many sockets are ready to read or write.
+    * Every socket is non-blocking and remembers how far its request and response got (a small state machine).
+    * So, one thread can serve tens of thousands of clients at the same time without a thread stack per client.
+    * The loop runs until the process is stopped.
+    */
+    if (event_loop_run(server_socket, handle_client) < 0) {
+        exit(1);
     }
 
     close(server_socket); //Shutting down the Server and free up the resources used by the socket.
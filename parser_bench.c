@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "http_parser.h"
+
+#define ITERATIONS 2000000
+
+// A request head as a browser sends it for a script
+static const char browser_head[] =
+    "GET /assets/app.3f9a2c1d.js HTTP/1.1\r\nHost: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: */*\r\nAccept-Language: en-US,en;q=0.5\r\nAccept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Referer: http://localhost:8080/index.html\r\nConnection: keep-alive\r\n"
+    "Cookie: session=6f1d2c9a8b7e4f3a2d1c0b9a8f7e6d5c; theme=dark; consent=analytics%2Cads; _ga=GA1.1.1234567890.1700000000\r\n"
+    "Sec-Fetch-Dest: script\r\nSec-Fetch-Mode: no-cors\r\nSec-Fetch-Site: same-origin\r\n"
+    "If-None-Match: \"5f2b-18c4a7e9f3d\"\r\nIf-Modified-Since: Tue, 14 Nov 2023 22:13:20 GMT\r\n\r\n";
+
+// What bench sends
+static const char small_head[] = "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+static const char *level_names[] = {"scalar", "SSE", "AVX2"};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parses the head as it arrives in reads of chunk bytes, the whole head at once if chunk is 0
+static long parse(const char *head, size_t length, size_t chunk) {
+    struct http_request request;
+    http_request_init(&request);
+    if (chunk == 0) return http_parse_request(&request, head, length);
+    long status = HTTP_PARSE_INCOMPLETE;
+    for (size_t received = chunk; status == HTTP_PARSE_INCOMPLETE; received += chunk) {
+        status = http_parse_request(&request, head, received < length ? received : length);
+    }
+    return status;
+}
+
+static void run(const char *name, const char *head, size_t length, size_t chunk) {
+    unsigned long checksum = 0;
+    double start = now();
+    for (long i = 0; i < ITERATIONS; i++) checksum += parse(head, length, chunk);
+    double elapsed = now() - start;
+    printf("  %-18s %7.1f ns/request %6.2f GB/s (checksum %lu)\n", name, elapsed * 1e9 / ITERATIONS,
+           length * (double)ITERATIONS / elapsed / 1e9, checksum);
+}
+
+int main(void) {
+    int best = http_parser_set_simd(HTTP_SIMD_AVX2);
+    printf("%zu and %zu byte heads, %d requests each\n", sizeof(browser_head) - 1, sizeof(small_head) - 1, ITERATIONS);
+
+    for (int level = HTTP_SIMD_NONE; level <= best; level++) {
+        http_parser_set_simd(level);
+        printf("\n%s\n", level_names[level]);
+        run("browser", browser_head, sizeof(browser_head) - 1, 0);
+        run("browser, 64B reads", browser_head, sizeof(browser_head) - 1, 64);
+        run("small", small_head, sizeof(small_head) - 1, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http_parser.h"
+
+/*
+ * Checks http_parse_request() for every instruction set the CPU has against the plain loops (HTTP_SIMD_NONE):
+ * Each head is parsed whole, then fed one byte at a time and split in two at every point, as it would arrive
+   in several reads. Every way has to give the same result as the scalar parser given the whole head.
+ * Lines are padded to every length around the 16 and 32 byte blocks, so matches in a block and in the
+   tail after the last block are both covered.
+ * Heads are copied into buffers of their exact size, so a scanner reading past the end shows up under
+   valgrind or -fsanitize=address.
+ */
+
+#define SPLIT_ALL_MAX 2048 // Longer heads are only split byte by byte
+#define RANDOM_HEADS 3000
+
+// What a parse produced, with slices as offsets so results from different buffers compare
+struct outcome {
+    long status;
+    size_t method[2], uri[2], version[2];
+    int minor_version;
+    int header_count;
+    size_t headers[HTTP_MAX_HEADERS][4];
+};
+
+static int checks;
+static int failures;
+
+static void slice_offsets(size_t out[2], struct http_slice slice, const char *buffer) {
+    out[0] = slice.data - buffer;
+    out[1] = slice.len;
+}
+
+static void record(struct outcome *outcome, long status, const struct http_request *request, const char *buffer) {
+    memset(outcome, 0, sizeof(*outcome));
+    outcome->status = status;
+    if (status <= 0) return; // The fields of a head that did not parse are not defined
+    slice_offsets(outcome->method, request->method, buffer);
+    slice_offsets(outcome->uri, request->uri, buffer);
+    slice_offsets(outcome->version, request->version, buffer);
+    outcome->minor_version = request->minor_version;
+    outcome->header_count = request->header_count;
+    for (int i = 0; i < request->header_count; i++) {
+        slice_offsets(outcome->headers[i], request->headers[i].name, buffer);
+        slice_offsets(outcome->headers[i] + 2, request->headers[i].value, buffer);
+    }
+}
+
+/*
+ * Parses head[0..length) as it would arrive in reads ending at the offsets in cuts, followed by one with the rest.
+ * Every read but the last has to leave the head incomplete, unless the parser already found it malformed.
+ */
+static void parse(struct outcome *outcome, const char *head, size_t length, const size_t *cuts, int cut_count) {
+    char *buffer = malloc(length ? length : 1);
+    memcpy(buffer, head, length);
+    struct http_request request;
+    http_request_init(&request);
+    long status = HTTP_PARSE_INCOMPLETE;
+    for (int i = 0; i <= cut_count; i++) {
+        size_t received = i < cut_count ? cuts[i] : length;
+        status = http_parse_request(&request, buffer, received);
+        if (status != HTTP_PARSE_INCOMPLETE) break;
+    }
+    record(outcome, status, &request, buffer);
+    free(buffer);
+}
+
+static void check(const char *name, const char *how, const struct outcome *expected, const struct outcome *got) {
+    checks++;
+    if (memcmp(expected, got, sizeof(*got)) == 0) return;
+    if (++failures <= 20) {
+        printf("FAIL %s, %s: status %ld, expected %ld", name, how, got->status, expected->status);
+        if (got->status == expected->status) printf(" (fields differ)");
+        printf("\n");
+    }
+}
+
+static const char *level_names[] = {"scalar", "SSE", "AVX2"};
+
+// Parses a head every way at every level and compares with the scalar parser; returns the scalar status.
+static long check_head(const char *name, const char *head, size_t length) {
+    struct outcome expected, got;
+    http_parser_set_simd(HTTP_SIMD_NONE);
+    parse(&expected, head, length, NULL, 0);
+
+    for (int level = HTTP_SIMD_NONE; level <= HTTP_SIMD_AVX2; level++) {
+        if (http_parser_set_simd(level) != level) continue;
+        char how[64];
+        parse(&got, head, length, NULL, 0);
+        snprintf(how, sizeof(how), "%s, whole", level_names[level]);
+        check(name, how, &expected, &got);
+
+        size_t *cuts = malloc((length ? length : 1) * sizeof(*cuts));
+        for (size_t i = 0; i < length; i++) cuts[i] = i;
+        parse(&got, head, length, cuts, (int)length);
+        snprintf(how, sizeof(how), "%s, byte by byte", level_names[level]);
+        check(name, how, &expected, &got);
+        free(cuts);
+
+        if (length > SPLIT_ALL_MAX) continue;
+        for (size_t cut = 1; cut < length; cut++) {
+            parse(&got, head, length, &cut, 1);
+            snprintf(how, sizeof(how), "%s, split at %zu", level_names[level], cut);
+            check(name, how, &expected, &got);
+        }
+    }
+    return expected.status;
+}
+
+static void expect(const char *name, const char *head, long status) {
+    long got = check_head(name, head, strlen(head));
+    checks++;
+    if ((status > 0 && got <= 0) || (status <= 0 && got != status)) {
+        if (++failures <= 20) printf("FAIL %s: status %ld, expected %ld\n", name, got, status);
+    }
+}
+
+// Requests that parse, and the fields of one of them
+static void test_valid(void) {
+    expect("simple", "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n", 1);
+    expect("no headers", "GET /index.html HTTP/1.0\r\n\r\n", 1);
+    expect("bare LF", "GET / HTTP/1.1\nHost: a\nAccept: */*\n\n", 1);
+    expect("empty lines first", "\r\n\r\nGET / HTTP/1.1\r\nHost: a\r\n\r\n", 1);
+    expect("one Content-Length", "POST / HTTP/1.1\r\nContent-Length: 0\r\n\r\n", 1);
+    expect("Transfer-Encoding lines",
+           "POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n\r\n", 1);
+    expect("whitespace around values", "GET / HTTP/1.1\r\nHost:a\r\nX-A: \t spaced \t \r\nX-B:\r\n\r\n", 1);
+    expect("browser",
+           "GET /assets/app.3f9a2c1d.js?v=2 HTTP/1.1\r\nHost: localhost:8080\r\n"
+           "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+           "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+           "Accept-Language: en-US,en;q=0.5\r\nAccept-Encoding: gzip, deflate, br, zstd\r\n"
+           "Connection: keep-alive\r\nIf-None-Match: \"5f2b-18c4a7e9f3d\"\r\nSec-Fetch-Dest: script\r\n\r\n",
+           1);
+
+    const char head[] = "POST /form HTTP/1.0\r\nHost: a\r\nContent-Length:  12 \r\n\r\nbody follows";
+    struct http_request request;
+    http_parser_set_simd(HTTP_SIMD_AVX2);
+    http_request_init(&request);
+    long length = http_parse_request(&request, head, sizeof(head) - 1);
+    const struct http_slice *content_length = http_request_header(&request, "content-length");
+    checks++;
+    if (length != (long)(sizeof(head) - 1 - 12) || !http_slice_equals(request.method, "POST") ||
+        !http_slice_equals(request.uri, "/form") || request.minor_version != 0 || request.header_count != 2 ||
+        !content_length || !http_slice_equals(*content_length, "12")) {
+        failures++;
+        printf("FAIL fields of a POST head\n");
+    }
+}
+
+// Elements of list headers, across lines and whitespace
+static void test_tokens(void) {
+    static const struct {
+        const char *head;
+        const char *token;
+        int found;
+    } cases[] = {
+        {"GET / HTTP/1.1\r\nConnection: close\r\n\r\n", "close", 1},
+        {"GET / HTTP/1.1\r\nConnection: close, TE\r\n\r\n", "close", 1},
+        {"GET / HTTP/1.1\r\nConnection: TE,\tCLOSE \r\n\r\n", "close", 1},
+        {"GET / HTTP/1.1\r\nConnection: TE\r\nconnection: close\r\n\r\n", "close", 1},
+        {"GET / HTTP/1.0\r\nConnection: keep-alive, Upgrade\r\n\r\n", "keep-alive", 1},
+        {"GET / HTTP/1.1\r\nConnection: closed, TE\r\n\r\n", "close", 0},
+        {"GET / HTTP/1.1\r\nConnection: ,, \r\n\r\n", "close", 0},
+        {"GET / HTTP/1.1\r\nX-Connection: close\r\n\r\n", "close", 0},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+        struct http_request request;
+        http_request_init(&request);
+        long length = http_parse_request(&request, cases[i].head, strlen(cases[i].head));
+        checks++;
+        if (length <= 0 || http_request_has_token(&request, "Connection", cases[i].token) != cases[i].found) {
+            failures++;
+            printf("FAIL token %s in case %zu\n", cases[i].token, i);
+        }
+    }
+}
+
+// Several requests in one read: each parse starts where the previous head ended
+static void test_pipelined(void) {
+    static const char *requests[] = {"GET /a HTTP/1.1\r\nHost: a\r\n\r\n", "GET /bb HTTP/1.1\r\n\r\n",
+                                     "\r\nHEAD /ccc HTTP/1.0\nX: y\n\n"};
+    char buffer[256];
+    size_t length = 0;
+    for (int i = 0; i < 3; i++) length += snprintf(buffer + length, sizeof(buffer) - length, "%s", requests[i]);
+    memcpy(buffer + length, "GET /partial HTTP/1.1\r\nHo", 25); // The start of a fourth
+    length += 25;
+
+    for (int level = HTTP_SIMD_NONE; level <= HTTP_SIMD_AVX2; level++) {
+        if (http_parser_set_simd(level) != level) continue;
+        size_t offset = 0;
+        for (int i = 0; i < 4; i++) {
+            struct http_request request;
+            http_request_init(&request);
+            long status = http_parse_request(&request, buffer + offset, length - offset);
+            long expected = i < 3 ? (long)strlen(requests[i]) : HTTP_PARSE_INCOMPLETE;
+            checks++;
+            if (status != expected) {
+                failures++;
+                printf("FAIL pipelined request %d, %s: status %ld, expected %ld\n", i, level_names[level], status, expected);
+                break;
+            }
+            if (status > 0) offset += status;
+        }
+    }
+    check_head("pipelined", buffer, length);
+}
+
+static void test_malformed(void) {
+    static const char *heads[] = {
+        "GET  / HTTP/1.1\r\n\r\n",          "GET / HTTP/2.0\r\n\r\n",           "GET / HTTP/1.1 \r\n\r\n",
+        "GET / HTTP/1.10\r\n\r\n",          "G@T / HTTP/1.1\r\n\r\n",           "GET HTTP/1.1\r\n\r\n",
+        " GET / HTTP/1.1\r\n\r\n",          "GET /\x7f HTTP/1.1\r\n\r\n",        "GET /a\tb HTTP/1.1\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost x\r\n\r\n", "GET / HTTP/1.1\r\n: x\r\n\r\n",   "GET / HTTP/1.1\r\nHo st: x\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost: a\r\n folded\r\n\r\n",                          "GET / HTTP/1.1\r\nX: a\x01z\r\n\r\n",
+        "GET / HTTP/1.1\r\nX: a\rz\r\n\r\n",                                      "GET / HTTP/1.1\r\nX: \x7f\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 0\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 5\r\ncontent-length: 5\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n",
+        "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 5, 5\r\n\r\n",                     "POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length:\r\n\r\n",
+    };
+    for (size_t i = 0; i < sizeof(heads) / sizeof(*heads); i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "malformed %zu", i);
+        expect(name, heads[i], HTTP_PARSE_INVALID);
+    }
+}
+
+static void test_oversized(void) {
+    static char head[80000];
+    size_t length = snprintf(head, sizeof(head), "GET / HTTP/1.1\r\n");
+    for (int i = 0; i < HTTP_MAX_HEADERS; i++) length += snprintf(head + length, sizeof(head) - length, "X-%d: %d\r\n", i, i);
+    strcpy(head + length, "\r\n");
+    expect("most headers", head, 1);
+    strcpy(head + length, "X-Last: 1\r\n\r\n");
+    expect("too many headers", head, HTTP_PARSE_TOO_LARGE);
+
+    // A 64 KiB cookie, then the same line without an end: the head never completes, the caller rejects it
+    length = snprintf(head, sizeof(head), "GET / HTTP/1.1\r\nCookie: ");
+    memset(head + length, 'c', 65536);
+    length += 65536;
+    strcpy(head + length, "\r\nHost: a\r\n\r\n");
+    expect("long header value", head, 1);
+    head[length] = 0;
+    expect("endless header line", head, HTTP_PARSE_INCOMPLETE);
+    head[length - 1000] = '\x02';
+    strcpy(head + length, "\r\n\r\n");
+    expect("control character far into a value", head, HTTP_PARSE_INVALID);
+}
+
+// Line ends, colons and control characters at every offset of a 16 and 32 byte block, and past the last one
+static void test_block_boundaries(void) {
+    static const char pad[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUV";
+    char head[256], name[64];
+    for (int n = 0; n < 100; n++) {
+        snprintf(head, sizeof(head), "GET /%.*s HTTP/1.1\r\nX: %.*s\r\n\r\n", n, pad, n, pad);
+        snprintf(name, sizeof(name), "padded to %d", n);
+        expect(name, head, 1);
+
+        snprintf(head, sizeof(head), "GET / HTTP/1.1\r\nX-%.*s: v\r\n\r\n", n, pad);
+        snprintf(name, sizeof(name), "name of %d", n);
+        expect(name, head, 1);
+
+        snprintf(head, sizeof(head), "GET / HTTP/1.1\r\nX: %.*s\x1f%.*s\r\n\r\n", n, pad, 99 - n, pad);
+        snprintf(name, sizeof(name), "control character at %d", n);
+        expect(name, head, HTTP_PARSE_INVALID);
+
+        snprintf(head, sizeof(head), "GET / HTTP/1.1\r\nX: %.*s\t%.*s\r\n\r\n", n, pad, 99 - n, pad);
+        snprintf(name, sizeof(name), "tab at %d", n);
+        expect(name, head, 1);
+    }
+}
+
+// Random heads from a few bytes that matter to the parser, compared between the parsers
+static void test_random(void) {
+    static const char alphabet[] = "GET /aZ:\r\n\r\n\t\x01\x7f\x80-HTTP/1.1";
+    char head[512];
+    unsigned state = 12345;
+    for (int i = 0; i < RANDOM_HEADS; i++) {
+        size_t length = snprintf(head, sizeof(head), "%s", i & 1 ? "GET / HTTP/1.1\r\n" : "");
+        state = state * 1103515245 + 12345;
+        size_t extra = (state >> 8) % 400;
+        for (size_t j = 0; j < extra; j++) {
+            state = state * 1103515245 + 12345;
+            unsigned pick = (state >> 8) % 64;
+            head[length++] = pick < sizeof(alphabet) - 1 ? alphabet[pick] : (char)('a' + pick % 26);
+        }
+        if (i & 2) length += snprintf(head + length, sizeof(head) - length, "\r\n\r\n");
+        check_head("random", head, length);
+    }
+}
+
+int main(void) {
+    int best = http_parser_set_simd(HTTP_SIMD_AVX2);
+    printf("Comparing with the scalar parser: %s", level_names[HTTP_SIMD_NONE]);
+    for (int level = HTTP_SIMD_SSE; level <= best; level++) printf(", %s", level_names[level]);
+    printf("\n");
+
+    test_valid();
+    test_tokens();
+    test_pipelined();
+    test_malformed();
+    test_oversized();
+    test_block_boundaries();
+    test_random();
+
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,35 @@
+#include <stdlib.h>
+
+#include "pool.h"
+
+static size_t stride(const struct pool *pool) {
+    size_t size = pool->object_size < sizeof(void *) ? sizeof(void *) : pool->object_size;
+    return (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+}
+
+// Threads the objects of a new slab onto the free list, the first one ends up on top
+static int grow(struct pool *pool) {
+    size_t size = stride(pool);
+    size_t count = POOL_SLAB_SIZE / size ? POOL_SLAB_SIZE / size : 1;
+    char *slab = aligned_alloc(POOL_ALIGN, count * size);
+    if (!slab) return -1;
+    for (size_t i = count; i-- > 0;) {
+        void *object = slab + i * size;
+        *(void **)object = pool->free_list;
+        pool->free_list = object;
+    }
+    pool->bytes += count * size;
+    return 0;
+}
+
+void *pool_get(struct pool *pool) {
+    if (!pool->free_list && grow(pool) < 0) return NULL;
+    void *object = pool->free_list;
+    pool->free_list = *(void **)object;
+    return object;
+}
+
+void pool_put(struct pool *pool, void *object) {
+    *(void **)object = pool->free_list;
+    pool->free_list = object;
+}
@@ -0,0 +1,29 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#define POOL_SLAB_SIZE 65536 // Bytes allocated at once when a pool runs dry
+#define POOL_ALIGN 16        // Every object starts at a multiple of this
+
+/*
+ * A free list of objects of one size, carved out of slabs of POOL_SLAB_SIZE bytes.
+ * A pool belongs to one thread (declare it __thread), so taking and returning an object is a pointer swap
+   without a lock or a call to malloc().
+ * Slabs are never freed: a pool grows to the most objects its thread ever had in use at once, and objects
+   returned are handed out again, the most recently returned first while it is still in the CPU cache.
+ */
+struct pool {
+    size_t object_size;
+    void *free_list; // Each free object starts with the pointer to the next one
+    size_t bytes;    // Allocated in slabs so far
+};
+
+#define POOL_INITIALIZER(type) {.object_size = sizeof(type)}
+
+// Returns an object with undefined contents, or NULL when no slab could be allocated.
+void *pool_get(struct pool *pool);
+
+void pool_put(struct pool *pool, void *object);
+
+#endif
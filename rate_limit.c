@@ -0,0 +1,223 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "http_header.h"
+#include "metrics.h"
+#include "rate_limit.h"
+
+#define SLOT_MASK (RATE_LIMIT_SHARD_SLOTS - 1)
+#define SHARD_FULL (RATE_LIMIT_SHARD_SLOTS - RATE_LIMIT_SHARD_SLOTS / 8) // Keeps probe sequences short
+
+struct rate_bucket {
+    unsigned char address[16]; // IPv4 addresses are mapped into IPv6
+    uint32_t hash;
+    uint64_t updated;  // metrics_now() when the tokens were last refilled, 0 marks a free slot
+    double requests;   // Request tokens left
+    double bytes;      // Byte tokens left, negative while a large response is paid off
+};
+
+/*
+ * One part of the table: an open-addressing hash with linear probing, under its own lock.
+ * A lookup holds one lock for a few dozen nanoseconds, and with RATE_LIMIT_SHARDS of them
+   workers rarely meet on the same one.
+ */
+struct rate_shard {
+    pthread_mutex_t lock;
+    int count;
+    struct rate_bucket slots[RATE_LIMIT_SHARD_SLOTS];
+} __attribute__((aligned(64)));
+
+static int enabled;
+static double request_rate; // Per nanosecond, 0 when unlimited
+static double byte_rate;
+static double request_burst;
+static double byte_burst;
+static struct rate_shard shards[RATE_LIMIT_SHARDS];
+
+static const char too_many_body[] = "Too many requests, please slow down.\n";
+
+// Looks the client's address up once per connection. Returns 0 if it has none we can key on.
+static int client_address(struct connection *conn) {
+    if (conn->address_known) return conn->address_known > 0;
+    conn->address_known = -1;
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if (getpeername(conn->fd, (struct sockaddr *)&address, &length) < 0) return 0;
+    if (address.ss_family == AF_INET) {
+        static const unsigned char mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+        memcpy(conn->address, mapped, sizeof(mapped));
+        memcpy(conn->address + 12, &((struct sockaddr_in *)&address)->sin_addr, 4);
+    } else if (address.ss_family == AF_INET6) {
+        memcpy(conn->address, &((struct sockaddr_in6 *)&address)->sin6_addr, 16);
+    } else {
+        return 0;
+    }
+    conn->address_known = 1;
+    return 1;
+}
+
+static uint32_t hash_address(const unsigned char *address) {
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (int i = 0; i < 16; i++) hash = (hash ^ address[i]) * 1099511628211ull;
+    return (uint32_t)(hash ^ hash >> 32);
+}
+
+// The shard comes from the low bits of the hash, the first slot from the bits above them
+static struct rate_shard *shard_of(uint32_t hash) {
+    return &shards[hash & (RATE_LIMIT_SHARDS - 1)];
+}
+
+static unsigned home_slot(uint32_t hash) {
+    return (hash / RATE_LIMIT_SHARDS) & SLOT_MASK;
+}
+
+/*
+ * Finds the client's bucket, or adds a full one. Called with the shard locked.
+ * Returns NULL when the shard is full; that client is then not limited until the sweeper makes room.
+ */
+static struct rate_bucket *find_bucket(struct rate_shard *shard, const unsigned char *address, uint32_t hash,
+                                       uint64_t now) {
+    for (unsigned i = home_slot(hash);; i = (i + 1) & SLOT_MASK) {
+        struct rate_bucket *bucket = &shard->slots[i];
+        if (!bucket->updated) {
+            if (shard->count >= SHARD_FULL) return NULL;
+            memcpy(bucket->address, address, 16);
+            bucket->hash = hash;
+            bucket->updated = now ? now : 1;
+            bucket->requests = request_burst;
+            bucket->bytes = byte_burst;
+            shard->count++;
+            return bucket;
+        }
+        if (bucket->hash == hash && memcmp(bucket->address, address, 16) == 0) return bucket;
+    }
+}
+
+static void refill(struct rate_bucket *bucket, uint64_t now) {
+    if (now <= bucket->updated) return;
+    double elapsed = (double)(now - bucket->updated);
+    bucket->requests = fmin(request_burst, bucket->requests + elapsed * request_rate);
+    bucket->bytes = fmin(byte_burst, bucket->bytes + elapsed * byte_rate);
+    bucket->updated = now;
+}
+
+// Queues the 429, with Retry-After rounded up to whole seconds
+static void send_too_many(struct connection *conn, double wait_ns) {
+    int retry_after = (int)ceil(wait_ns / 1e9);
+    if (retry_after < 1) retry_after = 1;
+    struct header_builder header;
+    http_header_start(&header, conn->io->header, sizeof(conn->io->header), 429);
+    http_header_add_literal(&header, "Content-Type: text/plain; charset=utf-8\r\nContent-Length: ");
+    http_header_add_number(&header, sizeof(too_many_body) - 1);
+    http_header_add_literal(&header, "\r\nRetry-After: ");
+    http_header_add_number(&header, retry_after);
+    http_header_add_literal(&header, "\r\nCache-Control: no-store\r\n");
+    int complete = http_header_finish(&header, conn) == 0;
+    struct iovec pieces[2] = {
+        {.iov_base = header.data, .iov_len = header.len},
+        {.iov_base = (void *)too_many_body, .iov_len = sizeof(too_many_body) - 1},
+    };
+    connection_send_buffers(conn, pieces, complete ? 2 : 1, NULL, NULL);
+}
+
+int rate_limit_request(struct connection *conn, uint64_t now) {
+    if (!enabled || !client_address(conn)) return 1;
+    uint32_t hash = hash_address(conn->address);
+    struct rate_shard *shard = shard_of(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    struct rate_bucket *bucket = find_bucket(shard, conn->address, hash, now);
+    double wait_ns = 0;
+    if (bucket) {
+        refill(bucket, now);
+        if (request_rate && bucket->requests < 1) wait_ns = (1 - bucket->requests) / request_rate;
+        if (byte_rate && bucket->bytes < 0) wait_ns = fmax(wait_ns, -bucket->bytes / byte_rate);
+        if (wait_ns == 0) bucket->requests -= 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (wait_ns == 0) return 1;
+    send_too_many(conn, wait_ns);
+    return 0;
+}
+
+void rate_limit_charge(struct connection *conn, uint64_t bytes) {
+    if (!enabled || !byte_rate || conn->address_known <= 0) return;
+    uint32_t hash = hash_address(conn->address);
+    struct rate_shard *shard = shard_of(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    // Refilling is left to the next request, which has the time at hand
+    struct rate_bucket *bucket = find_bucket(shard, conn->address, hash, metrics_now());
+    if (bucket) bucket->bytes -= (double)bytes;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Removes slot i without breaking the probe sequence of the buckets behind it: each of them that
+   could have lived at the emptied slot moves up into it, and the slot it left is emptied in turn.
+ */
+static void remove_slot(struct rate_shard *shard, unsigned i) {
+    for (unsigned j = (i + 1) & SLOT_MASK; shard->slots[j].updated; j = (j + 1) & SLOT_MASK) {
+        unsigned home = home_slot(shard->slots[j].hash);
+        if (((j - home) & SLOT_MASK) >= ((j - i) & SLOT_MASK)) {
+            shard->slots[i] = shard->slots[j];
+            i = j;
+        }
+    }
+    shard->slots[i].updated = 0;
+    shard->count--;
+}
+
+// A client whose buckets have filled up again is no different from one never seen, so it can go
+static void sweep(uint64_t now) {
+    for (int s = 0; s < RATE_LIMIT_SHARDS; s++) {
+        struct rate_shard *shard = &shards[s];
+        pthread_mutex_lock(&shard->lock);
+        for (unsigned i = 0; i < RATE_LIMIT_SHARD_SLOTS && shard->count > 0;) {
+            struct rate_bucket *bucket = &shard->slots[i];
+            if (bucket->updated) refill(bucket, now);
+            if (bucket->updated && bucket->requests >= request_burst && bucket->bytes >= byte_burst) {
+                remove_slot(shard, i); // Another bucket may have moved into slot i, look at it again
+            } else {
+                i++;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+static void *sweep_main(void *arg) {
+    (void)arg;
+    struct timespec interval = {.tv_sec = RATE_LIMIT_SWEEP_MS / 1000, .tv_nsec = RATE_LIMIT_SWEEP_MS % 1000 * 1000000L};
+    for (;;) {
+        nanosleep(&interval, NULL);
+        sweep(metrics_now());
+    }
+    return NULL;
+}
+
+int rate_limit_start(double requests_per_second, double bytes_per_second) {
+    if (requests_per_second <= 0 && bytes_per_second <= 0) return 0;
+    request_rate = requests_per_second > 0 ? requests_per_second / 1e9 : 0;
+    byte_rate = bytes_per_second > 0 ? bytes_per_second / 1e9 : 0;
+    // An unlimited bucket never runs dry, a limited one holds at least one request
+    request_burst = request_rate ? fmax(1, requests_per_second * RATE_LIMIT_BURST) : INFINITY;
+    byte_burst = byte_rate ? bytes_per_second * RATE_LIMIT_BURST : INFINITY;
+
+    for (int s = 0; s < RATE_LIMIT_SHARDS; s++) pthread_mutex_init(&shards[s].lock, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sweep_main, NULL) != 0) {
+        perror("Starting the rate limit sweeper failed");
+        return -1;
+    }
+    pthread_detach(thread);
+    enabled = 1;
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdint.h>
+
+#include "event_loop.h"
+
+#define RATE_LIMIT_SHARDS 64        // Separately locked parts of the table, a power of two
+#define RATE_LIMIT_SHARD_SLOTS 1024 // Client addresses one shard can track, a power of two
+#define RATE_LIMIT_BURST 2          // Seconds of its rate a client may use up at once
+#define RATE_LIMIT_SWEEP_MS 1000    // How often the background thread forgets clients whose buckets are full again
+
+/*
+ * Limits every client address to requests_per_second and bytes_per_second (0 leaves a limit off), each with a
+   token bucket holding RATE_LIMIT_BURST seconds worth. Buckets are refilled lazily when the client is next seen.
+ * Requests over a limit are answered with 429 Too Many Requests and a Retry-After.
+ * Starts the thread that drops idle clients. Call before any event loop starts. Returns 0, or -1 if the thread cannot start.
+ */
+int rate_limit_start(double requests_per_second, double bytes_per_second);
+
+/*
+ * Takes a request token from the client of conn; now is metrics_now().
+ * Returns 1 when the request may go on. Returns 0 when a bucket is empty (or in debt for bytes),
+   after queueing the 429 response on conn.
+ */
+int rate_limit_request(struct connection *conn, uint64_t now);
+
+// Takes the bytes of a response that was just sent from its client's byte bucket, which may go into debt.
+void rate_limit_charge(struct connection *conn, uint64_t bytes);
+
+#endif
@@ -2,191 +2,465 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <arpa/ainet.h>
-#include <pthread.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <signal.h>
 
+#include "access_log.h"
+#include "admission.h"
+#include "bundle.h"
+#include "cache_policy.h"
+#include "event_loop.h"
+#include "file_cache.h"
+#include "file_validators.h"
+#include "file_watch.h"
+#include "handoff.h"
+#include "http_header.h"
+#include "http_range.h"
+#include "metrics.h"
+#include "mime_types.h"
+#include "rate_limit.h"
+#include "status_pages.h"
+#include "web_root.h"
+#include "workers.h"
+
 #define PORT 8080
 #define WEB_ROOT "./web/"  // Serve files from the web directory
 #define DEFAULT_FILE "index.html"
-#define MAX_CLIENTS 10
+#define WEB_ROOT_PREFIX_LEN (sizeof(WEB_ROOT) - 2) // "./web", a path below the root follows with its leading '/'
+#define LISTEN_BACKLOG SOMAXCONN // Pending connections each worker's listening socket can queue
+#define DRAIN_TIMEOUT 30 // Seconds the requests in flight get to finish when the server stops or is replaced
 
-static int server_socket; // Server socket descriptor
-static int running = 1;   // Flag for server running status
+static int serve_bundle; // Every file comes from the bundle mapped with -B, the web root is never looked at
+static int serve_fingerprints; // -F: "/app.3f9a2c1d.js" is "/app.js" as long as the content has that fingerprint
 
-// Function to handle graceful shutdown when SIGINT (Ctrl+C) is received
-void signal_handler(int signum) {
-    if (signum == SIGINT) {
-        printf("\nServer shutting down gracefully...\n");
-        running = 0; // Mark the server as not running anymore
-        close(server_socket); // Close the server socket to stop accepting new connections
+/*
+ * Waits for signals until the workers are done.
+ * The signals are blocked in every thread and taken with sigtimedwait(), so they are handled here in the main
+   thread, which may do what a signal handler cannot, like starting the new binary.
+ * SIGINT or SIGTERM: stop accepting and let the requests in flight finish, a second one stops right away.
+ * SIGUSR2: start the new binary on the same listening sockets, then drain once it serves.
+ * SIGHUP: reopen the access log after logrotate moved it.
+ */
+static void supervise(const sigset_t *signals, char *const argv[], const int *listen_fds, int count) {
+    int draining = 0;
+    while (workers_running()) {
+        struct timespec tick = {.tv_sec = 1}; // Notice workers that stopped on their own
+        int signum = sigtimedwait(signals, NULL, &tick);
+        if (signum == SIGHUP) {
+            access_log_reopen();
+        } else if (signum == SIGUSR2 && !draining) {
+            printf("Starting %s to take over...\n", argv[0]);
+            if (handoff_start(argv, listen_fds, count) == 0) {
+                printf("The new server is running, finishing the requests in flight\n");
+                event_loop_drain(DRAIN_TIMEOUT);
+                draining = 1;
+            }
+        } else if ((signum == SIGINT || signum == SIGTERM) && draining) {
+            event_loop_stop();
+        } else if (signum == SIGINT || signum == SIGTERM) {
+            printf("\nFinishing the requests in flight...\n");
+            event_loop_drain(DRAIN_TIMEOUT);
+            draining = 1;
+        }
     }
 }
 
-// Function to determine the MIME type of a requested file
-const char *get_mime_type(const char *path) {
-    const char *dot = strrchr(path, '.');
-    if (!dot) return "application/octet-stream"; // Default for unknown files
-
-    if (strcmp(dot, ".html") == 0) return "text/html";
-    if (strcmp(dot, ".css") == 0) return "text/css";
-    if (strcmp(dot, ".js") == 0) return "application/javascript";
-    if (strcmp(dot, ".png") == 0) return "image/png";
-    if (strcmp(dot, ".jpg") == 0 || strcmp(dot, ".jpeg") == 0) return "image/jpeg";
-    if (strcmp(dot, ".gif") == 0) return "image/gif";
-    if (strcmp(dot, ".json") == 0) return "application/json";
-    if (strcmp(dot, ".txt") == 0) return "text/plain";
-    if (strcmp(dot, ".pdf") == 0) return "application/pdf";
-    
-    return "application/octet-stream"; // Default for unknown files
+// Sends a cached file as 304, 206, 416 or 200, compressed if the client accepts it
+static void send_cached(struct connection *conn, const struct http_request *request, struct cache_entry *cached,
+                        const struct cache_policy *policy) {
+    cached = file_cache_negotiate(cached, request);
+    if (file_validators_not_modified(&cached->validators, request)) {
+        file_cache_send_not_modified(conn, cached, policy);
+        return;
+    }
+
+    struct byte_range ranges[RANGE_MAX];
+    int range_count = http_range_parse(request, cached->body_len, &cached->validators, ranges);
+    if (range_count < 0) {
+        http_range_send_unsatisfiable(conn, cached->body_len);
+        file_cache_release(cached);
+    } else if (range_count > 0) {
+        file_cache_send_ranges(conn, cached, ranges, range_count, policy);
+    } else {
+        file_cache_send(conn, cached, policy);
+    }
 }
 
-// Function to serve a requested file to the client
-void serve_file(int client_socket, const char *file_path) {
+// Opens the file at file_path if it is a regular file below the web root, or returns -1
+static int open_regular_file(const char *file_path, struct stat *file_stat) {
+    // One walk from the web root's descriptor, fstat() then asks about the file that was actually opened
+    int file_fd = web_root_open_file(file_path + WEB_ROOT_PREFIX_LEN);
+    if (file_fd >= 0 && (fstat(file_fd, file_stat) < 0 || !S_ISREG(file_stat->st_mode))) {
+        close(file_fd);
+        return -1;
+    }
+    return file_fd;
+}
+
+void serve_file(struct connection *conn, const struct http_request *request, const char *file_path,
+                const struct cache_policy *policy) {
+    // Answer straight from memory when the file is cached
+    unsigned long generation;
+    struct cache_entry *cached = file_cache_get(file_path, &generation);
+    if (cached) {
+        metrics_record_latency(METRIC_STAGE_OPEN, metrics_now() - conn->request_start);
+        send_cached(conn, request, cached, policy);
+        return;
+    }
+
     struct stat file_stat;
-    if (stat(file_path, &file_stat) < 0 || S_ISDIR(file_stat.st_mode)) {
-        // If file doesn't exist or is a directory, serve the 404 page
-        char file_path[30];
-        snprintf(file_path, sizeof(file_path), "%s%s", WEB_ROOT, "page-not-found.html");
-        serve_file(client_socket, file_path);
-        shutdown(client_socket, SHUT_WR);
-        close(client_socket);
+    int file_fd = open_regular_file(file_path, &file_stat);
+    if (file_fd < 0) {
+        // If the file doesn't exist, is a directory or lies outside the web root, serve the 404 page
+        status_pages_send(conn, STATUS_PAGE_NOT_FOUND);
         return;
     }
 
-    FILE *file = fopen(file_path, "rb");
-    const char *mime_type = get_mime_type(file_path);
-
-    if (!file) {
-        // If file cannot be opened, return 404 error response
-        if (strcmp(mime_type, "text/html") == 0) {
-            char file_path[30];
-            snprintf(file_path, sizeof(file_path), "%s%s", WEB_ROOT, "page-not-found.html");
-            serve_file(client_socket, file_path);
-            shutdown(client_socket, SHUT_WR);
-            close(client_socket);
-        } else {
-            const char *error_msg = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-            send(client_socket, error_msg, strlen(error_msg), 0);
-        }
+    // The client already has this version of the file
+    struct file_validators validators;
+    file_validators_init(&validators, &file_stat);
+    struct header_builder header;
+    if (file_validators_not_modified(&validators, request)) {
+        close(file_fd);
+        http_header_start(&header, conn->io->header, sizeof(conn->io->header), 304);
+        http_header_add_validators(&header, &validators);
+        http_header_add_cache_policy(&header, policy);
+        http_header_finish(&header, conn);
+        connection_send_response(conn, header.data, header.len);
         return;
     }
 
-    // Send HTTP response header
-    char header[256];
-    snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n\r\n", mime_type);
-    send(client_socket, header, strlen(header), 0);
+    const char *mime_type = mime_type_lookup(file_path);
+    metrics_record_latency(METRIC_STAGE_OPEN, metrics_now() - conn->request_start);
 
-    // Send file content
-    char buffer[4096];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        send(client_socket, buffer, bytes_read, 0);
+    // Small files are read into the cache once and served from memory from now on, large ones stay open in it
+    cached = file_cache_put(file_path, generation, file_fd, &file_stat, mime_type);
+    if (cached) {
+        send_cached(conn, request, cached, policy);
+        return;
     }
 
-    fclose(file);
-    shutdown(client_socket, SHUT_WR);
-    usleep(1000); // Small delay before closing socket
-    close(client_socket);
+    // Ranges are sent from their offsets in the file, the connection owns file_fd from here on
+    struct byte_range ranges[RANGE_MAX];
+    int range_count = http_range_parse(request, file_stat.st_size, &validators, ranges);
+    if (range_count < 0) {
+        close(file_fd);
+        http_range_send_unsatisfiable(conn, file_stat.st_size);
+        return;
+    }
+    if (range_count > 0) {
+        struct range_source source = {.mime_type = mime_type, .validators = &validators, .cache_policy = policy,
+                                      .size = file_stat.st_size, .fd = file_fd, .owns_fd = 1};
+        http_range_send(conn, ranges, range_count, &source);
+        return;
+    }
+
+    // Queue the HTTP response header and the file content, the event loop streams both
+    http_header_start(&header, conn->io->header, sizeof(conn->io->header), 200);
+    http_header_add_literal(&header, "Content-Type: ");
+    http_header_add(&header, mime_type, strlen(mime_type));
+    http_header_add_literal(&header, "\r\nContent-Length: ");
+    http_header_add_number(&header, file_stat.st_size);
+    http_header_add_literal(&header, "\r\nAccept-Ranges: bytes\r\n");
+    http_header_add_validators(&header, &validators);
+    http_header_add_cache_policy(&header, policy);
+    if (http_header_finish(&header, conn) < 0) {
+        close(file_fd); // The header became a 500, which goes out without the file
+        connection_send_response(conn, header.data, header.len);
+        return;
+    }
+    connection_send_response(conn, header.data, header.len);
+    connection_add_file_body(conn, file_fd, 0, file_stat.st_size, 1);
+    conn->mime_type = mime_type;
 }
 
-// Thread function to handle client requests
-void *handle_client(void *arg) {
-    int client_socket = *(int *)arg;
-    free(arg);
+/*
+ * A fingerprinted URL ("/app.3f9a2c1d.js") names one version of a file by its content, so while the file still has
+   that content it is sent as immutable. Returns 0 if the URL does not name the current version, which is then
+   served as a path of its own (usually a 404).
+ * Bundles fingerprint every file, the web root only those the cache keeps in memory.
+ */
+static int serve_fingerprinted(struct connection *conn, const struct http_request *request, const char *path, int path_len) {
+    char file_path[WEB_ROOT_PREFIX_LEN + WEB_PATH_MAX];
+    memcpy(file_path, WEB_ROOT, WEB_ROOT_PREFIX_LEN);
+    char *stripped = file_path + WEB_ROOT_PREFIX_LEN;
+    uint32_t fingerprint;
+    int stripped_len = cache_fingerprint_strip(path, path_len, stripped, WEB_PATH_MAX, &fingerprint);
+    if (stripped_len < 0) return 0;
 
-    char buffer[2048];
-    recv(client_socket, buffer, sizeof(buffer) - 1, 0);
+    if (serve_bundle) {
+        const struct bundle_entry *entry = bundle_find((struct http_slice){.data = stripped, .len = stripped_len});
+        if (!entry || entry->fingerprint != fingerprint) return 0;
+        metrics_record_latency(METRIC_STAGE_OPEN, metrics_now() - conn->request_start);
+        bundle_send(conn, request, entry, &cache_policy_immutable);
+        return 1;
+    }
 
-    char method[16], url[256], protocol[32];
-    sscanf(buffer, "%15s %255s %31s", method, url, protocol);
+    unsigned long generation;
+    struct cache_entry *cached = file_cache_get(file_path, &generation);
+    if (!cached) {
+        struct stat file_stat;
+        int file_fd = open_regular_file(file_path, &file_stat);
+        if (file_fd < 0) return 0;
+        cached = file_cache_put(file_path, generation, file_fd, &file_stat, mime_type_lookup(file_path));
+        if (!cached) {
+            close(file_fd);
+            return 0;
+        }
+    }
+    if (!cached->fingerprinted || cached->fingerprint != fingerprint) {
+        file_cache_release(cached);
+        return 0;
+    }
+    metrics_record_latency(METRIC_STAGE_OPEN, metrics_now() - conn->request_start);
+    send_cached(conn, request, cached, &cache_policy_immutable);
+    return 1;
+}
 
+// Called by the event loop once a full request has arrived on a connection
+void handle_client(struct connection *conn, const struct http_request *request) {
     // Only support GET requests; return 400 Bad Request for others
-    if (strcmp(method, "GET") != 0) {
-        char file_path[30];
-        snprintf(file_path, sizeof(file_path), "%s%s", WEB_ROOT, "bad-request.html");
-        serve_file(client_socket, file_path);
-        return NULL;
+    if (!http_slice_equals(request->method, "GET")) {
+        status_pages_send(conn, STATUS_PAGE_BAD_REQUEST);
+        return;
     }
 
-    // Prevent directory traversal attacks
-    if (strstr(url, "..")) {
-        char file_path[30];
-        snprintf(file_path, sizeof(file_path), "%s%s", WEB_ROOT, "access-denied.html");
-        serve_file(client_socket, file_path);
-        return NULL;
+    /*
+     * The decoded, normalized path goes right behind "./web", so the whole is the file's path for the cache and
+       the MIME type and the part from '/' on is what gets opened below the web root.
+     * Normalizing keeps every path inside the root, a ".." that would climb out of it is refused.
+     */
+    char file_path[WEB_ROOT_PREFIX_LEN + WEB_PATH_MAX];
+    memcpy(file_path, WEB_ROOT, WEB_ROOT_PREFIX_LEN);
+    char *path = file_path + WEB_ROOT_PREFIX_LEN;
+    int path_len = web_path_normalize(request->uri, DEFAULT_FILE, path, WEB_PATH_MAX);
+    if (path_len < 0) {
+        status_pages_send(conn, path_len == WEB_PATH_FORBIDDEN ? STATUS_PAGE_FORBIDDEN : STATUS_PAGE_BAD_REQUEST);
+        return;
     }
 
-    // Construct the full file path
-    char file_path[512];
-    if (strcmp(url, "/") == 0) {
-        snprintf(file_path, sizeof(file_path), "%s%s", WEB_ROOT, DEFAULT_FILE);
-    } else {
-        snprintf(file_path, sizeof(file_path), "%s%s", WEB_ROOT, url + 1);
+    // Counters and latency histograms of every worker, in the Prometheus text format
+    if (strcmp(path, METRICS_PATH) == 0) {
+        metrics_send(conn);
+        return;
     }
 
-    serve_file(client_socket, file_path);
-    return NULL;
+    if (serve_fingerprints && serve_fingerprinted(conn, request, path, path_len)) {
+        return;
+    }
+
+    // Cache-Control from the rules loaded with -P, NULL when none applies
+    const struct cache_policy *policy = cache_policy_lookup(path, path_len);
+    if (serve_bundle) {
+        const struct bundle_entry *entry = bundle_find((struct http_slice){.data = path, .len = path_len});
+        if (!entry) {
+            status_pages_send(conn, STATUS_PAGE_NOT_FOUND);
+            return;
+        }
+        metrics_record_latency(METRIC_STAGE_OPEN, metrics_now() - conn->request_start);
+        bundle_send(conn, request, entry, policy);
+        return;
+    }
+
+    serve_file(conn, request, file_path, policy);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-w workers] [-p] [-c cache_mb] [-o max_object_kb] [-z gzip_level] [-u] [-m mime.types]\n"
+                    "       [-l access_log] [-f common|combined|json] [-b backlog] [-C max_connections] [-I max_per_address]\n"
+                    "       [-r requests_per_sec] [-R kbytes_per_sec] [-B bundle] [-P cache_policies] [-F]\n", program);
+    fprintf(stderr, "  -w workers        number of worker event loops (default: one per CPU)\n");
+    fprintf(stderr, "  -p                pin each worker to its own CPU\n");
+    fprintf(stderr, "  -c cache_mb       memory for cached files, 0 disables the cache (default: %d)\n", CACHE_DEFAULT_BUDGET >> 20);
+    fprintf(stderr, "  -o max_object_kb  largest file kept in the cache (default: %d)\n", CACHE_DEFAULT_MAX_OBJECT >> 10);
+    fprintf(stderr, "  -z gzip_level     compress cached text files once at this level, 0 disables (default: %d)\n", COMPRESSION_DEFAULT_LEVEL);
+    fprintf(stderr, "  -u                do I/O through io_uring instead of epoll\n");
+    fprintf(stderr, "  -m mime.types     add the MIME types listed in this file, e.g. /etc/mime.types\n");
+    fprintf(stderr, "  -l access_log     log every response to this file, - for stdout, reopened on SIGHUP\n");
+    fprintf(stderr, "  -f format         access log format: common, combined or json (default: combined)\n");
+    fprintf(stderr, "  -b backlog        connections each worker's listening socket queues before accepting (default: %d)\n", LISTEN_BACKLOG);
+    fprintf(stderr, "  -C connections    most connections open at once, more get a 503 (default: unlimited)\n");
+    fprintf(stderr, "  -I connections    most connections open at once from one client address (default: unlimited)\n");
+    fprintf(stderr, "  -r requests       requests per second one client address may make, more get a 429 (default: unlimited)\n");
+    fprintf(stderr, "  -R kbytes         response kilobytes per second one client address may receive (default: unlimited)\n");
+    fprintf(stderr, "  -B bundle         serve every file from this bundle made by bundle_pack instead of %s\n", WEB_ROOT);
+    fprintf(stderr, "  -P policies       set Cache-Control by the path, directory and extension rules in this file\n");
+    fprintf(stderr, "  -F                serve name.<fingerprint>.ext as the current name.ext, cached by clients for a year\n");
 }
 
-int main() {
-    struct sockaddr_in server_address, client_address;
-    socklen_t address_len = sizeof(client_address);
+int main(int argc, char *argv[]) {
+    int workers = 0; // 0 picks one worker per online CPU
+    int pin_cpus = 0;
+    size_t cache_budget = CACHE_DEFAULT_BUDGET;
+    size_t cache_max_object = CACHE_DEFAULT_MAX_OBJECT;
+    int gzip_level = COMPRESSION_DEFAULT_LEVEL;
+    const char *mime_file = NULL;
+    const char *access_log_path = NULL;
+    enum access_log_format access_log_format = ACCESS_LOG_COMBINED;
+    int backlog = LISTEN_BACKLOG;
+    int max_connections = 0;
+    int max_per_address = 0;
+    double requests_per_second = 0;
+    double kbytes_per_second = 0;
+    const char *bundle_path = NULL;
+    const char *policy_path = NULL;
 
-    // Create the server socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        perror("Socket creation failed");
+    // getopt() may reorder argv, the new binary of an upgrade gets the arguments as they were given
+    char **original_argv = calloc(argc + 1, sizeof(*original_argv));
+    if (!original_argv) {
+        perror("Memory allocation failed");
         exit(1);
     }
+    memcpy(original_argv, argv, argc * sizeof(*argv));
+
+    int option;
+    while ((option = getopt(argc, argv, "w:pc:o:z:um:l:f:b:C:I:r:R:B:P:F")) != -1) {
+        switch (option) {
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'p':
+            pin_cpus = 1;
+            break;
+        case 'c':
+            cache_budget = (size_t)atol(optarg) << 20;
+            break;
+        case 'o':
+            cache_max_object = (size_t)atol(optarg) << 10;
+            break;
+        case 'z':
+            gzip_level = atoi(optarg);
+            break;
+        case 'u':
+            event_loop_set_backend(EVENT_LOOP_URING);
+            break;
+        case 'm':
+            mime_file = optarg;
+            break;
+        case 'l':
+            access_log_path = optarg;
+            break;
+        case 'f':
+            if (access_log_parse_format(optarg, &access_log_format) < 0) {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'C':
+            max_connections = atoi(optarg);
+            break;
+        case 'I':
+            max_per_address = atoi(optarg);
+            break;
+        case 'r':
+            requests_per_second = atof(optarg);
+            break;
+        case 'R':
+            kbytes_per_second = atof(optarg);
+            break;
+        case 'B':
+            bundle_path = optarg;
+            break;
+        case 'P':
+            policy_path = optarg;
+            break;
+        case 'F':
+            serve_fingerprints = 1;
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
 
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = INADDR_ANY;
-    server_address.sin_port = htons(PORT);
+    // Before any thread starts, so every thread inherits the mask and supervise() gets these signals
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    // A client that hangs up during sendfile() or splice() must not kill the server, those calls have no MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
 
-    // Bind the socket to the specified port
-    if (bind(server_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
-        perror("Binding failed");
+    // Without a file only building the table can fail, and mime_types_init() has said so
+    if (mime_types_init(mime_file) < 0 && mime_file) {
+        fprintf(stderr, "Cannot read %s, using the built-in MIME types\n", mime_file);
+    }
+    if (policy_path && cache_policy_init(policy_path) < 0) {
+        exit(1);
+    }
+    if (bundle_path) {
+        if (bundle_open(bundle_path) < 0) {
+            exit(1);
+        }
+        serve_bundle = 1;
+        cache_budget = 0; // Nothing is read from the web root, so there is nothing to cache or watch
+    } else if (web_root_open(WEB_ROOT) < 0) {
+        exit(1);
+    }
+    if (status_pages_init(serve_bundle) < 0) {
         exit(1);
     }
+    file_cache_init(cache_budget, cache_max_object);
+    file_cache_set_root(WEB_ROOT);
+    file_cache_set_compression(gzip_level);
+    if (cache_budget > 0) {
+        file_watch_start(WEB_ROOT); // Drop changed files from the cache as soon as inotify reports them
+    }
 
-    // Start listening for incoming connections
-    if (listen(server_socket, MAX_CLIENTS) < 0) {
-        perror("Listening failed");
+    admission_set_limits(max_connections, max_per_address);
+    if (rate_limit_start(requests_per_second, kbytes_per_second * 1024) < 0) {
+        exit(1);
+    }
+    if (access_log_path && access_log_start(access_log_path, access_log_format) < 0) {
         exit(1);
     }
 
-    // Register signal handler for graceful shutdown
-    signal(SIGINT, signal_handler);
+    // The listening sockets of the server we replace, or new ones
+    int listen_fds[HANDOFF_MAX_FDS];
+    int listen_count = handoff_receive(listen_fds, HANDOFF_MAX_FDS);
+    if (listen_count < 0) {
+        exit(1);
+    }
+    if (listen_count > 0) {
+        printf("Took over %d listening sockets, one worker each\n", listen_count);
+    } else {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        listen_count = workers > 0 ? workers : cpus > 0 ? (int)cpus : 1;
+        if (listen_count > HANDOFF_MAX_FDS) listen_count = HANDOFF_MAX_FDS;
+        if (open_listeners(PORT, backlog, listen_count, listen_fds) < 0) {
+            exit(1);
+        }
+    }
 
     printf("Server is running on http://localhost:%d\n", PORT);
 
-    while (running) {
-        int *client_socket = malloc(sizeof(int));
-        if (!client_socket) {
-            perror("Memory allocation failed");
-            continue;
-        }
-
-        *client_socket = accept(server_socket, (struct sockaddr *)&client_address, &address_len);
-        if (*client_socket < 0) {
-            perror("Accepting failed");
-            free(client_socket);
-            continue;
-        }
+    // Every worker accepts on its own SO_REUSEPORT socket and drives its clients through its own event loop
+    if (start_workers(listen_fds, listen_count, pin_cpus, handle_client) < 0) {
+        exit(1);
+    }
+    handoff_ready();
+    supervise(&signals, original_argv, listen_fds, listen_count);
+    int status = wait_workers() < 0 ? 1 : 0;
+    for (int i = 0; i < listen_count; i++) {
+        close(listen_fds[i]);
+    }
 
-        // Handle client requests in a separate thread
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_client, client_socket) != 0) {
-            perror("Thread creation failed");
-            free(client_socket);
-        }
+    printf("Server shutting down gracefully...\n");
+    access_log_stop(); // The workers are gone, so every line they logged gets written
 
-        pthread_detach(thread_id);
-    }
+    struct cache_stats stats;
+    file_cache_get_stats(&stats);
+    printf("File cache: %lu hits, %lu misses, %lu evictions, %lu invalidations, %lu files (%zu bytes, %lu open) cached\n",
+           stats.hits, stats.misses, stats.evictions, stats.invalidations, stats.entries, stats.bytes, stats.open_files);
 
-    close(server_socket);
     printf("Server has been shut down.\n");
-    return 0;
+    return status;
 }
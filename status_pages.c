@@ -0,0 +1,211 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "bundle.h"
+#include "http_header.h"
+#include "metrics.h"
+#include "mime_types.h"
+#include "status_pages.h"
+#include "web_root.h"
+
+/*
+ * A page rendered into its response header, up to the Date line, and its body. It is never changed:
+   a changed file gets a new one, and connections still sending the old one hold a reference to it.
+ */
+struct rendered_page {
+    int refs;
+    int exists;            // Whether the file existed when the page was loaded
+    struct stat file_stat; // Its metadata then, to notice changes by
+    const char *mime_type;
+    size_t header_len;
+    size_t body_len;
+    char data[]; // Header, then body
+};
+
+struct page_source {
+    int status;
+    const char *path;     // Below the web root, or the URL path in the bundle
+    const char *fallback; // Body when the file is missing
+};
+
+static const struct page_source sources[STATUS_PAGE_COUNT] = {
+    [STATUS_PAGE_BAD_REQUEST] = {400, "/bad-request.html", "Bad request.\n"},
+    [STATUS_PAGE_FORBIDDEN] = {403, "/access-denied.html", "Access denied.\n"},
+    [STATUS_PAGE_NOT_FOUND] = {404, "/page-not-found.html", "Page not found.\n"},
+};
+
+static int from_bundle;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // Guards pages
+static pthread_mutex_t check_lock = PTHREAD_MUTEX_INITIALIZER; // Held by the worker checking the files
+static struct rendered_page *pages[STATUS_PAGE_COUNT];
+static unsigned long generation = 1; // Bumped whenever a page is replaced
+static uint64_t checked_at;          // metrics_now() of the last check
+
+// Every worker holds a reference to the current pages and only takes the lock when one was replaced
+static __thread struct rendered_page *held[STATUS_PAGE_COUNT];
+static __thread unsigned long held_generation;
+
+static void page_release(struct rendered_page *page) {
+    if (__atomic_sub_fetch(&page->refs, 1, __ATOMIC_ACQ_REL) == 0) free(page);
+}
+
+static void release_page(void *page) {
+    page_release(page);
+}
+
+// Renders the header of page with body into one block with the body, which holds one reference
+static struct rendered_page *render(enum status_page page, const char *body, size_t body_len, const char *mime_type) {
+    char buffer[HEADER_BUFFER_SIZE];
+    struct header_builder header;
+    http_header_start(&header, buffer, sizeof(buffer), sources[page].status);
+    http_header_add_literal(&header, "Content-Type: ");
+    http_header_add(&header, mime_type, strlen(mime_type));
+    http_header_add_literal(&header, "\r\nContent-Length: ");
+    http_header_add_number(&header, body_len);
+    http_header_add_literal(&header, "\r\n");
+    if (header.overflowed) return NULL;
+
+    struct rendered_page *rendered = malloc(sizeof(*rendered) + header.len + body_len);
+    if (!rendered) return NULL;
+    memset(rendered, 0, sizeof(*rendered));
+    rendered->refs = 1;
+    rendered->mime_type = mime_type;
+    rendered->header_len = header.len;
+    rendered->body_len = body_len;
+    memcpy(rendered->data, buffer, header.len);
+    memcpy(rendered->data + header.len, body, body_len);
+    return rendered;
+}
+
+static struct rendered_page *render_fallback(enum status_page page) {
+    const char *fallback = sources[page].fallback;
+    return render(page, fallback, strlen(fallback), mime_type_lookup("fallback.txt"));
+}
+
+// Renders the page from the bundle, or the built-in text when the bundle has none
+static struct rendered_page *load_bundled(enum status_page page) {
+    struct http_slice url = {.data = sources[page].path, .len = strlen(sources[page].path)};
+    const struct bundle_entry *entry = bundle_find(url);
+    if (!entry) return render_fallback(page);
+    return render(page, bundle_data(&entry->identity), entry->identity.data_len, bundle_mime_type(entry));
+}
+
+/*
+ * Reads the file of page into a new rendering, or renders the built-in text when it cannot be used.
+ * The file is opened below the web root like any requested file, non-blocking so a FIFO cannot stall the worker.
+ */
+static struct rendered_page *load(enum status_page page) {
+    if (from_bundle) return load_bundled(page);
+    const char *path = sources[page].path;
+    struct stat file_stat;
+    int exists = 0;
+    char *body = NULL;
+    ssize_t body_len = 0;
+
+    int fd = web_root_open_file(path);
+    if (fd >= 0 && fstat(fd, &file_stat) == 0) {
+        exists = 1;
+        if (!S_ISREG(file_stat.st_mode) || file_stat.st_size > STATUS_PAGE_MAX_SIZE) {
+            fprintf(stderr, "%s is not a file of at most %d bytes, using the built-in text\n", path, STATUS_PAGE_MAX_SIZE);
+        } else if ((body = malloc(file_stat.st_size + 1))) {
+            body_len = read(fd, body, file_stat.st_size + 1);
+            if (body_len != file_stat.st_size) { // Changed while we read it, the next check loads it again
+                free(body);
+                body = NULL;
+            }
+        }
+    }
+    if (fd >= 0) close(fd);
+
+    struct rendered_page *rendered;
+    if (body) {
+        rendered = render(page, body, body_len, mime_type_lookup(path));
+        free(body);
+    } else {
+        rendered = render_fallback(page);
+    }
+    if (rendered) {
+        rendered->exists = exists;
+        if (exists) rendered->file_stat = file_stat;
+    }
+    return rendered;
+}
+
+static int same_file(const struct rendered_page *page, int exists, const struct stat *file_stat) {
+    if (exists != page->exists) return 0;
+    if (!exists) return 1;
+    const struct stat *old = &page->file_stat;
+    return old->st_dev == file_stat->st_dev && old->st_ino == file_stat->st_ino && old->st_size == file_stat->st_size &&
+           old->st_mtim.tv_sec == file_stat->st_mtim.tv_sec && old->st_mtim.tv_nsec == file_stat->st_mtim.tv_nsec;
+}
+
+// Renders the pages whose file changed since they were loaded again. Only one worker checks at a time.
+static void check_pages(void) {
+    if (from_bundle || pthread_mutex_trylock(&check_lock) != 0) return;
+    for (int i = 0; i < STATUS_PAGE_COUNT; i++) {
+        struct stat file_stat;
+        int exists = web_root_stat(sources[i].path, &file_stat) == 0;
+        struct rendered_page *old = pages[i]; // Only replaced by the checking worker
+        if (same_file(old, exists, &file_stat)) continue;
+        struct rendered_page *fresh = load(i);
+        if (!fresh) continue; // Keep sending the old one
+        pthread_mutex_lock(&lock);
+        pages[i] = fresh;
+        __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&lock);
+        page_release(old);
+    }
+    pthread_mutex_unlock(&check_lock);
+}
+
+// Swaps the pages this worker holds for the current ones
+static void hold_current(void) {
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < STATUS_PAGE_COUNT; i++) {
+        if (held[i] == pages[i]) continue;
+        if (held[i]) page_release(held[i]);
+        held[i] = pages[i];
+        __atomic_add_fetch(&held[i]->refs, 1, __ATOMIC_RELAXED);
+    }
+    held_generation = generation;
+    pthread_mutex_unlock(&lock);
+}
+
+int status_pages_init(int bundled) {
+    from_bundle = bundled;
+    for (int i = 0; i < STATUS_PAGE_COUNT; i++) {
+        pages[i] = load(i);
+        if (!pages[i]) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+    }
+    checked_at = metrics_now();
+    return 0;
+}
+
+void status_pages_send(struct connection *conn, enum status_page page) {
+    uint64_t now = metrics_now();
+    uint64_t checked = __atomic_load_n(&checked_at, __ATOMIC_RELAXED);
+    if (now - checked >= STATUS_PAGE_CHECK_INTERVAL * 1000000000ull &&
+        __atomic_compare_exchange_n(&checked_at, &checked, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        check_pages();
+    }
+    if (held_generation != __atomic_load_n(&generation, __ATOMIC_ACQUIRE)) hold_current();
+
+    // The connection's own reference, as this worker may swap the held one while the response is still going out
+    struct rendered_page *rendered = held[page];
+    __atomic_add_fetch(&rendered->refs, 1, __ATOMIC_RELAXED);
+    struct iovec pieces[3] = {
+        {.iov_base = rendered->data, .iov_len = rendered->header_len},
+        http_header_tail(conn, NULL),
+        {.iov_base = rendered->data + rendered->header_len, .iov_len = rendered->body_len},
+    };
+    conn->mime_type = rendered->mime_type;
+    connection_send_buffers(conn, pieces, 3, release_page, rendered);
+}
@@ -0,0 +1,31 @@
+#ifndef STATUS_PAGES_H
+#define STATUS_PAGES_H
+
+#include "event_loop.h"
+
+#define STATUS_PAGE_MAX_SIZE (64 * 1024) // Larger page files are ignored in favour of the built-in text
+#define STATUS_PAGE_CHECK_INTERVAL 1     // Seconds between stat() checks of the page files
+
+enum status_page {
+    STATUS_PAGE_BAD_REQUEST, // 400, bad-request.html
+    STATUS_PAGE_FORBIDDEN,   // 403, access-denied.html
+    STATUS_PAGE_NOT_FOUND,   // 404, page-not-found.html
+    STATUS_PAGE_COUNT
+};
+
+/*
+ * Loads the error pages from the web root opened with web_root_open() and renders the header of every response
+   (status line, Server, Content-Type, Content-Length) next to its body. A page whose file is missing gets a short
+   built-in text instead. Call after mime_types_init() and before the workers start.
+ * With bundled set the pages are taken from the open bundle (see bundle_open()) and never checked again.
+ * Returns 0, or -1 if memory ran out.
+ */
+int status_pages_init(int bundled);
+
+/*
+ * Queues the response for page on conn, written with a single sendmsg(). No file is touched: at most once per
+   STATUS_PAGE_CHECK_INTERVAL one worker stat()s the page files and renders a changed one again.
+ */
+void status_pages_send(struct connection *conn, enum status_page page);
+
+#endif
@@ -0,0 +1,649 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "admission.h"
+#include "event_loop.h"
+#include "event_loop_internal.h"
+#include "metrics.h"
+#include "pool.h"
+
+#define URING_ENTRIES 1024      // Submission queue slots, the completion queue gets twice as many
+#define URING_BUFFER_COUNT 32   // Registered buffers per loop for file bodies
+#define URING_BUFFER_SIZE 65536 // Bytes of a file read and sent per step
+#define ACCEPT_RETRY_MIN_MS 10    // First pause after accepting failed, doubled on every failure in a row
+#define ACCEPT_RETRY_MAX_MS 1000
+
+/*
+ * io_uring backend.
+ * Instead of waiting for readiness and then making a syscall per recv/send, operations are queued in a ring
+   shared with the kernel and one io_uring_enter() submits all of them and collects their completions.
+ * Accepting uses a single multishot accept that keeps producing a completion per client (Linux 5.19).
+   When it ends with an error such as EMFILE, it is started again after a pause that grows while the error persists.
+ * Requests are received straight into the connection's io_buffer. A connection without one (new, or waiting
+   for its next request) first polls for input and only borrows the buffer once there is something to receive.
+ * Memory responses go out with sendmsg. File bodies are read into a registered buffer and sent from it,
+   the send linked behind the read so both take one submission.
+ * The ring descriptor, the listening socket and the buffers are registered once, which saves the kernel
+   looking them up on every operation.
+ * There is no sendfile() in io_uring, so a file body costs one copy into the buffer. In exchange reads of
+   cached pages complete without waking any thread, where splice() would be punted to a kernel worker.
+ */
+
+// Completions carry the connection pointer with the operation in the low bits (connections are POOL_ALIGN aligned)
+enum uring_op {
+    OP_RECV = 1,
+    OP_SENDMSG,
+    OP_READ,
+    OP_SEND,
+    OP_POLL, // The connection has no io_buffer yet, wait for a request before borrowing one
+};
+#define OP_MASK 7
+_Static_assert(POOL_ALIGN > OP_MASK, "The operation must fit below the connection pointer");
+#define USER_ACCEPT ((uint64_t)-1)
+#define USER_STOP ((uint64_t)-2)
+#define USER_DRAIN ((uint64_t)-3)
+#define USER_CANCEL ((uint64_t)-4)
+#define USER_ACCEPT_RETRY ((uint64_t)-5)
+
+struct ring {
+    int fd;
+    int enter_fd;       // Index of the registered ring descriptor, or fd
+    unsigned enter_flags;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    unsigned to_submit;
+};
+
+struct uring_loop {
+    struct ring ring;
+    int listen_fd;
+    int listen_fixed; // The listening socket is registered as fixed file 0
+    request_handler handler;
+    time_t now;
+    struct timer_wheel timers;
+    int draining; // No longer accepting, see event_loop_drain()
+    int accept_failed; // Accepting cannot work on this socket, the loop gives up
+    int accept_retry_ms; // Pause before the next accept after a failure, 0 while accepting works
+    struct __kernel_timespec accept_retry; // The pause of the queued timeout, read by the kernel when submitted
+
+    char *buffers;
+    int buffers_registered; // Reads use READ_FIXED, otherwise plain READ into the same memory
+    int free_buffers[URING_BUFFER_COUNT];
+    int free_count;
+    struct connection *buffer_wait_head; // Connections with a file body to send, waiting for a buffer
+    struct connection *buffer_wait_tail;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, size);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static void ring_unmap(struct ring *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sq_map) munmap(ring->sq_map, ring->sq_map_size);
+}
+
+static int ring_init(struct ring *ring) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Only this thread submits, and completions are processed when we ask for them rather than by interrupting us
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring->fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params)); // Kernel older than 6.1
+        ring->fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    }
+    if (ring->fd < 0) {
+        perror("io_uring_setup failed");
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "io_uring on this kernel is too old (5.19 or newer is needed)\n");
+        close(ring->fd);
+        return -1;
+    }
+
+    // Submission and completion rings share one mapping, the submission entries have their own
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > ring->sq_map_size) ring->sq_map_size = cq_size;
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        perror("Mapping the io_uring failed");
+        if (ring->sq_map == MAP_FAILED) ring->sq_map = NULL;
+        if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+        ring_unmap(ring);
+        close(ring->fd);
+        return -1;
+    }
+    ring->cq_map = ring->sq_map;
+    ring->cq_map_size = ring->sq_map_size;
+
+    char *sq = ring->sq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    char *cq = ring->cq_map;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // A registered ring descriptor spares every io_uring_enter() the descriptor table lookup
+    ring->enter_fd = ring->fd;
+    struct io_uring_rsrc_update update = {.offset = -1U, .data = (uint64_t)ring->fd};
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_RING_FDS, &update, 1) == 1) {
+        ring->enter_fd = update.offset;
+        ring->enter_flags = IORING_ENTER_REGISTERED_RING;
+    }
+    return 0;
+}
+
+static int ring_submit(struct ring *ring, unsigned min_complete, struct __kernel_timespec *timeout) {
+    unsigned flags = ring->enter_flags;
+    struct io_uring_getevents_arg arg = {.ts = (uint64_t)(uintptr_t)timeout};
+    if (min_complete) flags |= IORING_ENTER_GETEVENTS;
+    if (timeout) flags |= IORING_ENTER_EXT_ARG;
+    int submitted = sys_io_uring_enter(ring->enter_fd, ring->to_submit, min_complete, flags,
+                                       timeout ? &arg : NULL, timeout ? sizeof(arg) : 0);
+    if (submitted > 0) ring->to_submit -= submitted;
+    return submitted;
+}
+
+// Makes sure count submission entries are free, submitting what is queued if needed.
+static int ring_reserve(struct ring *ring, unsigned count) {
+    while (*ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count > *ring->sq_mask + 1) {
+        if (ring_submit(ring, 0, NULL) < 0 && errno != EINTR && errno != EBUSY) return -1;
+    }
+    return 0;
+}
+
+// Returns a zeroed submission entry, submitting what is queued first if the ring is full.
+static struct io_uring_sqe *ring_get_sqe(struct ring *ring) {
+    if (ring_reserve(ring, 1) < 0) return NULL;
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+static void arm_accept(struct uring_loop *loop) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&loop->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_fixed ? 0 : loop->listen_fd;
+    if (loop->listen_fixed) sqe->flags = IOSQE_FIXED_FILE;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT; // One submission keeps accepting until it fails
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = USER_ACCEPT;
+}
+
+// Starts accepting again after a pause, see handle_accept()
+static void arm_accept_retry(struct uring_loop *loop) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&loop->ring);
+    if (!sqe) return;
+    loop->accept_retry_ms = loop->accept_retry_ms ? loop->accept_retry_ms * 2 : ACCEPT_RETRY_MIN_MS;
+    if (loop->accept_retry_ms > ACCEPT_RETRY_MAX_MS) loop->accept_retry_ms = ACCEPT_RETRY_MAX_MS;
+    loop->accept_retry.tv_sec = loop->accept_retry_ms / 1000;
+    loop->accept_retry.tv_nsec = (loop->accept_retry_ms % 1000) * 1000000LL;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->accept_retry;
+    sqe->len = 1;
+    sqe->user_data = USER_ACCEPT_RETRY;
+}
+
+/*
+ * Kernels before 5.19 take IORING_ACCEPT_MULTISHOT for an invalid argument and fail the accept right away,
+   without it waiting for a client. Submitting the first accept on its own tells us.
+ * Other completions left in the ring are handled by the loop as usual.
+ */
+static int accept_supported(struct uring_loop *loop) {
+    if (ring_submit(&loop->ring, 0, NULL) < 0) {
+        perror("io_uring_enter failed");
+        return 0;
+    }
+    unsigned tail = __atomic_load_n(loop->ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (unsigned head = *loop->ring.cq_head; head != tail; head++) {
+        struct io_uring_cqe *cqe = &loop->ring.cqes[head & *loop->ring.cq_mask];
+        if (cqe->user_data == USER_ACCEPT && cqe->res == -EINVAL) {
+            fprintf(stderr, "io_uring on this kernel cannot accept in multishot mode (5.19 or newer is needed)\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Completes with user_data once fd becomes readable
+static void arm_poll(struct uring_loop *loop, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&loop->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data;
+}
+
+static struct io_uring_sqe *connection_sqe(struct uring_loop *loop, struct connection *conn, enum uring_op op) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&loop->ring);
+    if (!sqe) return NULL;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | op;
+    conn->pending_ops++;
+    return sqe;
+}
+
+static void release_buffer(struct uring_loop *loop, struct connection *conn) {
+    if (conn->buffer_index < 0) return;
+    loop->free_buffers[loop->free_count++] = conn->buffer_index;
+    conn->buffer_index = -1;
+}
+
+static void buffer_wait_remove(struct uring_loop *loop, struct connection *conn) {
+    struct connection **link = &loop->buffer_wait_head;
+    struct connection *prev = NULL;
+    while (*link && *link != conn) {
+        prev = *link;
+        link = &(*link)->buffer_wait_next;
+    }
+    if (!*link) return;
+    *link = conn->buffer_wait_next;
+    if (loop->buffer_wait_tail == conn) loop->buffer_wait_tail = prev;
+    conn->buffer_wait_next = NULL;
+}
+
+/*
+ * Ends the connection. Operations still in flight hold on to it: shutdown() makes them complete,
+   and the last completion frees it.
+ */
+static void uring_close(struct uring_loop *loop, struct connection *conn) {
+    if (!conn->closing) {
+        conn->closing = 1;
+        timer_wheel_cancel(&loop->timers, conn);
+        buffer_wait_remove(loop, conn);
+        if (conn->pending_ops > 0) shutdown(conn->fd, SHUT_RDWR);
+    }
+    if (conn->pending_ops > 0) return;
+    release_buffer(loop, conn);
+    connection_destroy(conn);
+}
+
+/*
+ * Queues the next step of the file body: a read into the connection's buffer with the send of those bytes
+   linked behind it, or the rest of a partially sent buffer.
+ * Returns 0 once the whole body is sent, 1 while operations are in flight or a buffer is awaited.
+ */
+static int send_file_chunk(struct uring_loop *loop, struct connection *conn) {
+    if (conn->chunk_sent < conn->chunk_len) {
+        struct io_uring_sqe *sqe = connection_sqe(loop, conn, OP_SEND);
+        if (!sqe) return -1;
+        int more = conn->body_remaining > 0 || conn->next_part;
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(loop->buffers + (size_t)conn->buffer_index * URING_BUFFER_SIZE + conn->chunk_sent);
+        sqe->len = conn->chunk_len - conn->chunk_sent;
+        sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+        return 1;
+    }
+    if (conn->body_remaining == 0) {
+        release_buffer(loop, conn);
+        return 0;
+    }
+
+    if (conn->buffer_index < 0) {
+        if (loop->free_count == 0) {
+            // Every buffer is busy, the next one released goes to the connection waiting longest
+            conn->buffer_wait_next = NULL;
+            if (loop->buffer_wait_tail) loop->buffer_wait_tail->buffer_wait_next = conn;
+            else loop->buffer_wait_head = conn;
+            loop->buffer_wait_tail = conn;
+            return 1;
+        }
+        conn->buffer_index = loop->free_buffers[--loop->free_count];
+    }
+
+    size_t length = conn->body_remaining < URING_BUFFER_SIZE ? (size_t)conn->body_remaining : URING_BUFFER_SIZE;
+    char *buffer = loop->buffers + (size_t)conn->buffer_index * URING_BUFFER_SIZE;
+    if (ring_reserve(&loop->ring, 2) < 0) return -1; // A link must not be split over two submissions
+    struct io_uring_sqe *read = connection_sqe(loop, conn, OP_READ);
+    if (!read) return -1;
+    read->opcode = loop->buffers_registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    read->fd = conn->file_fd;
+    read->addr = (uint64_t)(uintptr_t)buffer;
+    read->len = length;
+    read->off = conn->file_offset; // Explicit offset, the descriptor may be shared with other connections
+    if (loop->buffers_registered) read->buf_index = conn->buffer_index;
+    read->flags = IOSQE_IO_LINK; // The send below only starts once the read has filled the buffer
+
+    struct io_uring_sqe *send = connection_sqe(loop, conn, OP_SEND);
+    if (!send) return -1;
+    int more = conn->body_remaining > (off_t)length || conn->next_part;
+    send->opcode = IORING_OP_SEND;
+    send->fd = conn->fd;
+    send->addr = (uint64_t)(uintptr_t)buffer;
+    send->len = length;
+    send->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    conn->chunk_len = length; // Confirmed by the read's completion
+    conn->chunk_sent = 0;
+    return 1;
+}
+
+/*
+ * Moves the connection on until it has to wait for a completion. Only called while nothing is in flight.
+ * The request and response logic is the one the epoll backend uses, see event_loop_internal.h.
+ */
+static void uring_drive(struct uring_loop *loop, struct connection *conn) {
+    for (;;) {
+        switch (conn->state) {
+        case CONN_READ_REQUEST: {
+            long length = connection_parse(conn);
+            if (length == HTTP_PARSE_INCOMPLETE) {
+                // The keep-alive wait ends with the first byte, the whole head must follow within HEADER_TIMEOUT
+                if (conn->timer == TIMER_IDLE && conn->request_len > 0) {
+                    connection_set_timer(&loop->timers, conn, TIMER_HEADER, loop->now);
+                }
+                struct io_uring_sqe *sqe = connection_sqe(loop, conn, conn->io ? OP_RECV : OP_POLL);
+                if (!sqe) {
+                    conn->state = CONN_CLOSE;
+                    break;
+                }
+                if (!conn->io) {
+                    sqe->opcode = IORING_OP_POLL_ADD;
+                    sqe->fd = conn->fd;
+                    sqe->poll32_events = POLLIN;
+                    return;
+                }
+                sqe->opcode = IORING_OP_RECV;
+                sqe->fd = conn->fd;
+                sqe->addr = (uint64_t)(uintptr_t)(conn->io->request + conn->request_len);
+                sqe->len = sizeof(conn->io->request) - conn->request_len;
+                return;
+            }
+            connection_set_timer(&loop->timers, conn, TIMER_SEND, loop->now);
+            connection_dispatch(conn, length, loop->handler);
+            break;
+        }
+
+        case CONN_SEND_HEADERS: {
+            if (conn->iov_index == conn->iov_count) {
+                conn->state = CONN_SEND_BODY;
+                break;
+            }
+            struct io_uring_sqe *sqe = connection_sqe(loop, conn, OP_SENDMSG);
+            if (!sqe) {
+                conn->state = CONN_CLOSE;
+                break;
+            }
+            memset(&conn->message, 0, sizeof(conn->message));
+            conn->message.msg_iov = conn->iov + conn->iov_index;
+            conn->message.msg_iovlen = conn->iov_count - conn->iov_index;
+            int more = conn->body_remaining > 0 || conn->next_part;
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = conn->fd;
+            sqe->addr = (uint64_t)(uintptr_t)&conn->message;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+            return;
+        }
+
+        case CONN_SEND_BODY: {
+            int status = send_file_chunk(loop, conn);
+            if (status > 0) return;
+            if (status < 0) {
+                conn->state = CONN_CLOSE;
+                break;
+            }
+            if (conn->next_part && conn->next_part(conn, conn->release_arg)) {
+                conn->state = CONN_SEND_HEADERS;
+                break;
+            }
+            if (connection_finish_response(conn)) connection_set_timer(&loop->timers, conn, TIMER_IDLE, loop->now);
+            break;
+        }
+
+        case CONN_CLOSE:
+            uring_close(loop, conn);
+            return;
+        }
+    }
+}
+
+/*
+ * A multishot accept ends with its last completion, usually an error.
+ * Out of descriptors or memory (EMFILE, ENFILE, ENOMEM, ...) a new accept would fail again at once,
+   so it is started after a pause instead, which grows until accepting works again.
+ * An accept the socket can never serve (EINVAL, EBADF, ...) stops the loop rather than retrying forever.
+ */
+static void handle_accept(struct uring_loop *loop, struct io_uring_cqe *cqe) {
+    int ended = !(cqe->flags & IORING_CQE_F_MORE);
+    if (cqe->res < 0) {
+        if (cqe->res == -ECANCELED) return; // We cancelled it to drain
+        fprintf(stderr, "Accepting failed: %s\n", strerror(-cqe->res));
+        metrics_add(METRIC_ACCEPT_ERRORS, 1);
+        if (!ended || loop->draining) return;
+        int error = -cqe->res;
+        if (error == EINVAL || error == EBADF || error == ENOTSOCK || error == EOPNOTSUPP) {
+            loop->accept_failed = 1;
+            return;
+        }
+        arm_accept_retry(loop);
+        return;
+    }
+
+    loop->accept_retry_ms = 0;
+    if (ended && !loop->draining) arm_accept(loop); // Ended without an error, e.g. the completion queue overflowed
+
+    int slot;
+    if (!admission_admit(cqe->res, &slot)) return; // Over a connection limit, answered with a 503 and closed
+
+    struct connection *conn = connection_create(cqe->res, slot);
+    if (!conn) {
+        perror("Memory allocation failed");
+        metrics_add(METRIC_ACCEPT_ERRORS, 1);
+        admission_release(slot);
+        close(cqe->res);
+        return;
+    }
+    connection_set_timer(&loop->timers, conn, TIMER_HEADER, loop->now);
+    uring_drive(loop, conn);
+}
+
+static void handle_completion(struct uring_loop *loop, struct connection *conn, enum uring_op op, int result) {
+    conn->pending_ops--;
+    if (conn->closing) {
+        uring_close(loop, conn);
+        return;
+    }
+
+    switch (op) {
+    case OP_POLL:
+        if (result < 0 || connection_borrow_io(conn) < 0) conn->state = CONN_CLOSE;
+        break;
+    case OP_RECV:
+        if (result <= 0) conn->state = CONN_CLOSE;
+        else conn->request_len += result;
+        break;
+    case OP_SENDMSG:
+        if (result < 0) conn->state = CONN_CLOSE;
+        else connection_sent(conn, result);
+        break;
+    case OP_READ:
+        if (result <= 0) {
+            conn->state = CONN_CLOSE; // Error, or the file shrank underneath us
+        } else {
+            // A short read breaks the link, the send behind it completes with -ECANCELED and closes the connection
+            if ((size_t)result < conn->chunk_len) conn->state = CONN_CLOSE;
+            conn->file_offset += result;
+            conn->body_remaining -= result;
+        }
+        break;
+    case OP_SEND:
+        if (result < 0) {
+            conn->state = CONN_CLOSE;
+        } else {
+            conn->chunk_sent += result;
+            conn->window_sent += result;
+        }
+        break;
+    }
+
+    if (conn->pending_ops == 0) uring_drive(loop, conn);
+}
+
+// Hands freed buffers to connections waiting for one
+static void serve_buffer_waiters(struct uring_loop *loop) {
+    while (loop->free_count > 0 && loop->buffer_wait_head) {
+        struct connection *conn = loop->buffer_wait_head;
+        loop->buffer_wait_head = conn->buffer_wait_next;
+        if (!loop->buffer_wait_head) loop->buffer_wait_tail = NULL;
+        conn->buffer_wait_next = NULL;
+        uring_drive(loop, conn);
+    }
+}
+
+// Closes connections that are too slow to send a request or to read their response, or idle for too long.
+static void expire_connections(struct uring_loop *loop) {
+    struct connection *conn;
+    while ((conn = timer_wheel_expired(&loop->timers, loop->now))) {
+        // Its pending recv or send completes after shutdown() and frees it
+        if (connection_timed_out(&loop->timers, conn, loop->now)) uring_close(loop, conn);
+    }
+}
+
+static void close_idle_connection(void *arg, struct connection *conn) {
+    if (conn->request_len == 0) uring_close(arg, conn); // Nothing of a next request has arrived yet
+}
+
+// Cancels the multishot accept, clients it already accepted are still served
+static void start_draining(struct uring_loop *loop) {
+    loop->draining = 1;
+    struct io_uring_sqe *sqe = ring_get_sqe(&loop->ring);
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = USER_ACCEPT;
+        sqe->user_data = USER_CANCEL;
+    }
+    timer_wheel_each(&loop->timers, TIMER_IDLE, close_idle_connection, loop);
+}
+
+static int setup_buffers(struct uring_loop *loop) {
+    size_t size = (size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE;
+    loop->buffers = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->buffers == MAP_FAILED) {
+        perror("Allocating io_uring buffers failed");
+        loop->buffers = NULL;
+        return -1;
+    }
+    struct iovec vectors[URING_BUFFER_COUNT];
+    for (int i = 0; i < URING_BUFFER_COUNT; i++) {
+        vectors[i].iov_base = loop->buffers + (size_t)i * URING_BUFFER_SIZE;
+        vectors[i].iov_len = URING_BUFFER_SIZE;
+        loop->free_buffers[i] = i;
+    }
+    loop->free_count = URING_BUFFER_COUNT;
+    // Registering pins the pages once instead of on every read, it can fail under a low RLIMIT_MEMLOCK
+    loop->buffers_registered = sys_io_uring_register(loop->ring.fd, IORING_REGISTER_BUFFERS, vectors, URING_BUFFER_COUNT) == 0;
+    return 0;
+}
+
+int uring_loop_run(int listen_fd, request_handler handler) {
+    struct uring_loop loop;
+    memset(&loop, 0, sizeof(loop));
+    loop.listen_fd = listen_fd;
+    loop.handler = handler;
+    loop.now = event_loop_monotonic_seconds();
+    timer_wheel_init(&loop.timers, loop.now);
+
+    if (ring_init(&loop.ring) < 0) return -1;
+    if (setup_buffers(&loop) < 0) {
+        ring_unmap(&loop.ring);
+        close(loop.ring.fd);
+        return -1;
+    }
+    loop.listen_fixed = sys_io_uring_register(loop.ring.fd, IORING_REGISTER_FILES, &listen_fd, 1) == 0;
+
+    arm_accept(&loop);
+    if (!accept_supported(&loop)) {
+        ring_unmap(&loop.ring);
+        close(loop.ring.fd);
+        munmap(loop.buffers, (size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+        return -1;
+    }
+    arm_poll(&loop, event_loop_stop_fd(), USER_STOP);
+    arm_poll(&loop, event_loop_drain_fd(), USER_DRAIN);
+
+    int stop = 0;
+    while (!stop && !loop.accept_failed && !event_loop_stopping()) {
+        // Only wake up periodically while there are connections that may time out
+        struct __kernel_timespec timeout = {.tv_sec = 1};
+        if (ring_submit(&loop.ring, 1, loop.timers.count ? &timeout : NULL) < 0 && errno != EINTR && errno != ETIME &&
+            errno != EBUSY) {
+            perror("io_uring_enter failed");
+            break;
+        }
+        loop.now = event_loop_monotonic_seconds();
+
+        unsigned head = *loop.ring.cq_head;
+        while (head != __atomic_load_n(loop.ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = loop.ring.cqes[head & *loop.ring.cq_mask];
+            head++;
+            // Hand the slot back first, handling the completion may queue more work
+            __atomic_store_n(loop.ring.cq_head, head, __ATOMIC_RELEASE);
+
+            if (cqe.user_data == USER_ACCEPT) {
+                handle_accept(&loop, &cqe);
+            } else if (cqe.user_data == USER_ACCEPT_RETRY) {
+                if (!loop.draining) arm_accept(&loop);
+            } else if (cqe.user_data == USER_STOP) {
+                stop = 1;
+            } else if (cqe.user_data == USER_DRAIN || cqe.user_data == USER_CANCEL) {
+                // Draining starts below, whichever loop iteration first sees the request
+            } else {
+                struct connection *conn = (struct connection *)(uintptr_t)(cqe.user_data & ~(uint64_t)OP_MASK);
+                handle_completion(&loop, conn, (enum uring_op)(cqe.user_data & OP_MASK), cqe.res);
+            }
+            serve_buffer_waiters(&loop);
+        }
+        expire_connections(&loop);
+
+        if (event_loop_draining() && !loop.draining) start_draining(&loop);
+        if (event_loop_drained(loop.now, loop.timers.count)) break; // Every open connection sits on the wheel
+    }
+
+    // Like the epoll loop, connections still open are left to process exit
+    ring_unmap(&loop.ring);
+    close(loop.ring.fd);
+    munmap(loop.buffers, (size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    return loop.accept_failed ? -1 : 0;
+}
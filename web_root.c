@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/openat2.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "web_root.h"
+
+static int root_fd = -1;
+static int openat2_missing; // Set once the kernel answered ENOSYS, so it is not asked again
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Copies the path part of target to out with every %XX decoded. Returns its length or WEB_PATH_BAD.
+static int decode(struct http_slice target, char *out, size_t size) {
+    size_t length = 0;
+    for (size_t i = 0; i < target.len && target.data[i] != '?' && target.data[i] != '#'; i++) {
+        char c = target.data[i];
+        if (c == '%') {
+            int high = i + 2 < target.len ? hex_value(target.data[i + 1]) : -1;
+            int low = high >= 0 ? hex_value(target.data[i + 2]) : -1;
+            if (low < 0) return WEB_PATH_BAD;
+            c = (char)(high << 4 | low);
+            if (c == '\0') return WEB_PATH_BAD; // Would cut the path short for the kernel
+            i += 2;
+        }
+        if (length + 1 >= size) return WEB_PATH_BAD;
+        out[length++] = c;
+    }
+    return (int)length;
+}
+
+int web_path_normalize(struct http_slice target, const char *index, char *out, size_t size) {
+    if (target.len == 0 || target.data[0] != '/') return WEB_PATH_BAD;
+    int decoded = decode(target, out, size);
+    if (decoded < 0) return decoded;
+
+    /*
+     * Removes the dot segments in place: every segment is copied back behind the ones kept so far, which never
+       overtakes the one being read. An encoded slash (%2F) separates segments like a plain one.
+     */
+    size_t length = (size_t)decoded;
+    size_t read = 0, written = 0;
+    int directory = 0; // The path names a directory, index is appended
+    while (read < length) {
+        read++; // The '/' in front of every segment
+        size_t end = read;
+        while (end < length && out[end] != '/') end++;
+        size_t segment_len = end - read;
+        if (segment_len == 0 || (segment_len == 1 && out[read] == '.')) {
+            directory = end == length;
+        } else if (segment_len == 2 && out[read] == '.' && out[read + 1] == '.') {
+            if (written == 0) return WEB_PATH_FORBIDDEN;
+            do written--; while (out[written] != '/');
+            directory = end == length;
+        } else {
+            out[written++] = '/';
+            memmove(out + written, out + read, segment_len);
+            written += segment_len;
+            directory = 0;
+        }
+        read = end;
+    }
+
+    if (directory || written == 0) {
+        size_t index_len = index ? strlen(index) : 0;
+        if (written + 1 + index_len + 1 > size) return WEB_PATH_BAD;
+        out[written++] = '/';
+        if (index_len) memcpy(out + written, index, index_len);
+        written += index_len;
+    }
+    out[written] = '\0';
+    return (int)written;
+}
+
+int web_root_open(const char *dir) {
+    root_fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        perror(dir);
+        return -1;
+    }
+    return 0;
+}
+
+// Opens path below the root with openat2() and RESOLVE_BENEATH, or openat() on kernels without it
+static int open_beneath(const char *path, int flags) {
+    const char *relative = path + 1;
+    if (!__atomic_load_n(&openat2_missing, __ATOMIC_RELAXED)) {
+        struct open_how how = {.flags = flags, .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS};
+        int fd = (int)syscall(SYS_openat2, root_fd, relative, &how, sizeof(how));
+        if (fd >= 0 || errno != ENOSYS) return fd;
+        __atomic_store_n(&openat2_missing, 1, __ATOMIC_RELAXED);
+    }
+    return openat(root_fd, relative, flags);
+}
+
+int web_root_open_file(const char *path) {
+    // O_NONBLOCK makes no difference to regular files, but keeps a FIFO under the root from blocking the worker
+    return open_beneath(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+}
+
+int web_root_stat(const char *path, struct stat *file_stat) {
+    // fstatat() has no RESOLVE_BENEATH, an O_PATH descriptor resolves the path the same way without opening the file
+    int fd = open_beneath(path, O_PATH | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int result = fstat(fd, file_stat);
+    close(fd);
+    return result;
+}
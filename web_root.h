@@ -0,0 +1,43 @@
+#ifndef WEB_ROOT_H
+#define WEB_ROOT_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "http_parser.h"
+
+#define WEB_PATH_MAX 512 // Room for a normalized path, including its NUL
+
+enum web_path_status {
+    WEB_PATH_BAD = -1,       // Not an origin-form target, broken percent-encoding, an encoded NUL or too long: 400
+    WEB_PATH_FORBIDDEN = -2, // ".." segments that climb above the web root: 403
+};
+
+/*
+ * Turns a request target into the path of a file under the web root, without touching the filesystem:
+   the query and fragment are dropped, %XX escapes decoded, empty and "." segments removed and ".." segments
+   resolved (RFC 3986 section 5.2.4). A path ending in '/' gets index appended.
+ * The result starts with '/' and never contains a ".." segment, e.g. "/css/../a%20b.css?v=2" becomes "/a b.css".
+ * Writes the NUL-terminated path to out and returns its length, or a web_path_status.
+ */
+int web_path_normalize(struct http_slice target, const char *index, char *out, size_t size);
+
+/*
+ * Opens dir as the web root. Files are opened relative to this descriptor from then on, so the kernel only
+   walks the path below the root and a request can never leave it.
+ * Returns 0, or -1 if dir cannot be opened.
+ */
+int web_root_open(const char *dir);
+
+/*
+ * Opens a path from web_path_normalize() below the web root for reading, with openat2() and RESOLVE_BENEATH:
+   symbolic links that point outside the root fail with EXDEV. Kernels older than 5.6 fall back to openat(),
+   which still keeps ".." out but follows every symbolic link.
+ * Returns the descriptor, or -1 with errno set.
+ */
+int web_root_open_file(const char *path);
+
+// stat()s a path below the web root, resolved like web_root_open_file(). Returns 0, or -1 with errno set.
+int web_root_stat(const char *path, struct stat *file_stat);
+
+#endif
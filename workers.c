@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include "workers.h"
+
+struct worker {
+    pthread_t thread;
+    int index;
+    int listen_fd;
+    int cpu; // CPU to pin to, -1 to let the scheduler decide
+    request_handler handler;
+};
+
+int open_listener(int port, int backlog, int reuse_port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0); // Only passed on to a new binary on purpose, see handoff.h
+    if (fd < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    // SO_REUSEADDR lets a restarted server bind while old connections are still in TIME_WAIT
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("Setting SO_REUSEPORT failed");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("Binding failed");
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, backlog) < 0) {
+        perror("Listening failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static struct worker *workers;
+static int worker_count;
+static int started;
+static int running;
+static int failed; // Set when a worker's event loop could not run
+
+int open_listeners(int port, int backlog, int count, int *fds) {
+    for (int i = 0; i < count; i++) {
+        fds[i] = open_listener(port, backlog, 1);
+        if (fds[i] < 0) {
+            while (i-- > 0) close(fds[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *worker = arg;
+
+    if (worker->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "Worker %d: pinning to CPU %d failed\n", worker->index, worker->cpu);
+        }
+    }
+
+    // Nobody else accepts on this worker's listener, so a worker that cannot serve stops the server
+    if (event_loop_run(worker->listen_fd, worker->handler) < 0) {
+        __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        event_loop_stop();
+    }
+    __atomic_sub_fetch(&running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int start_workers(const int *fds, int count, int pin_cpus, request_handler handler) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+
+    workers = calloc(count, sizeof(*workers));
+    if (!workers) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    worker_count = count;
+
+    for (int i = 0; i < count; i++) {
+        workers[i].index = i;
+        workers[i].cpu = pin_cpus ? (int)(i % cpus) : -1;
+        workers[i].handler = handler;
+        workers[i].listen_fd = fds[i];
+        __atomic_add_fetch(&running, 1, __ATOMIC_RELAXED);
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("Thread creation failed");
+            __atomic_sub_fetch(&running, 1, __ATOMIC_RELAXED);
+            event_loop_stop();
+            break;
+        }
+        started++;
+    }
+    return started > 0 ? 0 : -1;
+}
+
+int workers_running(void) {
+    return __atomic_load_n(&running, __ATOMIC_ACQUIRE) > 0;
+}
+
+int wait_workers(void) {
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    free(workers);
+    workers = NULL;
+    return started == worker_count && !failed ? 0 : -1;
+}
@@ -0,0 +1,37 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include "event_loop.h"
+
+/*
+ * Creates a TCP socket listening on port on every interface.
+ * With reuse_port set, SO_REUSEPORT lets several sockets bind the same port;
+   the kernel then spreads incoming connections across them.
+ * Returns the socket descriptor, or -1 after printing the reason.
+ */
+int open_listener(int port, int backlog, int reuse_port);
+
+/*
+ * Opens count SO_REUSEPORT listeners on port into fds, one per worker.
+ * Returns 0, or -1 after closing the ones already opened, so a port that is taken fails before any worker starts.
+ */
+int open_listeners(int port, int backlog, int count, int *fds);
+
+/*
+ * Starts one worker thread per listening socket in fds and returns. Each worker runs its own event loop on its
+   own socket, so workers share no lock while accepting or serving clients.
+ * With pin_cpus set, worker i is bound to CPU i (wrapping around when there are more workers than CPUs).
+ * The sockets stay owned by the caller. Returns 0, or -1 if no thread could be started.
+ */
+int start_workers(const int *fds, int count, int pin_cpus, request_handler handler);
+
+// Returns 1 while any worker is still running its event loop.
+int workers_running(void);
+
+/*
+ * Waits until every worker has returned (see event_loop_stop() and event_loop_drain()).
+ * Returns 0 if all of them had started and run, -1 if one could not, which stops the others.
+ */
+int wait_workers(void);
+
+#endif